@@ -31,6 +31,8 @@ file_def_t::file_def_t(wxWindow* parent, model_t const& model, chr_file_t const&
     wxButton* rename_button = new wxButton(this, wxID_ANY, "Rename");
     wxButton* open_button = new wxButton(this, wxID_ANY, "Set Path");
     wxButton* delete_button = new wxButton(this, wxID_ANY, "Delete");
+    wxButton* compact_button = new wxButton(this, wxID_ANY, "Compact");
+    wxButton* duplicates_button = new wxButton(this, wxID_ANY, "Duplicates");
 
     row_sizer->Add(name_label, wxSizerFlags().Left().Border().Center());
     row_sizer->Add(name_entry, wxSizerFlags().Left().Border().Center());
@@ -42,10 +44,14 @@ file_def_t::file_def_t(wxWindow* parent, model_t const& model, chr_file_t const&
     row_sizer->AddSpacer(16);
     row_sizer->Add(open_button, wxSizerFlags().Left().Border().Center());
     row_sizer->Add(delete_button, wxSizerFlags().Left().Border().Center());
+    row_sizer->Add(compact_button, wxSizerFlags().Left().Border().Center());
+    row_sizer->Add(duplicates_button, wxSizerFlags().Left().Border().Center());
 
     rename_button->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &file_def_t::on_rename, this);
     delete_button->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &file_def_t::on_delete, this);
     open_button->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &file_def_t::on_open, this);
+    compact_button->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &file_def_t::on_compact, this);
+    duplicates_button->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &file_def_t::on_duplicates, this);
     //name_entry->Bind(wxEVT_TEXT, &file_def_t::on_name, this);
 
     SetSizerAndFit(row_sizer);
@@ -56,6 +62,16 @@ void file_def_t::on_delete(wxCommandEvent& event)
     static_cast<chr_editor_t*>(GetParent())->on_delete(index); 
 }
 
+void file_def_t::on_compact(wxCommandEvent& event)
+{ 
+    static_cast<chr_editor_t*>(GetParent())->on_compact(index); 
+}
+
+void file_def_t::on_duplicates(wxCommandEvent& event)
+{ 
+    static_cast<chr_editor_t*>(GetParent())->on_duplicates(index); 
+}
+
 void file_def_t::on_open(wxCommandEvent& event)
 { 
     wxFileDialog open_dialog(
@@ -100,6 +116,8 @@ chr_editor_t::chr_editor_t(wxWindow* parent, model_t& model)
 : wxScrolledWindow(parent)
 , model(model)
 {
+    history.journal = model.journal.get();
+
     wxBoxSizer* main_sizer = new wxBoxSizer(wxVERTICAL);
     file_sizer = new wxBoxSizer(wxVERTICAL);
 
@@ -158,9 +176,7 @@ void chr_editor_t::on_open_collision(wxCommandEvent& event)
         model.collision_path = filename;
         try
         {
-            auto bm = load_collision_file(filename);
-            model.collision_bitmaps = std::move(bm.first);
-            model.collision_wx_bitmaps = std::move(bm.second);
+            model.set_collision_bitmaps(load_collision_file(filename));
         }
         catch(...)
         {}
@@ -192,6 +208,8 @@ void chr_editor_t::on_delete(unsigned index)
     {
         file_defs.erase(file_defs.begin() + index); 
         model.chr_files.erase(model.chr_files.begin() + index); 
+        model.index_names();
+        history.clear();
         for(unsigned i = 0; i < file_defs.size(); ++i)
             file_defs[i]->index = i;
         FitInside();
@@ -208,17 +226,15 @@ void chr_editor_t::on_new(wxCommandEvent& event)
     {
         std::string new_name = dialog.GetValue().ToStdString();
 
-        for(unsigned i = 0; i < model.chr_files.size(); ++i)
+        if(model.chr_file(new_name))
         {
-            if(model.chr_files[i].name == new_name)
-            {
-                wxMessageBox( wxT("Names must be unique."), wxT("Error"), wxICON_ERROR);
-                return;
-            }
+            wxMessageBox( wxT("Names must be unique."), wxT("Error"), wxICON_ERROR);
+            return;
         }
 
         auto& file = model.chr_files.emplace_back();
         file.name = new_name;
+        model.index_names();
         new_file(file);
         FitInside();
         model.modify();
@@ -227,17 +243,16 @@ void chr_editor_t::on_new(wxCommandEvent& event)
 
 void chr_editor_t::on_rename(unsigned index, std::string str)
 {
-    for(unsigned i = 0; i < model.chr_files.size(); ++i)
+    if(auto* file = model.chr_file(str); file && file != &model.chr_files[index])
     {
-        if(i != index && model.chr_files[i].name == str)
-        {
-            wxMessageBox( wxT("Names must be unique."), wxT("Error"), wxICON_ERROR);
-            return;
-        }
+        wxMessageBox( wxT("Names must be unique."), wxT("Error"), wxICON_ERROR);
+        return;
     }
 
     std::string const old_name = model.chr_files[index].name;
     model.chr_files[index].name = str;
+    model.index_names();
+    history.clear();
 
     for(auto& mt : model.metatiles)
         if(mt->chr_name == old_name)
@@ -254,9 +269,64 @@ void chr_editor_t::on_open(unsigned index, std::string path)
 {
     model.chr_files[index].path = path;
     model.chr_files[index].load();
+    history.clear();
     model.modify();
 }
 
+void chr_editor_t::on_compact(unsigned index)
+{
+    chr_file_t& file = model.chr_files[index];
+    if(!file.on_disk())
+    {
+        wxMessageBox("Compacting reorders the tiles of the file on disk, so open one first.", 
+                     "Compact", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+
+    auto const usage = model.chr_usage();
+    auto it = usage.find(file.name);
+    if(it == usage.end())
+        return;
+
+    tile_lut_t const lut = compact_lut(it->second);
+    if(lut != identity_lut())
+        history.push(model.permute_chr(file, lut));
+}
+
+void chr_editor_t::on_duplicates(unsigned index)
+{
+    chr_file_t& file = model.chr_files[index];
+    auto const groups = chr_duplicates(file.chr.data(), file.chr.size());
+    if(groups.empty())
+    {
+        wxMessageBox("No tile matches another.", "Duplicates", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+
+    // One line per group, up to a screenful. Flips are listed as the sprite attribute bits they need.
+    constexpr unsigned max_lines = 24;
+    wxString report;
+    for(unsigned i = 0; i < groups.size() && i < max_lines; ++i)
+    {
+        for(chr_duplicate_t const& dup : groups[i])
+        {
+            report << wxString::Format(" $%02X", dup.tile);
+            if(dup.flip)
+                report << wxString::Format(" ($%02X)", dup.flip);
+        }
+        report << "\n";
+    }
+    if(groups.size() > max_lines)
+        report << wxString::Format("...and %u more.\n", unsigned(groups.size() - max_lines));
+
+    if(wxMessageBox("Matching tiles, with the flips needed to draw them from the first:\n\n" + report 
+                    + "\nPoint the metatiles at the first of each set of unflipped copies?",
+                    "Duplicates", wxYES_NO | wxICON_QUESTION, this) == wxYES)
+    {
+        history.push(model.merge_duplicate_chr(file));
+    }
+}
+
 void chr_editor_t::new_file(chr_file_t const& file)
 {
     auto* def = new file_def_t(this, model, file, file_defs.size());
@@ -266,6 +336,7 @@ void chr_editor_t::new_file(chr_file_t const& file)
 
 void chr_editor_t::load()
 {
+    history.clear();
     file_defs.clear();
     for(auto const& file : model.chr_files)
         new_file(file);
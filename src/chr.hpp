@@ -28,6 +28,8 @@ public:
     void on_open(wxCommandEvent& event);
     void on_delete(wxCommandEvent& event);
     void on_rename(wxCommandEvent& event);
+    void on_compact(wxCommandEvent& event);
+    void on_duplicates(wxCommandEvent& event);
 
     unsigned index = 0;
 private:
@@ -42,10 +44,18 @@ class chr_editor_t : public wxScrolledWindow
 public:
     chr_editor_t(wxWindow* parent, model_t& model);
 
+    // Holds tile reorders and merges. Cleared when a CHR file is renamed, deleted or reloaded,
+    // as reorder records find their file by name and reorder what's in memory.
+    undo_history_t history;
+
     void on_delete(unsigned index);
     void on_new(wxCommandEvent& event);
     void on_rename(unsigned index, std::string str);
     void on_open(unsigned index, std::string path);
+    // Moves the tiles the metatile sets use to the front, freeing the tail of the file.
+    void on_compact(unsigned index);
+    // Reports tiles matching others, flipped or not, and offers to merge the unflipped ones.
+    void on_duplicates(unsigned index);
     void on_open_collision(wxCommandEvent& event);
 
     void load();
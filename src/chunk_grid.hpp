@@ -0,0 +1,253 @@
+#ifndef CHUNK_GRID_HPP
+#define CHUNK_GRID_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "2d/geometry.hpp"
+
+using namespace i2d;
+
+// A grid stored as square chunks behind shared pointers, copy-on-write.
+// Copying one only copies the chunk pointers, and writing clones just the chunk written to,
+// so snapshots of a layer cost O(chunks) no matter how much of it is later edited.
+// The interface follows grid_t. Non-const access detaches the chunk it lands in,
+// so read-only code should go through a const reference.
+template<typename T, int ChunkShift = 4>
+class chunk_grid_t
+{
+public:
+    static constexpr int CHUNK_SIZE = 1 << ChunkShift;
+    static constexpr int CHUNK_MASK = CHUNK_SIZE - 1;
+
+    using value_type = T;
+    using chunk_t = std::array<T, CHUNK_SIZE * CHUNK_SIZE>;
+
+    template<typename Grid, typename Ref>
+    class basic_iterator
+    {
+    friend class chunk_grid_t;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::remove_reference_t<Ref>*;
+        using reference = Ref;
+
+        basic_iterator() = default;
+
+        reference operator*() const { return m_grid->chunk_at(m_at)[index(m_at)]; }
+        pointer operator->() const { return &**this; }
+
+        basic_iterator& operator++()
+        {
+            if(++m_at.x == m_grid->m_dimen.w)
+            {
+                m_at.x = 0;
+                ++m_at.y;
+            }
+            return *this;
+        }
+        basic_iterator operator++(int) { basic_iterator ret = *this; ++*this; return ret; }
+
+        bool operator==(basic_iterator const& o) const { return m_at.x == o.m_at.x && m_at.y == o.m_at.y; }
+
+    private:
+        basic_iterator(Grid* grid, coord_t at) : m_grid(grid), m_at(at) {}
+
+        Grid* m_grid = nullptr;
+        coord_t m_at = {};
+    };
+
+    using iterator = basic_iterator<chunk_grid_t, T&>;
+    using const_iterator = basic_iterator<chunk_grid_t const, T const&>;
+
+    chunk_grid_t() = default;
+    explicit chunk_grid_t(dimen_t dimen) { resize(dimen); }
+
+    dimen_t dimen() const { return m_dimen; }
+    std::size_t size() const { return std::size_t(m_dimen.w) * m_dimen.h; }
+
+    // Bumped by every non-const access, so caches derived from the contents can tell they're stale.
+    std::uint64_t revision() const { return m_revision; }
+
+    // The number of chunks and how many of them are not shared with another grid.
+    std::size_t num_chunks() const { return m_chunks.size(); }
+    std::size_t num_unique_chunks() const
+    {
+        return std::count_if(m_chunks.begin(), m_chunks.end(), [](auto const& chunk) { return chunk.use_count() == 1; });
+    }
+
+    // Keeps the overlapping area; new cells are value-initialized.
+    void resize(dimen_t dimen)
+    {
+        assert(dimen.w >= 0 && dimen.h >= 0);
+
+        dimen_t const old_dimen = m_dimen;
+        dimen_t const old_chunks = m_chunks_dimen;
+        dimen_t const new_chunks = { (dimen.w + CHUNK_MASK) >> ChunkShift, (dimen.h + CHUNK_MASK) >> ChunkShift };
+
+        std::vector<std::shared_ptr<chunk_t>> chunks(new_chunks.w * new_chunks.h);
+        std::shared_ptr<chunk_t> blank;
+
+        for(int cy = 0; cy < new_chunks.h; ++cy)
+        for(int cx = 0; cx < new_chunks.w; ++cx)
+        {
+            auto& chunk = chunks[cy * new_chunks.w + cx];
+
+            if(cx >= old_chunks.w || cy >= old_chunks.h)
+            {
+                if(!blank)
+                    blank = std::make_shared<chunk_t>();
+                chunk = blank;
+                continue;
+            }
+
+            chunk = std::move(m_chunks[cy * old_chunks.w + cx]);
+
+            // Cells of an edge chunk that lay outside the old dimen hold stale values
+            // and come into view if the grid grows past them.
+            int const keep_w = std::min(old_dimen.w - (cx << ChunkShift), CHUNK_SIZE);
+            int const keep_h = std::min(old_dimen.h - (cy << ChunkShift), CHUNK_SIZE);
+            int const show_w = std::min(dimen.w - (cx << ChunkShift), CHUNK_SIZE);
+            int const show_h = std::min(dimen.h - (cy << ChunkShift), CHUNK_SIZE);
+
+            if(show_w <= keep_w && show_h <= keep_h)
+                continue;
+
+            T* data = detach(chunk).data();
+            for(int y = 0; y < show_h; ++y)
+            {
+                T* row = data + y * CHUNK_SIZE;
+                std::fill(row + (y < keep_h ? std::min(keep_w, show_w) : 0), row + show_w, T{});
+            }
+        }
+
+        m_chunks = std::move(chunks);
+        m_chunks_dimen = new_chunks;
+        m_dimen = dimen;
+        ++m_revision;
+    }
+
+    // Every chunk ends up sharing one filled chunk.
+    void fill(T const& value)
+    {
+        if(m_chunks.empty())
+            return;
+        auto chunk = std::make_shared<chunk_t>();
+        chunk->fill(value);
+        std::fill(m_chunks.begin(), m_chunks.end(), chunk);
+        ++m_revision;
+    }
+
+    // Copies every chunk shared with another grid, or within this one.
+    // Writes check sharing through use_count(), which isn't safe while other threads write to grids
+    // sharing the same chunks, so call this on one thread before handing such grids out.
+    void detach_all()
+    {
+        for(auto& chunk : m_chunks)
+            detach(chunk);
+    }
+
+    T const& operator[](coord_t c) const { return chunk_at(c)[index(c)]; }
+    T& operator[](coord_t c) { return chunk_at(c)[index(c)]; }
+
+    T const& at(coord_t c) const { check(c); return (*this)[c]; }
+    T& at(coord_t c) { check(c); return (*this)[c]; }
+
+    // Calls 'fn(coord_t at, T const* values, int n)' with each row of 'rect' split at chunk edges,
+    // in row-major order. 'rect' must lie within dimen().
+    template<typename Fn>
+    void for_each_span(rect_t rect, Fn const& fn) const
+    {
+        for_each_span_impl(*this, rect, fn);
+    }
+
+    // Likewise, passing 'T* values' and detaching each chunk it touches.
+    template<typename Fn>
+    void for_each_span(rect_t rect, Fn const& fn)
+    {
+        for_each_span_impl(*this, rect, fn);
+    }
+
+    const_iterator begin() const { return const_iterator(this, first()); }
+    const_iterator end() const { return const_iterator(this, { 0, m_dimen.h }); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // Mutable iteration detaches every chunk up front.
+    iterator begin()
+    {
+        for(auto& chunk : m_chunks)
+            detach(chunk);
+        ++m_revision;
+        return iterator(this, first());
+    }
+    iterator end() { return iterator(this, { 0, m_dimen.h }); }
+
+    bool operator==(chunk_grid_t const& o) const
+    {
+        if(m_dimen != o.m_dimen)
+            return false;
+        return std::equal(begin(), end(), o.begin());
+    }
+
+private:
+    dimen_t m_dimen = {};
+    dimen_t m_chunks_dimen = {};
+    std::vector<std::shared_ptr<chunk_t>> m_chunks; // Row-major.
+    std::uint64_t m_revision = 0;
+
+    static int index(coord_t c) { return ((c.y & CHUNK_MASK) << ChunkShift) | (c.x & CHUNK_MASK); }
+
+    coord_t first() const { return { 0, (m_dimen.w && m_dimen.h) ? 0 : m_dimen.h }; }
+
+    std::shared_ptr<chunk_t> const& chunk_ptr(coord_t c) const
+    {
+        assert(in_bounds(c, m_dimen));
+        return m_chunks[(c.y >> ChunkShift) * m_chunks_dimen.w + (c.x >> ChunkShift)];
+    }
+
+    chunk_t const& chunk_at(coord_t c) const { return *chunk_ptr(c); }
+    chunk_t& chunk_at(coord_t c) 
+    { 
+        ++m_revision;
+        return detach(const_cast<std::shared_ptr<chunk_t>&>(chunk_ptr(c))); 
+    }
+
+    static chunk_t& detach(std::shared_ptr<chunk_t>& chunk)
+    {
+        if(chunk.use_count() > 1)
+            chunk = std::make_shared<chunk_t>(*chunk);
+        return *chunk;
+    }
+
+    void check(coord_t c) const
+    {
+        if(!in_bounds(c, m_dimen))
+            throw std::out_of_range("chunk_grid_t coordinate out of range.");
+    }
+
+    template<typename Self, typename Fn>
+    static void for_each_span_impl(Self& self, rect_t rect, Fn const& fn)
+    {
+        assert(!rect || (in_bounds(rect.c, self.m_dimen) && in_bounds(rect.e() - coord_t{ 1, 1 }, self.m_dimen)));
+
+        for(int y = rect.c.y; y < rect.e().y; ++y)
+        for(int x = rect.c.x; x < rect.e().x;)
+        {
+            int const n = std::min(rect.e().x, (x | CHUNK_MASK) + 1) - x;
+            fn(coord_t{ x, y }, &self.chunk_at({ x, y })[index({ x, y })], n);
+            x += n;
+        }
+    }
+};
+
+#endif
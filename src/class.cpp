@@ -150,7 +150,7 @@ void class_editor_t::on_new(wxCommandEvent& event)
             }
         }
 
-        auto& field = oc->fields.emplace_back();
+        auto& field = oc->new_field();
         field.name = new_name;
         new_field<true>(field);
         FitInside();
@@ -175,22 +175,8 @@ void class_editor_t::on_rename(unsigned index, std::string str)
         }
     }
 
-    std::string const old_name = oc->fields[index].name;
+    // Objects store their fields by slot, so they don't need updating:
     oc->fields[index].name = str;
-
-    for(auto& level : model.levels)
-    {
-        for(auto& object : level->objects)
-        {
-            if(object.oclass == oc->name)
-            {
-                auto it = object.fields.find(old_name);
-                if(it != object.fields.end())
-                    object.fields[str] = it->second;
-            }
-        }
-    }
-
     model.modify();
 }
 
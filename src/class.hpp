@@ -70,12 +70,10 @@ struct class_policy_t
     static constexpr char const* name = "Object Class";
     static auto& collection(model_t& m) { return m.object_classes; }
     static void on_page_changing(page_type& page, object_type& object) {}
+    static void on_collection_change(model_t& m) { m.index_classes(); }
     static void rename(model_t& m, std::string const& old_name, std::string const& new_name)
     {
-        for(auto& level : m.levels)
-            for(auto& object : level->objects)
-                if(object.oclass == old_name)
-                    object.oclass = new_name;
+        m.rename_class(old_name, new_name);
     }
 };
 
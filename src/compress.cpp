@@ -0,0 +1,1144 @@
+#include "compress.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "model.hpp"
+#include "parallel.hpp"
+
+// Rough 6502 cycle costs, for a decoder writing through an indirect pointer:
+static constexpr std::size_t CYCLES_PACKET = 40;  // Reading a header byte and branching on it.
+static constexpr std::size_t CYCLES_LITERAL = 14; // Per byte: lda (src),y / sta (dst),y, plus pointer upkeep.
+static constexpr std::size_t CYCLES_RUN = 9;      // Per byte: sta (dst),y, plus the loop.
+static constexpr std::size_t CYCLES_MATCH = 30;   // Reading the distance and pointing into the window, on top of CYCLES_PACKET.
+static constexpr std::size_t CYCLES_COPY = 16;    // Per byte: lda (window),y / sta (dst),y, plus the loop.
+static constexpr std::size_t CYCLES_DELTA = 10;   // Per byte: clc / adc with the previous column.
+
+char const* codec_name(codec_t codec)
+{
+    switch(codec)
+    {
+    case CODEC_RAW: return "Raw";
+    case CODEC_RLE: return "RLE";
+    case CODEC_LZ77: return "LZ77";
+    case CODEC_COLUMN_DELTA: return "Column Delta";
+    default: return "?";
+    }
+}
+
+namespace
+{
+    class reader_t
+    {
+    public:
+        reader_t(std::uint8_t const* data, std::size_t size) : m_data(data), m_size(size) {}
+
+        std::uint8_t get()
+        {
+            if(m_pos >= m_size)
+                throw std::runtime_error("Compressed data ends early.");
+            return m_data[m_pos++];
+        }
+
+        bool done() const { return m_pos == m_size; }
+
+    private:
+        std::uint8_t const* m_data;
+        std::size_t m_size;
+        std::size_t m_pos = 0;
+    };
+
+    // Splits literals into packets of up to 128 bytes.
+    void put_literals(std::vector<std::uint8_t>& out, std::uint8_t const* begin, std::uint8_t const* end)
+    {
+        while(begin < end)
+        {
+            std::size_t const n = std::min<std::size_t>(end - begin, 128);
+            out.push_back(n - 1);
+            out.insert(out.end(), begin, begin + n);
+            begin += n;
+        }
+    }
+
+    void rle_encode(std::vector<std::uint8_t>& out, std::uint8_t const* in, std::size_t size)
+    {
+        constexpr std::size_t MAX_RUN = 0x7F + 2;
+
+        std::size_t literal = 0; // Where the literals not yet written start.
+        for(std::size_t i = 0; i < size;)
+        {
+            std::size_t run = 1;
+            while(i + run < size && run < MAX_RUN && in[i + run] == in[i])
+                ++run;
+
+            // A run of 2 only pays off when it doesn't split up literals.
+            if(run >= 3 || (run == 2 && literal == i))
+            {
+                put_literals(out, in + literal, in + i);
+                out.push_back(0x80 + run - 2);
+                out.push_back(in[i]);
+                literal = i + run;
+            }
+            i += run;
+        }
+        put_literals(out, in + literal, in + size);
+    }
+
+    void rle_decode(std::vector<std::uint8_t>& out, reader_t& in, std::size_t size, std::size_t& cycles)
+    {
+        while(out.size() < size)
+        {
+            unsigned const header = in.get();
+            cycles += CYCLES_PACKET;
+            if(header < 0x80)
+            {
+                if(out.size() + header + 1 > size)
+                    throw std::runtime_error("Compressed data runs past the end of the level.");
+                for(unsigned i = 0; i <= header; ++i)
+                    out.push_back(in.get());
+                cycles += (header + 1) * CYCLES_LITERAL;
+            }
+            else
+            {
+                unsigned const n = header - 0x80 + 2;
+                if(out.size() + n > size)
+                    throw std::runtime_error("Compressed data runs past the end of the level.");
+                out.insert(out.end(), n, in.get());
+                cycles += n * CYCLES_RUN;
+            }
+        }
+    }
+
+    std::vector<std::uint8_t> lz77_encode(std::uint8_t const* in, std::size_t size)
+    {
+        constexpr std::size_t WINDOW = 256;
+        constexpr std::size_t MIN_MATCH = 3;
+        constexpr std::size_t MAX_MATCH = 0x7F + MIN_MATCH;
+        constexpr unsigned HASH_BITS = 12;
+
+        // Earlier positions with the same 3-byte hash, newest first:
+        std::vector<int> head(1 << HASH_BITS, -1);
+        std::vector<int> prev(size, -1);
+        auto const hash = [&](std::size_t i)
+        {
+            std::uint32_t const key = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+            return (key * 2654435761u) >> (32 - HASH_BITS);
+        };
+        auto const insert = [&](std::size_t i)
+        {
+            if(i + MIN_MATCH > size)
+                return;
+            auto& h = head[hash(i)];
+            prev[i] = h;
+            h = i;
+        };
+
+        std::vector<std::uint8_t> out;
+        std::size_t literal = 0; // Where the literals not yet written start.
+        for(std::size_t i = 0; i < size;)
+        {
+            std::size_t best_len = 0;
+            std::size_t best_dist = 0;
+            if(i + MIN_MATCH <= size)
+            {
+                std::size_t const max_len = std::min(MAX_MATCH, size - i);
+                for(int c = head[hash(i)]; c >= 0 && i - c <= WINDOW; c = prev[c])
+                {
+                    std::size_t len = 0;
+                    while(len < max_len && in[c + len] == in[i + len])
+                        ++len;
+                    if(len > best_len)
+                    {
+                        best_len = len;
+                        best_dist = i - c;
+                        if(len == max_len)
+                            break;
+                    }
+                }
+            }
+
+            if(best_len >= MIN_MATCH)
+            {
+                put_literals(out, in + literal, in + i);
+                out.push_back(0x80 + best_len - MIN_MATCH);
+                out.push_back(best_dist - 1);
+                for(std::size_t j = 0; j < best_len; ++j)
+                    insert(i + j);
+                i += best_len;
+                literal = i;
+            }
+            else
+                insert(i++);
+        }
+        put_literals(out, in + literal, in + size);
+
+        return out;
+    }
+
+    void lz77_decode(std::vector<std::uint8_t>& out, reader_t& in, std::size_t size, std::size_t& cycles)
+    {
+        while(out.size() < size)
+        {
+            unsigned const header = in.get();
+            cycles += CYCLES_PACKET;
+            if(header < 0x80)
+            {
+                if(out.size() + header + 1 > size)
+                    throw std::runtime_error("Compressed data runs past the end of the level.");
+                for(unsigned i = 0; i <= header; ++i)
+                    out.push_back(in.get());
+                cycles += (header + 1) * CYCLES_LITERAL;
+            }
+            else
+            {
+                std::size_t const n = header - 0x80 + 3;
+                std::size_t const dist = in.get() + 1;
+                if(dist > out.size())
+                    throw std::runtime_error("Compressed data refers back before the start of the level.");
+                if(out.size() + n > size)
+                    throw std::runtime_error("Compressed data runs past the end of the level.");
+                // One byte at a time, as copies can overlap what they write.
+                for(std::size_t i = 0; i < n; ++i)
+                {
+                    std::uint8_t const byte = out[out.size() - dist];
+                    out.push_back(byte);
+                }
+                cycles += CYCLES_MATCH + n * CYCLES_COPY;
+            }
+        }
+    }
+
+    void write_bytes(std::filesystem::path const& path, std::vector<std::uint8_t> const& bytes)
+    {
+        FILE* fp = std::fopen(path.string().c_str(), "wb");
+        if(!fp)
+            throw std::runtime_error("Unable to write " + path.string());
+        bool const written = bytes.empty() || std::fwrite(bytes.data(), bytes.size(), 1, fp) == 1;
+        if(std::fclose(fp) != 0 || !written)
+            throw std::runtime_error("Unable to write " + path.string());
+    }
+
+    std::vector<std::uint8_t> read_bytes(std::filesystem::path const& path)
+    {
+        FILE* fp = std::fopen(path.string().c_str(), "rb");
+        if(!fp)
+            throw std::runtime_error("Unable to read " + path.string());
+        std::vector<std::uint8_t> bytes;
+        std::uint8_t buffer[4096];
+        while(std::size_t const n = std::fread(buffer, 1, sizeof(buffer), fp))
+            bytes.insert(bytes.end(), buffer, buffer + n);
+        bool const failed = std::ferror(fp);
+        std::fclose(fp);
+        if(failed)
+            throw std::runtime_error("Unable to read " + path.string());
+        return bytes;
+    }
+}
+
+std::vector<std::uint8_t> encode_tiles(codec_t codec, std::uint8_t const* tiles, dimen_t dimen)
+{
+    std::size_t const size = std::size_t(dimen.w) * dimen.h;
+    std::vector<std::uint8_t> out;
+
+    switch(codec)
+    {
+    case CODEC_RAW:
+        out.assign(tiles, tiles + size);
+        break;
+
+    case CODEC_RLE:
+        rle_encode(out, tiles, size);
+        break;
+
+    case CODEC_LZ77:
+        out = lz77_encode(tiles, size);
+        break;
+
+    case CODEC_COLUMN_DELTA:
+        {
+            std::vector<std::uint8_t> deltas;
+            deltas.reserve(size);
+            for(int x = 0; x < dimen.w; ++x)
+            for(int y = 0; y < dimen.h; ++y)
+            {
+                std::uint8_t const* row = tiles + y * dimen.w;
+                deltas.push_back(row[x] - (x ? row[x-1] : 0));
+            }
+            rle_encode(out, deltas.data(), deltas.size());
+        }
+        break;
+
+    default:
+        throw std::runtime_error("Unknown codec.");
+    }
+
+    return out;
+}
+
+std::vector<std::uint8_t> decode_tiles(codec_t codec, std::uint8_t const* data, std::size_t size, dimen_t dimen,
+                                       std::size_t* cycles)
+{
+    std::size_t const tiles = std::size_t(dimen.w) * dimen.h;
+    std::vector<std::uint8_t> out;
+    out.reserve(tiles);
+    reader_t in(data, size);
+    std::size_t count = 0;
+
+    switch(codec)
+    {
+    case CODEC_RAW:
+        for(std::size_t i = 0; i < tiles; ++i)
+            out.push_back(in.get());
+        count += tiles * CYCLES_LITERAL;
+        break;
+
+    case CODEC_RLE:
+        rle_decode(out, in, tiles, count);
+        break;
+
+    case CODEC_LZ77:
+        lz77_decode(out, in, tiles, count);
+        break;
+
+    case CODEC_COLUMN_DELTA:
+        {
+            std::vector<std::uint8_t> deltas;
+            deltas.reserve(tiles);
+            rle_decode(deltas, in, tiles, count);
+            out.resize(tiles);
+            for(int x = 0; x < dimen.w; ++x)
+            for(int y = 0; y < dimen.h; ++y)
+            {
+                std::uint8_t* row = out.data() + y * dimen.w;
+                row[x] = deltas[x * dimen.h + y] + (x ? row[x-1] : 0);
+            }
+            count += tiles * CYCLES_DELTA;
+        }
+        break;
+
+    default:
+        throw std::runtime_error("Unknown codec.");
+    }
+
+    if(!in.done())
+        throw std::runtime_error("Compressed data continues past the end of the level.");
+    if(cycles)
+        *cycles = count;
+    return out;
+}
+
+compressed_level_t compress_level(level_model_t const& level)
+{
+    auto const& grid = level.metatile_layer.tiles;
+    std::vector<std::uint8_t> const tiles(grid.begin(), grid.end());
+
+    compressed_level_t out;
+    out.name = level.name;
+    out.dimen = grid.dimen();
+
+    for(unsigned c = 0; c < NUM_CODECS; ++c)
+    {
+        codec_t const codec = codec_t(c);
+        std::vector<std::uint8_t> data = encode_tiles(codec, tiles.data(), out.dimen);
+        std::size_t cycles;
+        std::vector<std::uint8_t> const decoded = decode_tiles(codec, data.data(), data.size(), out.dimen, &cycles);
+        assert(decoded == tiles);
+        out.results[c] = { data.size(), cycles };
+
+        if(c > 0)
+        {
+            auto const& best = out.results[out.best];
+            if(data.size() > best.size || (data.size() == best.size && cycles >= best.cycles))
+                continue;
+        }
+        out.best = codec;
+        out.data = std::move(data);
+    }
+    return out;
+}
+
+std::vector<compressed_level_t> compress_levels(model_t const& model)
+{
+    std::vector<compressed_level_t> ret(model.levels.size());
+    parallel_for(model.levels.size(), [&](std::size_t i)
+    {
+        ret[i] = compress_level(*model.levels[i]);
+    });
+    return ret;
+}
+
+void write_compressed_levels(std::vector<compressed_level_t> const& levels, std::filesystem::path const& dir)
+{
+    for(compressed_level_t const& level : levels)
+    {
+        std::vector<std::uint8_t> bytes =
+        {
+            level.best,
+            std::uint8_t(level.dimen.w), std::uint8_t(level.dimen.w >> 8),
+            std::uint8_t(level.dimen.h), std::uint8_t(level.dimen.h >> 8),
+        };
+        bytes.insert(bytes.end(), level.data.begin(), level.data.end());
+
+        write_bytes(dir / (level.name + ".bin"), bytes);
+    }
+}
+
+std::string compression_report(std::vector<compressed_level_t> const& levels)
+{
+    std::ostringstream ss;
+    ss << std::left << std::setw(20) << "Level" << std::right << " " << std::setw(8) << "Tiles";
+    for(unsigned c = 0; c < NUM_CODECS; ++c)
+        ss << " " << std::setw(25) << codec_name(codec_t(c));
+    ss << "  Best\n";
+
+    std::array<compressed_level_t::result_t, NUM_CODECS> totals = {};
+    std::size_t total_tiles = 0;
+    std::size_t total_best = 0;
+    auto const row = [&](std::string const& name, std::size_t tiles, auto const& results, std::string const& best)
+    {
+        ss << std::left << std::setw(20) << name << std::right << " " << std::setw(8) << tiles;
+        for(auto const& result : results)
+        {
+            std::ostringstream cell;
+            cell << result.size << " B / " << result.cycles << " cy";
+            ss << " " << std::setw(25) << cell.str();
+        }
+        ss << "  " << best << "\n";
+    };
+
+    for(compressed_level_t const& level : levels)
+    {
+        std::size_t const tiles = std::size_t(level.dimen.w) * level.dimen.h;
+        row(level.name, tiles, level.results, codec_name(level.best));
+
+        total_tiles += tiles;
+        total_best += level.data.size();
+        for(unsigned c = 0; c < NUM_CODECS; ++c)
+        {
+            totals[c].size += level.results[c].size;
+            totals[c].cycles += level.results[c].cycles;
+        }
+    }
+
+    row("Total", total_tiles, totals, std::to_string(total_best) + " B");
+    ss << "\nCycles are rough estimates for a 6502 decoder.\n";
+    return ss.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// column streams //////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// As the level editor draws its grid.
+static unsigned screen_width(model_t const& model)
+{
+    return model.level_grid_x ? model.level_grid_x : 16;
+}
+
+static void put16(std::uint8_t* out, std::size_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put32(std::uint8_t* out, std::size_t value)
+{
+    put16(out, value);
+    put16(out + 2, value >> 16);
+}
+
+static unsigned get16(std::uint8_t const* in) { return in[0] | (in[1] << 8); }
+static std::size_t get32(std::uint8_t const* in) { return get16(in) | (std::size_t(get16(in + 2)) << 16); }
+
+static constexpr std::size_t COLUMN_HEADER_SIZE = 7;
+
+std::vector<column_level_t> encode_column_levels(model_t const& model, bool rle)
+{
+    unsigned const screen_w = screen_width(model);
+
+    std::vector<column_level_t> ret(model.levels.size());
+    parallel_for(model.levels.size(), [&](std::size_t i)
+    {
+        level_model_t const& level = *model.levels[i];
+        auto const& grid = level.metatile_layer.tiles;
+        dimen_t const dimen = grid.dimen();
+        std::size_t const screens = (dimen.w + screen_w - 1) / screen_w;
+
+        ret[i].name = level.name;
+        std::vector<std::uint8_t>& out = ret[i].bytes;
+
+        // The tables are filled in as the columns are appended after them.
+        std::size_t const screen_table = COLUMN_HEADER_SIZE;
+        std::size_t const column_table = screen_table + screens * 4;
+        std::size_t const data = column_table + dimen.w * 2;
+        out.reserve(data + (rle ? 0 : std::size_t(dimen.w) * dimen.h));
+        out.resize(data);
+        out[0] = rle ? COLUMNS_RLE : 0;
+        put16(&out[1], dimen.w);
+        put16(&out[3], dimen.h);
+        put16(&out[5], screen_w);
+
+        std::vector<std::uint8_t> column(dimen.h);
+        std::size_t screen_start = data;
+        for(int x = 0; x < dimen.w; ++x)
+        {
+            if(x % screen_w == 0)
+            {
+                screen_start = out.size();
+                put32(&out[screen_table + x / screen_w * 4], screen_start - data);
+            }
+
+            std::size_t const offset = out.size() - screen_start;
+            if(offset > 0xFFFF)
+                throw std::runtime_error("Level " + level.name + " has a screen too large for 16-bit column offsets.");
+            put16(&out[column_table + x * 2], offset);
+
+            for(int y = 0; y < dimen.h; ++y)
+                column[y] = grid[{ x, y }];
+            if(rle)
+                rle_encode(out, column.data(), column.size());
+            else
+                out.insert(out.end(), column.begin(), column.end());
+        }
+    });
+    return ret;
+}
+
+decoded_columns_t decode_column_level(std::uint8_t const* data, std::size_t size)
+{
+    if(size < COLUMN_HEADER_SIZE)
+        throw std::runtime_error("Column stream ends early.");
+
+    unsigned const flags = data[0];
+    if(flags & ~COLUMNS_RLE)
+        throw std::runtime_error("Unknown column stream flags.");
+
+    decoded_columns_t ret;
+    ret.dimen = { get16(data + 1), get16(data + 3) };
+    ret.screen_width = get16(data + 5);
+    if(!ret.screen_width)
+        throw std::runtime_error("Column stream has screens 0 columns wide.");
+
+    std::size_t const w = ret.dimen.w;
+    std::size_t const h = ret.dimen.h;
+    std::size_t const screens = (w + ret.screen_width - 1) / ret.screen_width;
+    std::size_t const screen_table = COLUMN_HEADER_SIZE;
+    std::size_t const column_table = screen_table + screens * 4;
+    std::size_t const column_data = column_table + w * 2;
+    if(column_data > size)
+        throw std::runtime_error("Column stream ends early.");
+
+    auto const column_start = [&](std::size_t x) -> std::size_t
+    {
+        if(x == w)
+            return size;
+        return column_data + get32(data + screen_table + x / ret.screen_width * 4) + get16(data + column_table + x * 2);
+    };
+
+    ret.tiles.resize(w * h);
+    std::vector<std::uint8_t> column;
+    column.reserve(h);
+    for(std::size_t x = 0; x < w; ++x)
+    {
+        // Each column has to end exactly where the next one starts.
+        std::size_t const begin = column_start(x);
+        std::size_t const end = column_start(x + 1);
+        if(begin > end || end > size)
+            throw std::runtime_error("Column " + std::to_string(x) + " has a bad offset.");
+
+        reader_t in(data + begin, end - begin);
+        column.clear();
+        if(flags & COLUMNS_RLE)
+        {
+            std::size_t cycles = 0;
+            rle_decode(column, in, h, cycles);
+        }
+        else
+        {
+            for(std::size_t y = 0; y < h; ++y)
+                column.push_back(in.get());
+        }
+        if(!in.done())
+            throw std::runtime_error("Column " + std::to_string(x) + " runs into the next.");
+
+        for(std::size_t y = 0; y < h; ++y)
+            ret.tiles[y * w + x] = column[y];
+    }
+
+    return ret;
+}
+
+void write_column_levels(std::vector<column_level_t> const& levels, std::filesystem::path const& dir)
+{
+    for(column_level_t const& level : levels)
+        write_bytes(dir / (level.name + ".col"), level.bytes);
+}
+
+void validate_column_levels(model_t const& model, std::filesystem::path const& dir)
+{
+    for(auto const& level : model.levels)
+    {
+        std::filesystem::path const path = dir / (level->name + ".col");
+        std::vector<std::uint8_t> const bytes = read_bytes(path);
+
+        decoded_columns_t decoded;
+        try
+        {
+            decoded = decode_column_level(bytes.data(), bytes.size());
+        }
+        catch(std::exception const& e)
+        {
+            throw std::runtime_error(path.string() + ": " + e.what());
+        }
+
+        if(decoded.dimen != level->dimen())
+            throw std::runtime_error(path.string() + " doesn't match the dimensions of level " + level->name + ".");
+        if(decoded.screen_width != screen_width(model))
+            throw std::runtime_error(path.string() + " doesn't match the level grid.");
+
+        auto const& grid = level->metatile_layer.tiles;
+        auto it = grid.begin();
+        for(std::size_t i = 0; i < decoded.tiles.size(); ++i, ++it)
+        {
+            if(decoded.tiles[i] != *it)
+            {
+                throw std::runtime_error(path.string() + " doesn't match level " + level->name + " at column "
+                                         + std::to_string(i % decoded.dimen.w) + ", row " + std::to_string(i / decoded.dimen.w) + ".");
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// shared dictionaries /////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    constexpr std::size_t MIN_COPY = 3;
+    constexpr std::size_t MAX_COPY = 0x3F + MIN_COPY;
+    constexpr unsigned COPY_HASH_BITS = 12;
+    // Dictionaries are full of similar runs, so their chains are cut short.
+    constexpr unsigned MAX_DICTIONARY_CHAIN = 64;
+
+    // Earlier positions with the same 3-byte hash, newest first.
+    class hash_chains_t
+    {
+    public:
+        hash_chains_t(std::uint8_t const* data, std::size_t size)
+        : m_data(data), m_size(size), m_head(1 << COPY_HASH_BITS, -1), m_prev(size, -1) {}
+
+        unsigned hash(std::uint8_t const* p) const
+        {
+            std::uint32_t const key = (p[0] << 16) | (p[1] << 8) | p[2];
+            return (key * 2654435761u) >> (32 - COPY_HASH_BITS);
+        }
+
+        void insert(std::size_t i)
+        {
+            if(i + MIN_COPY > m_size)
+                return;
+            int& h = m_head[hash(m_data + i)];
+            m_prev[i] = h;
+            h = i;
+        }
+
+        int head(std::uint8_t const* p) const { return m_head[hash(p)]; }
+        int prev(int i) const { return m_prev[i]; }
+
+    private:
+        std::uint8_t const* m_data;
+        std::size_t m_size;
+        std::vector<int> m_head;
+        std::vector<int> m_prev;
+    };
+}
+
+std::vector<std::uint8_t> encode_with_dictionary(dictionary_t const& dictionary, std::uint8_t const* in, std::size_t size,
+                                                 std::vector<std::size_t>* saved)
+{
+    constexpr std::size_t WINDOW = 256;
+
+    assert(dictionary.size() <= MAX_DICTIONARY_SIZE);
+    hash_chains_t dictionary_chains(dictionary.data(), dictionary.size());
+    for(std::size_t i = dictionary.size(); i > 0; --i)
+        dictionary_chains.insert(i - 1);
+    hash_chains_t chains(in, size);
+    if(saved)
+        saved->assign(dictionary.size(), 0);
+
+    auto const match = [&](std::uint8_t const* from, std::uint8_t const* end, std::size_t i)
+    {
+        std::size_t const max_len = std::min<std::size_t>({ MAX_COPY, size - i, std::size_t(end - from) });
+        std::size_t len = 0;
+        while(len < max_len && from[len] == in[i + len])
+            ++len;
+        return len;
+    };
+
+    std::vector<std::uint8_t> out;
+    std::size_t literal = 0; // Where the literals not yet written start.
+    for(std::size_t i = 0; i < size;)
+    {
+        std::size_t back_len = 0;
+        std::size_t back_dist = 0;
+        std::size_t dict_len = 0;
+        std::size_t dict_offset = 0;
+        if(i + MIN_COPY <= size)
+        {
+            for(int c = chains.head(in + i); c >= 0 && i - c <= WINDOW && back_len < MAX_COPY; c = chains.prev(c))
+            {
+                std::size_t const len = match(in + c, in + size, i);
+                if(len > back_len)
+                {
+                    back_len = len;
+                    back_dist = i - c;
+                }
+            }
+
+            unsigned depth = 0;
+            for(int c = dictionary_chains.head(in + i); c >= 0 && depth < MAX_DICTIONARY_CHAIN && dict_len < MAX_COPY;
+                c = dictionary_chains.prev(c), ++depth)
+            {
+                std::size_t const len = match(dictionary.data() + c, dictionary.data() + dictionary.size(), i);
+                if(len > dict_len)
+                {
+                    dict_len = len;
+                    dict_offset = c;
+                }
+            }
+        }
+
+        // Copies from the level take 2 bytes, and from the dictionary 3.
+        long const back_saves = back_len >= MIN_COPY ? long(back_len) - 2 : 0;
+        long const dict_saves = dict_len >= MIN_COPY ? long(dict_len) - 3 : 0;
+
+        std::size_t len = 1;
+        if(back_saves > 0 && back_saves >= dict_saves)
+        {
+            put_literals(out, in + literal, in + i);
+            out.push_back(0x80 + back_len - MIN_COPY);
+            out.push_back(back_dist - 1);
+            len = back_len;
+            literal = i + len;
+        }
+        else if(dict_saves > 0)
+        {
+            put_literals(out, in + literal, in + i);
+            out.push_back(0xC0 + dict_len - MIN_COPY);
+            out.push_back(dict_offset);
+            out.push_back(dict_offset >> 8);
+            if(saved)
+                (*saved)[dict_offset] += dict_saves;
+            len = dict_len;
+            literal = i + len;
+        }
+
+        for(std::size_t j = 0; j < len; ++j)
+            chains.insert(i + j);
+        i += len;
+    }
+    put_literals(out, in + literal, in + size);
+
+    return out;
+}
+
+std::vector<std::uint8_t> decode_with_dictionary(dictionary_t const& dictionary, std::uint8_t const* data, std::size_t size,
+                                                 std::size_t tiles)
+{
+    std::vector<std::uint8_t> out;
+    out.reserve(tiles);
+    reader_t in(data, size);
+    while(out.size() < tiles)
+    {
+        unsigned const header = in.get();
+        if(header < 0x80)
+        {
+            if(out.size() + header + 1 > tiles)
+                throw std::runtime_error("Compressed data runs past the end of the level.");
+            for(unsigned i = 0; i <= header; ++i)
+                out.push_back(in.get());
+        }
+        else if(header < 0xC0)
+        {
+            std::size_t const n = header - 0x80 + MIN_COPY;
+            std::size_t const dist = in.get() + 1;
+            if(dist > out.size())
+                throw std::runtime_error("Compressed data refers back before the start of the level.");
+            if(out.size() + n > tiles)
+                throw std::runtime_error("Compressed data runs past the end of the level.");
+            // One byte at a time, as copies can overlap what they write.
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                std::uint8_t const byte = out[out.size() - dist];
+                out.push_back(byte);
+            }
+        }
+        else
+        {
+            std::size_t const n = header - 0xC0 + MIN_COPY;
+            std::size_t offset = in.get();
+            offset |= in.get() << 8;
+            if(offset + n > dictionary.size())
+                throw std::runtime_error("Compressed data refers past the end of the dictionary.");
+            if(out.size() + n > tiles)
+                throw std::runtime_error("Compressed data runs past the end of the level.");
+            out.insert(out.end(), dictionary.begin() + offset, dictionary.begin() + offset + n);
+        }
+    }
+    if(!in.done())
+        throw std::runtime_error("Compressed data continues past the end of the level.");
+    return out;
+}
+
+std::size_t shared_dictionary_t::level_bytes() const
+{
+    std::size_t bytes = 0;
+    for(auto const& level : levels)
+        bytes += 5 + level.data.size();
+    return bytes;
+}
+
+namespace
+{
+    // Lengths of the runs counted as dictionary candidates.
+    constexpr std::uint32_t CANDIDATE_LENGTHS[] = { 6, 8, 12, 16, 24, 32, 48, MAX_COPY };
+    // How many of the best-scoring candidates training picks from.
+    constexpr std::size_t MAX_CANDIDATES = 4096;
+    constexpr unsigned TRAINING_ROUNDS = 4;
+
+    struct candidate_t
+    {
+        std::uint64_t key;
+        std::uint32_t count; // Of levels holding it.
+        std::uint32_t stream; // Where an occurrence is, to read its bytes back.
+        std::uint32_t pos;
+        std::uint32_t length;
+
+        // A rough guess at the bytes saved, less the cost of storing it.
+        // Repeats within a level are left out, as copies from the level itself already catch them.
+        long score() const { return long(count - 1) * (length - 3) - long(length); }
+    };
+
+    // Calls 'fn(key, pos, length_index)' once for each distinct run of 'in', indexing CANDIDATE_LENGTHS.
+    template<typename Fn>
+    void for_each_distinct_run(std::uint8_t const* in, std::size_t size, Fn const& fn)
+    {
+        // An open-addressed set of the keys seen so far, with 0 marking empty slots.
+        std::size_t const num_runs = size * std::size(CANDIDATE_LENGTHS);
+        std::size_t mask = 1;
+        while(mask < num_runs * 2)
+            mask <<= 1;
+        std::vector<std::uint64_t> seen(mask--, 0);
+
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            std::uint64_t hash = 14695981039346656037ull; // FNV-1a, extended a byte at a time.
+            std::size_t len = 0;
+            for(std::size_t l = 0; l < std::size(CANDIDATE_LENGTHS); ++l)
+            {
+                std::size_t const length = CANDIDATE_LENGTHS[l];
+                if(i + length > size)
+                    break;
+                for(; len < length; ++len)
+                    hash = (hash ^ in[i + len]) * 1099511628211ull;
+
+                std::uint64_t const key = hash ? hash : 1;
+                std::size_t slot = (key ^ (key >> 29)) & mask;
+                while(seen[slot] && seen[slot] != key)
+                    slot = (slot + 1) & mask;
+                if(seen[slot])
+                    continue;
+                seen[slot] = key;
+                fn(key, i, l);
+            }
+        }
+    }
+
+    // Counts how many streams hold each run, and returns the best scoring, best first.
+    // A first pass counts into a fixed table per length, where runs sharing a slot add up.
+    // The second counts exactly, but only the runs whose slots are among the highest for their length,
+    // and merges the streams a batch at a time, so memory stays bounded however many streams there are.
+    std::vector<candidate_t> best_candidates(std::vector<std::vector<std::uint8_t>> const& streams)
+    {
+        constexpr std::size_t NUM_LENGTHS = std::size(CANDIDATE_LENGTHS);
+
+        // Around one slot per position, between enough to hold MAX_CANDIDATES and a fixed cap.
+        std::size_t positions = 0;
+        for(auto const& stream : streams)
+            positions += stream.size();
+        unsigned counter_bits = 13;
+        while(counter_bits < 20 && (std::size_t(1) << counter_bits) < positions)
+            ++counter_bits;
+        auto const slot = [&](std::uint64_t key, std::size_t l) { return (l << counter_bits) | (key >> (64 - counter_bits)); };
+
+        std::vector<std::atomic<std::uint32_t>> counters(NUM_LENGTHS << counter_bits);
+        parallel_for(streams.size(), [&](std::size_t i)
+        {
+            for_each_distinct_run(streams[i].data(), streams[i].size(), [&](std::uint64_t key, std::size_t, std::size_t l)
+            {
+                counters[slot(key, l)].fetch_add(1, std::memory_order_relaxed);
+            });
+        });
+
+        // Runs in fewer streams than this can't be among a length's best, bar collisions.
+        std::vector<std::uint32_t> threshold(NUM_LENGTHS);
+        parallel_for(NUM_LENGTHS, [&](std::size_t l)
+        {
+            std::vector<std::uint32_t> counts(std::size_t(1) << counter_bits);
+            for(std::size_t j = 0; j < counts.size(); ++j)
+                counts[j] = counters[(l << counter_bits) | j].load(std::memory_order_relaxed);
+            auto const nth = counts.begin() + MAX_CANDIDATES;
+            std::nth_element(counts.begin(), nth, counts.end(), std::greater<>());
+            // Strictly above, so ties can't let in more than MAX_CANDIDATES slots.
+            threshold[l] = std::max<std::uint32_t>(*nth + 1, 2);
+        });
+
+        std::size_t const num_shards = worker_pool_t::instance().size() * 4;
+        std::size_t const batch_size = worker_pool_t::instance().size() * 4;
+        std::vector<std::unordered_map<std::uint64_t, candidate_t>> sums(num_shards);
+        for(std::size_t first = 0; first < streams.size(); first += batch_size)
+        {
+            std::size_t const n = std::min(batch_size, streams.size() - first);
+            std::vector<std::vector<std::vector<candidate_t>>> kept(n, std::vector<std::vector<candidate_t>>(num_shards));
+            parallel_for(n, [&](std::size_t b)
+            {
+                std::uint32_t const stream = first + b;
+                for_each_distinct_run(streams[stream].data(), streams[stream].size(), [&](std::uint64_t key, std::size_t pos, std::size_t l)
+                {
+                    if(counters[slot(key, l)].load(std::memory_order_relaxed) >= threshold[l])
+                        kept[b][key % num_shards].push_back({ key, 1, stream, std::uint32_t(pos), CANDIDATE_LENGTHS[l] });
+                });
+            });
+
+            // Streams are merged in order, so each run keeps its first occurrence whatever the number of threads.
+            parallel_for(num_shards, [&](std::size_t shard)
+            {
+                for(auto const& stream : kept)
+                {
+                    for(candidate_t const& c : stream[shard])
+                    {
+                        auto result = sums[shard].try_emplace(c.key, c);
+                        if(!result.second)
+                            ++result.first->second.count;
+                    }
+                }
+            });
+        }
+
+        auto const by_score = [](candidate_t const& a, candidate_t const& b)
+        {
+            // Ties are broken by key so the result doesn't depend on the number of threads.
+            return a.score() != b.score() ? a.score() > b.score() : a.key < b.key;
+        };
+
+        std::vector<std::vector<candidate_t>> best(num_shards);
+        parallel_for(num_shards, [&](std::size_t shard)
+        {
+            for(auto const& [key, c] : sums[shard])
+                if(c.count > 1 && c.score() > 0)
+                    best[shard].push_back(c);
+            sums[shard] = {};
+
+            if(best[shard].size() > MAX_CANDIDATES)
+            {
+                std::nth_element(best[shard].begin(), best[shard].begin() + MAX_CANDIDATES, best[shard].end(), by_score);
+                best[shard].resize(MAX_CANDIDATES);
+            }
+        });
+
+        std::vector<candidate_t> ret;
+        for(auto const& shard : best)
+            ret.insert(ret.end(), shard.begin(), shard.end());
+        std::sort(ret.begin(), ret.end(), by_score);
+        if(ret.size() > MAX_CANDIDATES)
+            ret.resize(MAX_CANDIDATES);
+        return ret;
+    }
+
+    // Fills the dictionary from the best candidates, then drops the runs that don't pay for themselves
+    // once the streams are actually encoded, refilling from the candidates left.
+    dictionary_t train_dictionary(std::vector<std::vector<std::uint8_t>> const& streams)
+    {
+        std::vector<candidate_t> const candidates = best_candidates(streams);
+
+        std::vector<std::vector<std::uint8_t>> runs;
+        dictionary_t dictionary;
+        std::size_t next = 0;
+        for(unsigned round = 0; round < TRAINING_ROUNDS; ++round)
+        {
+            for(; next < candidates.size() && dictionary.size() < MAX_DICTIONARY_SIZE; ++next)
+            {
+                candidate_t const& c = candidates[next];
+                std::uint8_t const* begin = streams[c.stream].data() + c.pos;
+                std::uint8_t const* end = begin + c.length;
+                if(dictionary.size() + c.length > MAX_DICTIONARY_SIZE)
+                    continue;
+                // Runs already in the dictionary can be copied from there.
+                if(std::search(dictionary.begin(), dictionary.end(), begin, end) != dictionary.end())
+                    continue;
+                runs.emplace_back(begin, end);
+                dictionary.insert(dictionary.end(), begin, end);
+            }
+
+            std::vector<std::vector<std::size_t>> saved(streams.size());
+            parallel_for(streams.size(), [&](std::size_t i)
+            {
+                encode_with_dictionary(dictionary, streams[i].data(), streams[i].size(), &saved[i]);
+            });
+
+            std::vector<std::vector<std::uint8_t>> kept;
+            std::size_t offset = 0;
+            for(auto& run : runs)
+            {
+                std::size_t run_saved = 0;
+                for(auto const& stream_saved : saved)
+                    for(std::size_t i = 0; i < run.size(); ++i)
+                        run_saved += stream_saved[offset + i];
+                offset += run.size();
+                if(run_saved > run.size())
+                    kept.push_back(std::move(run));
+            }
+
+            bool const settled = kept.size() == runs.size();
+            runs = std::move(kept);
+            dictionary.clear();
+            for(auto const& run : runs)
+                dictionary.insert(dictionary.end(), run.begin(), run.end());
+            if(settled)
+                break;
+        }
+
+        return dictionary;
+    }
+}
+
+std::vector<shared_dictionary_t> train_shared_dictionaries(model_t const& model)
+{
+    std::vector<shared_dictionary_t> ret;
+    std::unordered_map<std::string, std::size_t> by_name;
+    for(std::size_t i = 0; i < model.levels.size(); ++i)
+    {
+        auto result = by_name.try_emplace(model.levels[i]->metatiles_name, ret.size());
+        if(result.second)
+            ret.emplace_back().metatiles_name = model.levels[i]->metatiles_name;
+        ret[result.first->second].levels.push_back({ i });
+    }
+
+    // Sets are trained one after another, each spreading its own work across the pool.
+    for(shared_dictionary_t& shared : ret)
+    {
+        std::vector<std::vector<std::uint8_t>> streams;
+        for(auto const& level : shared.levels)
+        {
+            auto const& grid = model.levels[level.index]->metatile_layer.tiles;
+            auto& stream = streams.emplace_back();
+            stream.reserve(std::size_t(grid.dimen().w) * grid.dimen().h);
+            for(int x = 0; x < grid.dimen().w; ++x)
+            for(int y = 0; y < grid.dimen().h; ++y)
+                stream.push_back(grid[{ x, y }]);
+        }
+
+        shared.dictionary = train_dictionary(streams);
+
+        std::vector<compressed_level_t> separate(streams.size());
+        std::atomic<std::size_t> gained = 0;
+        parallel_for(streams.size(), [&](std::size_t i)
+        {
+            auto& level = shared.levels[i];
+            level.data = encode_with_dictionary(shared.dictionary, streams[i].data(), streams[i].size());
+            assert(decode_with_dictionary(shared.dictionary, level.data.data(), level.data.size(), streams[i].size()) == streams[i]);
+
+            separate[i] = compress_level(*model.levels[level.index]);
+            if(separate[i].data.size() > level.data.size())
+                gained += separate[i].data.size() - level.data.size();
+        });
+
+        if(gained <= shared.dictionary.size())
+            shared.dictionary.clear();
+        for(std::size_t i = 0; i < streams.size(); ++i)
+        {
+            auto& level = shared.levels[i];
+            if(shared.dictionary.empty() || separate[i].data.size() <= level.data.size())
+            {
+                level.codec = separate[i].best;
+                level.data = std::move(separate[i].data);
+            }
+        }
+    }
+
+    return ret;
+}
+
+void write_shared_dictionaries(model_t const& model, std::vector<shared_dictionary_t> const& dictionaries,
+                               std::filesystem::path const& dir)
+{
+    for(shared_dictionary_t const& shared : dictionaries)
+    {
+        std::vector<std::uint8_t> bytes = { std::uint8_t(shared.dictionary.size()), std::uint8_t(shared.dictionary.size() >> 8) };
+        bytes.insert(bytes.end(), shared.dictionary.begin(), shared.dictionary.end());
+        write_bytes(dir / (shared.metatiles_name + ".dict"), bytes);
+
+        for(auto const& level : shared.levels)
+        {
+            level_model_t const& model_level = *model.levels[level.index];
+            dimen_t const dimen = model_level.dimen();
+            bytes =
+            {
+                level.codec,
+                std::uint8_t(dimen.w), std::uint8_t(dimen.w >> 8),
+                std::uint8_t(dimen.h), std::uint8_t(dimen.h >> 8),
+            };
+            bytes.insert(bytes.end(), level.data.begin(), level.data.end());
+            write_bytes(dir / (model_level.name + ".shared"), bytes);
+        }
+    }
+}
+
+std::string shared_dictionary_report(std::vector<shared_dictionary_t> const& dictionaries,
+                                     std::vector<compressed_level_t> const& per_level)
+{
+    std::ostringstream ss;
+    ss << std::left << std::setw(20) << "Metatiles" << std::right
+       << std::setw(8) << "Levels" << std::setw(13) << "Dictionary"
+       << std::setw(13) << "Level Data" << std::setw(13) << "Shared" << std::setw(13) << "Per-Level" << std::setw(13) << "Saved" << "\n";
+
+    std::size_t total_levels = 0;
+    std::size_t total_dictionary = 0;
+    std::size_t total_level = 0;
+    std::size_t total_per_level = 0;
+    auto const row = [&](std::string const& name, std::size_t levels, std::size_t dictionary, std::size_t level, std::size_t separate)
+    {
+        auto const bytes = [](long n) { return std::to_string(n) + " B"; };
+        ss << std::left << std::setw(20) << name << std::right
+           << std::setw(8) << levels << std::setw(13) << bytes(dictionary)
+           << std::setw(13) << bytes(level) << std::setw(13) << bytes(dictionary + level)
+           << std::setw(13) << bytes(separate) << std::setw(13) << bytes(long(separate) - long(dictionary + level)) << "\n";
+    };
+
+    for(shared_dictionary_t const& shared : dictionaries)
+    {
+        // As written by write_compressed_levels.
+        std::size_t separate = 0;
+        for(auto const& level : shared.levels)
+            separate += 5 + per_level[level.index].data.size();
+
+        row(shared.metatiles_name, shared.levels.size(), shared.dictionary_bytes(), shared.level_bytes(), separate);
+
+        total_levels += shared.levels.size();
+        total_dictionary += shared.dictionary_bytes();
+        total_level += shared.level_bytes();
+        total_per_level += separate;
+    }
+
+    row("Total", total_levels, total_dictionary, total_level, total_per_level);
+    ss << "\nPer-Level is each level's best codec on its own. Sizes include file headers.\n";
+    return ss.str();
+}
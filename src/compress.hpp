@@ -0,0 +1,172 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "2d/geometry.hpp"
+
+using namespace i2d;
+
+struct model_t;
+class level_model_t;
+
+// Codecs for level metatile grids, simple enough to decode on the NES.
+// Every stream decodes to the grid's bytes in row-major order. The dimensions are stored apart.
+enum codec_t : std::uint8_t
+{
+    CODEC_RAW,
+    // PackBits-style packets. A header byte n below 0x80 is followed by n+1 literal bytes,
+    // otherwise by one byte repeated n-0x80+2 times.
+    CODEC_RLE,
+    // LZ77 over a 256-byte window. A header byte n below 0x80 is followed by n+1 literal bytes,
+    // otherwise by a byte d, and copies n-0x80+3 bytes starting d+1 bytes back. Copies may overlap.
+    CODEC_LZ77,
+    // The grid a column at a time, left to right, as each byte minus the one to its left, packed with CODEC_RLE.
+    // Repeated columns become runs of 0, and a scrolling game can decode one column at a time.
+    CODEC_COLUMN_DELTA,
+    NUM_CODECS,
+};
+
+char const* codec_name(codec_t codec);
+
+std::vector<std::uint8_t> encode_tiles(codec_t codec, std::uint8_t const* tiles, dimen_t dimen);
+
+// Throws on malformed data.
+// If 'cycles' is given, it's set to a rough count of the 6502 cycles a straightforward decoder would take.
+std::vector<std::uint8_t> decode_tiles(codec_t codec, std::uint8_t const* data, std::size_t size, dimen_t dimen,
+                                       std::size_t* cycles = nullptr);
+
+struct compressed_level_t
+{
+    struct result_t
+    {
+        std::size_t size;
+        std::size_t cycles;
+    };
+
+    std::string name;
+    dimen_t dimen;
+    std::array<result_t, NUM_CODECS> results;
+    codec_t best = CODEC_RAW;
+    std::vector<std::uint8_t> data; // Encoded with 'best'.
+};
+
+// Encodes the level with every codec and picks the smallest, or the quickest to decode on ties.
+compressed_level_t compress_level(level_model_t const& level);
+
+// As compress_level, for each level of the model in parallel.
+std::vector<compressed_level_t> compress_levels(model_t const& model);
+
+// Writes each level to 'dir' as "<name>.bin": the codec, then the width and height as 16-bit little-endian, then the data.
+// Throws on failure.
+void write_compressed_levels(std::vector<compressed_level_t> const& levels, std::filesystem::path const& dir);
+
+// A plain-text table of every level's size and decode cycles under each codec.
+std::string compression_report(std::vector<compressed_level_t> const& levels);
+
+// Column streams, for horizontal scrollers that decode a metatile column at a time.
+// Each level is written as "<name>.col", little-endian:
+//   u8  flags
+//   u16 width and u16 height, in metatiles
+//   u16 screen width, in columns
+//   u32 per screen: where its first column starts, from the start of the column data
+//   u16 per column: where it starts, from the start of its screen
+//   the column data, each column top to bottom
+// Screens are as wide as the level grid (model_t::level_grid_x), so column x starts at
+// screen_offsets[x / screen_width] + column_offsets[x].
+enum : std::uint8_t
+{
+    COLUMNS_RLE = 1 << 0, // Each column is packed on its own as CODEC_RLE, otherwise columns are raw.
+};
+
+struct column_level_t
+{
+    std::string name;
+    std::vector<std::uint8_t> bytes; // The whole file.
+};
+
+// Encodes each level in a single pass over its columns. Levels are encoded in parallel.
+// Throws if a screen outgrows its 16-bit column offsets.
+std::vector<column_level_t> encode_column_levels(model_t const& model, bool rle);
+
+struct decoded_columns_t
+{
+    dimen_t dimen;
+    unsigned screen_width;
+    std::vector<std::uint8_t> tiles; // Row-major.
+};
+
+// Seeks to each column through the offset tables, and checks it ends where the next one starts.
+// Throws on malformed data.
+decoded_columns_t decode_column_level(std::uint8_t const* data, std::size_t size);
+
+// Throws on failure.
+void write_column_levels(std::vector<column_level_t> const& levels, std::filesystem::path const& dir);
+
+// Reads back what write_column_levels wrote to 'dir' and decodes it against the levels of 'model'.
+// Throws on the first level that doesn't round-trip.
+void validate_column_levels(model_t const& model, std::filesystem::path const& dir);
+
+// Shared dictionaries, each trained on every level using one metatile set, so structure repeated
+// across levels (floors, platforms, background motifs) is stored once.
+// Levels are encoded a column at a time, top to bottom, as in column streams, which keeps a block
+// of metatiles together as a few long runs rather than many short ones.
+// Levels are sequences of packets. A header byte n below 0x80 is followed by n+1 literal bytes.
+// One below 0xC0 is followed by a byte d, and copies n-0x80+3 bytes starting d+1 bytes back, as in CODEC_LZ77.
+// The rest are followed by a 16-bit little-endian offset, and copy n-0xC0+3 bytes of the dictionary from there.
+constexpr std::size_t MAX_DICTIONARY_SIZE = 4096;
+constexpr std::uint8_t SHARED_CODEC = 0xFF;
+
+using dictionary_t = std::vector<std::uint8_t>;
+
+// If 'saved' is given, it gets the bytes saved by copies from each dictionary offset.
+std::vector<std::uint8_t> encode_with_dictionary(dictionary_t const& dictionary, std::uint8_t const* tiles, std::size_t size,
+                                                 std::vector<std::size_t>* saved = nullptr);
+
+// Throws on malformed data.
+std::vector<std::uint8_t> decode_with_dictionary(dictionary_t const& dictionary, std::uint8_t const* data, std::size_t size,
+                                                 std::size_t tiles);
+
+struct shared_dictionary_t
+{
+    struct level_t
+    {
+        std::size_t index; // Into model_t::levels.
+        // Levels the dictionary doesn't help are kept as compress_level encoded them, with its best codec.
+        // Otherwise this is SHARED_CODEC, and 'data' is packets.
+        std::uint8_t codec = SHARED_CODEC;
+        std::vector<std::uint8_t> data;
+    };
+
+    std::string metatiles_name;
+    dictionary_t dictionary;
+    std::vector<level_t> levels;
+
+    // As written by write_shared_dictionaries.
+    std::size_t dictionary_bytes() const { return 2 + dictionary.size(); }
+    std::size_t level_bytes() const;
+};
+
+// Trains a dictionary for each metatile set used by a level, then encodes those levels with it.
+// Each level falls back to compress_level where that is smaller, and a dictionary no level gains
+// more than its own size from is left empty.
+// Counting candidates and trying out dictionaries are spread across the worker pool.
+std::vector<shared_dictionary_t> train_shared_dictionaries(model_t const& model);
+
+// Writes each dictionary to 'dir' as "<metatiles name>.dict": its size as 16-bit little-endian, then its bytes.
+// Levels are written as "<name>.shared": the codec, then the width and height as 16-bit little-endian, then the data,
+// as "<name>.bin" from write_compressed_levels but with SHARED_CODEC for packets.
+// Throws on failure.
+void write_shared_dictionaries(model_t const& model, std::vector<shared_dictionary_t> const& dictionaries,
+                               std::filesystem::path const& dir);
+
+// A plain-text table of the bytes each dictionary saves over the levels' best codecs from compress_levels.
+// 'per_level' is as returned by compress_levels for the same model.
+std::string shared_dictionary_report(std::vector<shared_dictionary_t> const& dictionaries,
+                                     std::vector<compressed_level_t> const& per_level);
+
+#endif
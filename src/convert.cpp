@@ -193,6 +193,61 @@ fail:
     throw std::runtime_error(std::string("png decoder error: ") + lodepng_error_text(error));
 }
 
+std::vector<std::uint8_t> permute_png_tiles(std::uint8_t const* png, std::size_t size, std::array<std::uint8_t, 256> const& order)
+{
+    auto const check = [](unsigned error)
+    {
+        if(error)
+            throw std::runtime_error(std::string("png error: ") + lodepng_error_text(error));
+    };
+
+    // Decode in the PNG's own color mode (keeping its palette), then widen to whole bytes per pixel:
+    unsigned width, height;
+    lodepng::State state;
+    state.decoder.color_convert = 0;
+    std::vector<std::uint8_t> packed;
+    check(lodepng::decode(packed, width, height, state, png, size));
+    if(width % 8 != 0 || height % 8 != 0)
+        throw std::runtime_error("Image size is not a multiple of 8.");
+
+    lodepng::State wide;
+    check(lodepng_color_mode_copy(&wide.info_raw, &state.info_png.color));
+    check(lodepng_color_mode_copy(&wide.info_png.color, &state.info_png.color));
+    if(wide.info_raw.bitdepth < 8)
+        wide.info_raw.bitdepth = 8;
+    std::vector<std::uint8_t> image(lodepng_get_raw_size(width, height, &wide.info_raw));
+    check(lodepng_convert(image.data(), packed.data(), &wide.info_raw, &state.info_raw, width, height));
+
+    unsigned const bytes = lodepng_get_bpp(&wide.info_raw) / 8;
+    unsigned const row_tiles = width / 8;
+    unsigned const num = std::min(row_tiles * (height / 8), 256u);
+    auto const row = [&](std::vector<std::uint8_t>& pixels, unsigned tile, unsigned y)
+    {
+        return pixels.data() + (((tile / row_tiles) * 8 + y) * width + (tile % row_tiles) * 8) * bytes;
+    };
+
+    // Grow the image downwards if a tile moves past its end:
+    unsigned needed = num;
+    for(unsigned i = 0; i < num; ++i)
+        needed = std::max(needed, order[i] + 1u);
+    height = std::max(height, (needed + row_tiles - 1) / row_tiles * 8);
+    image.resize(width * height * bytes, 0);
+
+    std::vector<std::uint8_t> result = image;
+    for(unsigned i = 0; i < needed; ++i)
+        for(unsigned y = 0; y < 8; ++y)
+            std::fill_n(row(result, i, y), 8 * bytes, 0);
+    for(unsigned i = 0; i < num; ++i)
+        for(unsigned y = 0; y < 8; ++y)
+            std::copy_n(row(image, i, y), 8 * bytes, row(result, order[i], y));
+
+    // Encode back to the original mode, rather than whatever lodepng would pick:
+    wide.encoder.auto_convert = 0;
+    std::vector<std::uint8_t> out;
+    check(lodepng::encode(out, result, width, height, wide));
+    return out;
+}
+
 attr_gc_bitmaps_t convert_bitmap(attr_bitmaps_t const& bmp)
 {
 #if GC_RENDER
@@ -52,4 +52,9 @@ std::pair<std::vector<bitmap_t>, std::vector<wxBitmap>> load_collision_file(wxSt
 
 std::vector<std::uint8_t> png_to_chr(std::uint8_t const* png, std::size_t size, bool chr16);
 
+// Moves each of the first 256 8x8 tiles of a PNG, numbered as png_to_chr reads them, to its position in 'order'.
+// Returns the re-encoded PNG, in the same color mode, grown by rows of tiles if one moves past the end.
+// Positions no tile moves into are cleared to 0.
+std::vector<std::uint8_t> permute_png_tiles(std::uint8_t const* png, std::size_t size, std::array<std::uint8_t, 256> const& order);
+
 #endif
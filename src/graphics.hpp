@@ -61,6 +61,24 @@ inline void set_font(render_t& gc, wxFont const& font, wxColour const& color)
 #endif
 }
 
+inline void set_clip(render_t& gc, int x, int y, int w, int h)
+{
+#if GC_RENDER
+    gc.Clip(x, y, w, h);
+#else
+    gc.SetClippingRegion(x, y, w, h);
+#endif
+}
+
+inline void reset_clip(render_t& gc)
+{
+#if GC_RENDER
+    gc.ResetClip();
+#else
+    gc.DestroyClippingRegion();
+#endif
+}
+
 inline void text_extent(render_t& gc, wxString const& str, int* x, int* y)
 {
 #if GC_RENDER
@@ -1,11 +1,144 @@
 #include "grid_box.hpp"
 
+#include <cstring>
 #include <sstream>
 
 #include <wx/dcbuffer.h>
 #include <wx/graphics.h>
 #include <wx/dcgraph.h>
 
+////////////////////////////////////////////////////////////////////////////////
+// cell_region_t ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void cell_region_t::build(rect_t bounds, std::vector<std::uint8_t> const& cells)
+{
+    m_rects.clear();
+    m_outline.clear();
+
+    auto const at = [&](int x, int y) -> bool
+    {
+        x -= bounds.c.x;
+        y -= bounds.c.y;
+        return x >= 0 && y >= 0 && x < bounds.d.w && y < bounds.d.h && cells[y * bounds.d.w + x];
+    };
+
+    // Rectangles that ended on the previous row, as indices into 'm_rects', sorted by x.
+    // A run exactly matching one of them extends it downward instead of starting a new one.
+    std::vector<std::size_t> open;
+    std::vector<std::size_t> next_open;
+    for(int y = bounds.c.y; y < bounds.e().y; ++y)
+    {
+        auto it = open.begin();
+        next_open.clear();
+        for(int x = bounds.c.x; x < bounds.e().x;)
+        {
+            if(!at(x, y))
+            {
+                ++x;
+                continue;
+            }
+
+            int const x0 = x;
+            while(x < bounds.e().x && at(x, y))
+                ++x;
+
+            while(it != open.end() && m_rects[*it].c.x < x0)
+                ++it;
+            if(it != open.end() && m_rects[*it].c.x == x0 && m_rects[*it].e().x == x)
+            {
+                m_rects[*it].d.h += 1;
+                next_open.push_back(*it);
+            }
+            else
+            {
+                next_open.push_back(m_rects.size());
+                m_rects.push_back({ { x0, y }, { x - x0, 1 } });
+            }
+        }
+        std::swap(open, next_open);
+    }
+
+    // The outline runs wherever a cell and its neighbor differ:
+    for(int y = bounds.c.y; y <= bounds.e().y; ++y)
+    {
+        for(int x = bounds.c.x; x < bounds.e().x;)
+        {
+            if(at(x, y) == at(x, y - 1))
+            {
+                ++x;
+                continue;
+            }
+
+            int const x0 = x;
+            while(x < bounds.e().x && at(x, y) != at(x, y - 1))
+                ++x;
+            m_outline.push_back({{ { x0, y }, { x, y } }});
+        }
+    }
+
+    for(int x = bounds.c.x; x <= bounds.e().x; ++x)
+    {
+        for(int y = bounds.c.y; y < bounds.e().y;)
+        {
+            if(at(x, y) == at(x - 1, y))
+            {
+                ++y;
+                continue;
+            }
+
+            int const y0 = y;
+            while(y < bounds.e().y && at(x, y) != at(x - 1, y))
+                ++y;
+            m_outline.push_back({{ { x, y0 }, { x, y } }});
+        }
+    }
+}
+
+void cell_region_t::draw(render_t& gc, coord_t origin, dimen_t cell_size) const
+{
+    auto const to_pixel = [&](coord_t c)
+    {
+        return coord_t{ origin.x + c.x * cell_size.w, origin.y + c.y * cell_size.h };
+    };
+
+#ifdef GC_RENDER
+    wxGraphicsPath fill = gc.CreatePath();
+    for(rect_t const& r : m_rects)
+    {
+        coord_t const c0 = to_pixel(r.c);
+        fill.AddRectangle(c0.x, c0.y, r.d.w * cell_size.w, r.d.h * cell_size.h);
+    }
+    gc.FillPath(fill);
+
+    wxGraphicsPath outline = gc.CreatePath();
+    for(auto const& [a, b] : m_outline)
+    {
+        coord_t const c0 = to_pixel(a);
+        coord_t const c1 = to_pixel(b);
+        outline.MoveToPoint(c0.x, c0.y);
+        outline.AddLineToPoint(c1.x, c1.y);
+    }
+    gc.StrokePath(outline);
+#else
+    wxPen const pen = gc.GetPen();
+    gc.SetPen(*wxTRANSPARENT_PEN);
+    for(rect_t const& r : m_rects)
+    {
+        coord_t const c0 = to_pixel(r.c);
+        gc.DrawRectangle(c0.x, c0.y, r.d.w * cell_size.w, r.d.h * cell_size.h);
+    }
+
+    gc.SetPen(pen);
+    for(auto const& [a, b] : m_outline)
+    {
+        coord_t const c0 = to_pixel(a);
+        coord_t const c1 = to_pixel(b);
+        gc.DrawLine(c0.x, c0.y, c1.x, c1.y);
+    }
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // grid_box_t //////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -268,14 +401,18 @@ void selector_box_t::draw_tiles(render_t& gc)
 
     gc.SetPen(wxPen(wxColor(255, 255, 255, 127), 0));
     gc.SetBrush(wxBrush(wxColor(0, 255, 255, 127)));
+    select_region().draw(gc, to_screen({ 0, 0 }), tile_size());
+}
 
-    for(coord_t c : dimen_range(selector().dimen()))
+cell_region_t const& selector_box_t::select_region()
+{
+    select_map_t const& map = selector();
+    if(m_select_region.key != map.revision())
     {
-        int x0 = c.x * tile_size().w + margin().w;
-        int y0 = c.y * tile_size().h + margin().h;
-        if(selector()[c])
-            gc.DrawRectangle(x0, y0, tile_size().w, tile_size().h);
+        m_select_region.build(map.select_rect(), [&](auto const& fn) { map.for_each_selected(fn); });
+        m_select_region.key = map.revision();
     }
+    return m_select_region;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -334,7 +471,7 @@ void canvas_box_t::on_up(mouse_button_t mb, coord_t mouse_end)
             return;
         model.modify();
 
-        editor().history.push(layer().save(pen));
+        editor().history.push(layer().save(pen), { &layer(), MERGE_STAMP });
 
         layer().for_each_picked(pen, [&](coord_t c, std::uint16_t tile)
         { 
@@ -393,56 +530,130 @@ void canvas_box_t::draw_overlays(render_t& gc)
 
     if(model.tool == TOOL_SELECT)
     {
-        for(coord_t c : dimen_range(layer().canvas_selector.dimen()))
-        {
-            int x0 = c.x * tile_size().w + margin().w;
-            int y0 = c.y * tile_size().h + margin().h;
-
-            if(model.tool == TOOL_SELECT && layer().canvas_selector[c])
-            {
-                gc.SetPen(wxPen(wxColor(255, 255, 255, 127), 0));
-                gc.SetBrush(wxBrush(wxColor(0, 255, 255, 127)));
-                gc.DrawRectangle(x0, y0, tile_size().w, tile_size().h);
-            }
-        }
+        gc.SetPen(wxPen(wxColor(255, 255, 255, 127), 0));
+        gc.SetBrush(wxBrush(wxColor(0, 255, 255, 127)));
+        select_region().draw(gc, to_screen({ 0, 0 }), tile_size());
     }
 
+    coord_t const pen = from_screen(mouse_current);
+
     if(pasting())
     {
         if(auto* grid = std::get_if<grid_t<std::uint16_t>>(&model.paste->data))
         {
-            gc.SetPen(wxPen(wxColor(255, 255, 0), 0));
-            gc.SetBrush(wxBrush(wxColor(255, 0, 255, 127)));
-            coord_t const pen = from_screen(mouse_current);
-            for(coord_t c : dimen_range(grid->dimen()))
+            if(m_paste_region.key != model.paste_serial)
             {
-                if((*grid)[c] != std::uint16_t(~0u))
+                m_paste_region.build(to_rect(grid->dimen()), [&](auto const& fn)
                 {
-                    coord_t const c0 = to_screen(c + pen);
-                    gc.DrawRectangle(c0.x, c0.y, tile_size().w, tile_size().h);
-                }
+                    for(coord_t c : dimen_range(grid->dimen()))
+                        if((*grid)[c] != std::uint16_t(~0u))
+                            fn(c);
+                });
+                m_paste_region.key = model.paste_serial;
+            }
+
+            paste_preview_key_t const preview_key = { model.paste_serial, &layer(), tiles().bitmaps_serial };
+            if(m_paste_preview_key != preview_key)
+            {
+                compose_paste_preview(*grid);
+                m_paste_preview_key = preview_key;
+            }
+
+            if(!m_paste_region.empty())
+            {
+                coord_t const at = to_screen(pen);
+#ifdef GC_RENDER
+                gc.DrawBitmap(m_paste_preview, at.x, at.y, 
+                              grid->dimen().w * tile_size().w, grid->dimen().h * tile_size().h);
+#else
+                gc.DrawBitmap(m_paste_preview, { at.x, at.y }, true);
+#endif
+                gc.SetPen(wxPen(wxColor(255, 255, 0), 0));
+                gc.SetBrush(*wxTRANSPARENT_BRUSH);
+                m_paste_region.draw(gc, at, tile_size());
             }
         }
     }
     else if(model.tool == TOOL_STAMP)
     {
+        select_map_t const& picker = layer().picker_selector;
+        rect_t const picked = picker.select_rect();
+        if(m_stamp_region.key != picker.revision())
+        {
+            m_stamp_region.build(to_rect(picked.d), [&](auto const& fn)
+            {
+                picker.for_each_selected([&](coord_t c) { fn(c - picked.c); });
+            });
+            m_stamp_region.key = picker.revision();
+        }
+
+        // Stamps are cropped to the canvas:
+        coord_t const c0 = to_screen({ 0, 0 });
+        coord_t const c1 = to_screen(to_coord(layer().canvas_dimen()));
         gc.SetPen(wxPen(wxColor(255, 255, 255, 127), 0));
         gc.SetBrush(wxBrush(wxColor(0, 255, 255, mouse_down == MBTN_LEFT ? 127 : 31)));
-        layer().for_each_picked(from_screen(mouse_current), [&](coord_t c, std::uint8_t tile)
-        {
-            coord_t const c0 = to_screen(c);
-            gc.DrawRectangle(c0.x, c0.y, tile_size().w, tile_size().h);
-        });
+        set_clip(gc, c0.x, c0.y, c1.x - c0.x, c1.y - c0.y);
+        m_stamp_region.draw(gc, to_screen(pen), tile_size());
+        reset_clip(gc);
+    }
+}
+
+void canvas_box_t::compose_paste_preview(grid_t<std::uint16_t> const& grid)
+{
+    if(m_paste_region.empty())
+        return;
+
+    constexpr unsigned char preview_alpha = 160;
+    dimen_t const tile = tile_size();
+    wxImage image(grid.dimen().w * tile.w, grid.dimen().h * tile.h);
+
+#ifdef GC_RENDER
+    image.InitAlpha();
+    {
+        std::unique_ptr<wxGraphicsContext> gc(get_renderer()->CreateContextFromImage(image));
+        gc->SetInterpolationQuality(wxINTERPOLATION_NONE);
+        gc->SetAntialiasMode(wxANTIALIAS_NONE);
+        for(coord_t c : dimen_range(grid.dimen()))
+            if(grid[c] != std::uint16_t(~0u))
+                draw_paste_tile(*gc, grid[c], { c.x * tile.w, c.y * tile.h });
+    } // The context writes back to 'image' when destroyed.
+#else
+    wxBitmap bitmap(image.GetWidth(), image.GetHeight());
+    {
+        wxMemoryDC dc(bitmap);
+        for(coord_t c : dimen_range(grid.dimen()))
+            if(grid[c] != std::uint16_t(~0u))
+                draw_paste_tile(dc, grid[c], { c.x * tile.w, c.y * tile.h });
+    }
+    image = bitmap.ConvertToImage();
+    if(!image.HasAlpha())
+        image.InitAlpha();
+#endif
+
+    // Translucent over pasted cells, and clear over the holes:
+    unsigned char* const alpha = image.GetAlpha();
+    for(coord_t c : dimen_range(grid.dimen()))
+    {
+        unsigned char const a = grid[c] != std::uint16_t(~0u) ? preview_alpha : 0;
+        for(int y = 0; y < tile.h; ++y)
+            std::memset(alpha + (c.y * tile.h + y) * image.GetWidth() + c.x * tile.w, a, tile.w);
     }
+
+#ifdef GC_RENDER
+    m_paste_preview = get_renderer()->CreateBitmapFromImage(image);
+#else
+    m_paste_preview = wxBitmap(image);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // editor_t ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-editor_t::editor_t(wxWindow* parent) 
+editor_t::editor_t(wxWindow* parent, model_t& model) 
 : wxPanel(parent)
 {
+    history.journal = model.journal.get();
     Bind(wxEVT_UPDATE_UI, &editor_t::on_update, this);
 }
 
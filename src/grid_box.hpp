@@ -126,6 +126,7 @@ public:
         model.modify();
 
         object->name = name.ToStdString();
+        P::on_collection_change(model);
         GetList()->InsertItems(1, &name, rtab_id + 1);
         GetList()->Select(rtab_id + 1);
         GetList()->Check(rtab_id + 1);
@@ -150,6 +151,7 @@ public:
         model.modify();
 
         object->name = name.ToStdString();
+        P::on_collection_change(model);
         GetList()->InsertItems(1, &name, rtab_id + 1);
         GetList()->Select(rtab_id + 1);
     }
@@ -170,6 +172,7 @@ public:
         {
             GetList()->Delete(rtab_id);
             collection().erase(collection().begin() + rtab_id);
+            P::on_collection_change(model);
             model.modify();
         }
     }
@@ -228,6 +231,37 @@ private:
     int rtab_id = -1;
 };
 
+// A set of cells prepared for drawing as one shape: row runs merged into
+// rectangles, plus the segments of its outline. Coordinates are in cells.
+class cell_region_t
+{
+public:
+    // 'for_each' is called with a function to apply to each cell of the region,
+    // all of which must lie in 'bounds'.
+    template<typename Fn>
+    void build(rect_t bounds, Fn const& for_each)
+    {
+        std::vector<std::uint8_t> cells(bounds.d.w * bounds.d.h, 0);
+        for_each([&](coord_t c)
+        {
+            assert(in_bounds(c - bounds.c, bounds.d));
+            cells[(c.y - bounds.c.y) * bounds.d.w + (c.x - bounds.c.x)] = 1;
+        });
+        build(bounds, cells);
+    }
+
+    bool empty() const { return m_rects.empty(); }
+    void draw(render_t& gc, coord_t origin, dimen_t cell_size) const;
+
+    // Whatever the region was last built from; see selector_box_t.
+    std::uint64_t key = ~0ull;
+private:
+    void build(rect_t bounds, std::vector<std::uint8_t> const& cells);
+
+    std::vector<rect_t> m_rects;
+    std::vector<std::array<coord_t, 2>> m_outline;
+};
+
 class grid_box_t : public wxScrolledWindow
 {
 public:
@@ -309,6 +343,11 @@ protected:
 
     virtual void draw_tile(render_t& gc, unsigned tile, coord_t at) {}
     virtual void draw_tiles(render_t& gc) override;
+
+    // The current selector() as a region, rebuilt only when it changes.
+    cell_region_t const& select_region();
+private:
+    cell_region_t m_select_region;
 };
 
 class canvas_box_t : public selector_box_t
@@ -343,9 +382,29 @@ protected:
 
     virtual void draw_tile(render_t& gc, unsigned tile, coord_t at) {}
     virtual void draw_tiles(render_t& gc) override;
+    // Draws a cell of a paste, whose value is in the format of tile_layer_t::get.
+    virtual void draw_paste_tile(render_t& gc, std::uint16_t value, coord_t at) { draw_tile(gc, value, at); }
 
     void draw_underlays(render_t& gc);
     void draw_overlays(render_t& gc);
+private:
+    void compose_paste_preview(grid_t<std::uint16_t> const& grid);
+
+    // What 'm_paste_preview' was drawn from: the paste, the layer deciding how its cells look,
+    // and the bitmaps they're drawn with.
+    struct paste_preview_key_t
+    {
+        unsigned paste_serial = 0;
+        tile_layer_t const* layer = nullptr;
+        unsigned bitmaps_serial = 0;
+
+        bool operator==(paste_preview_key_t const&) const = default;
+    };
+
+    cell_region_t m_paste_region; // Keyed by model_t::paste_serial.
+    bitmap_t m_paste_preview; // Keyed by 'm_paste_preview_key'.
+    paste_preview_key_t m_paste_preview_key;
+    cell_region_t m_stamp_region; // Keyed by the picker's revision, relative to its select_rect().
 };
 
 class editor_t : public wxPanel
@@ -353,7 +412,7 @@ class editor_t : public wxPanel
 public:
     undo_history_t history;
 
-    explicit editor_t(wxWindow* parent);
+    editor_t(wxWindow* parent, model_t& model);
 
     void on_update(wxUpdateUIEvent&) { on_update(); }
     virtual void on_update() {}
@@ -514,6 +573,7 @@ public:
                 new_collection.emplace_back(std::move(collection()[index]));
             }
             collection() = std::move(new_collection);
+            P::on_collection_change(model);
         }
     }
 
@@ -35,6 +35,10 @@ enum
     ID_SELECT_NONE,
     ID_SELECT_USAGE,
     ID_SELECT_INVERT,
+    ID_UNDO_BUDGET,
+    ID_EXPORT_LEVELS,
+    ID_EXPORT_COLUMNS,
+    ID_EXPORT_SHARED,
 };
 
 #endif
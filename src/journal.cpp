@@ -0,0 +1,714 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+// File layout: MAGIC, then records of
+//   u32 payload size, u32 payload checksum, payload.
+// Payloads start with a u64 sequence number and a u8 record_kind_t.
+// Integers are little-endian.
+static constexpr char MAGIC[8] = { 'M', 'F', 'J', 'R', 'N', 'L', '0', '1' };
+static constexpr std::size_t RECORD_HEADER = 8;
+
+// FNV-1a:
+static std::uint32_t checksum(std::uint8_t const* data, std::size_t size)
+{
+    std::uint32_t hash = 2166136261u;
+    for(std::size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// encoding ////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+static void put(std::vector<std::uint8_t>& out, T value)
+{
+    static_assert(std::is_integral_v<T>);
+    using U = std::make_unsigned_t<T>;
+    for(unsigned i = 0; i < sizeof(T); ++i)
+        out.push_back(std::uint8_t(U(value) >> (i * 8)));
+}
+
+static void put_str(std::vector<std::uint8_t>& out, std::string const& str)
+{
+    put<std::uint32_t>(out, str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+static void put_runs(std::vector<std::uint8_t>& out, tile_runs_t const& runs)
+{
+    put<std::uint32_t>(out, runs.size());
+    put<std::uint32_t>(out, runs.packets().size());
+    for(std::uint16_t packet : runs.packets())
+        put(out, packet);
+}
+
+// Throws std::runtime_error when reading past the end.
+class reader_t
+{
+public:
+    reader_t(std::uint8_t const* ptr, std::uint8_t const* end) : ptr(ptr), end(end) {}
+
+    template<typename T>
+    T get()
+    {
+        using U = std::make_unsigned_t<T>;
+        need(sizeof(T));
+        U value = 0;
+        for(unsigned i = 0; i < sizeof(T); ++i)
+            value |= U(*ptr++) << (i * 8);
+        return T(value);
+    }
+
+    std::string get_str()
+    {
+        std::size_t const size = get<std::uint32_t>();
+        need(size);
+        std::string ret(reinterpret_cast<char const*>(ptr), size);
+        ptr += size;
+        return ret;
+    }
+
+    tile_runs_t get_runs()
+    {
+        std::size_t const size = get<std::uint32_t>();
+        std::size_t const num_packets = get<std::uint32_t>();
+        need(num_packets * 2);
+        std::vector<std::uint16_t> packets(num_packets);
+        for(std::uint16_t& packet : packets)
+            packet = get<std::uint16_t>();
+        return tile_runs_t(size, std::move(packets));
+    }
+
+private:
+    std::uint8_t const* ptr;
+    std::uint8_t const* end;
+
+    void need(std::size_t size)
+    {
+        if(std::size_t(end - ptr) < size)
+            throw std::runtime_error("Journal record out of bounds.");
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// journal_t ///////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+journal_t::journal_t(model_t& model)
+: model(model)
+, m_writer(&journal_t::write_loop, this)
+{}
+
+journal_t::~journal_t()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_one();
+    m_writer.join();
+}
+
+std::filesystem::path journal_t::path_for(std::filesystem::path const& project)
+{
+    std::filesystem::path ret = project;
+    ret += EXTENSION;
+    return ret;
+}
+
+void journal_t::open(std::filesystem::path const& project)
+{
+    // Whatever was noted is in the file just saved.
+    m_pending_palette_num = false;
+    m_pending_tiles.clear();
+    m_pending_dimens.clear();
+    m_pending_objects.clear();
+    m_pending_chr.clear();
+    m_pending_metatile_nums.clear();
+
+    std::filesystem::path const path = path_for(project);
+    if(!m_path.empty() && m_path != path)
+        enqueue({ op_t::DISCARD, m_path });
+
+    m_path = path;
+    m_sequence = 0;
+    enqueue({ op_t::OPEN, m_path });
+}
+
+void journal_t::resume(std::filesystem::path const& project, replay_result_t const& replayed)
+{
+    if(!m_path.empty() && m_path != path_for(project))
+        enqueue({ op_t::DISCARD, m_path });
+
+    m_path = path_for(project);
+    m_sequence = replayed.last_sequence;
+    enqueue({ op_t::RESUME, m_path, {}, replayed.valid_size });
+}
+
+void journal_t::discard()
+{
+    m_pending_palette_num = false;
+    m_pending_tiles.clear();
+    m_pending_dimens.clear();
+    m_pending_objects.clear();
+    m_pending_chr.clear();
+    m_pending_metatile_nums.clear();
+
+    if(!m_path.empty())
+        enqueue({ op_t::DISCARD, m_path });
+    m_path.clear();
+}
+
+bool journal_t::failed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+}
+
+template<typename T>
+void journal_t::note_unique(std::vector<T>& vec, T value)
+{
+    if(std::find(vec.begin(), vec.end(), value) == vec.end())
+        vec.push_back(value);
+}
+
+void journal_t::note_tiles(tile_layer_t* layer, rect_t rect)
+{
+    if(!rect)
+        return;
+
+    for(auto& [pending_layer, pending_rect] : m_pending_tiles)
+    {
+        if(pending_layer == layer)
+        {
+            coord_t const c = { std::min(rect.c.x, pending_rect.c.x), std::min(rect.c.y, pending_rect.c.y) };
+            coord_t const e = { std::max(rect.e().x, pending_rect.e().x), std::max(rect.e().y, pending_rect.e().y) };
+            pending_rect = rect_from_2_coords(c, e - coord_t{ 1, 1 });
+            return;
+        }
+    }
+
+    m_pending_tiles.push_back({ layer, rect });
+}
+
+void journal_t::note(undo_t const& undo)
+{
+    if(m_path.empty())
+        return;
+
+    std::visit([&](auto const& u)
+    {
+        using T = std::decay_t<decltype(u)>;
+        if constexpr(std::is_same_v<T, undo_tiles_t>)
+            note_tiles(u.layer, u.rect);
+        else if constexpr(std::is_same_v<T, undo_palette_num_t>)
+            m_pending_palette_num = true;
+        else if constexpr(std::is_same_v<T, undo_metatile_num_t>)
+            note_unique(m_pending_metatile_nums, u.metatiles);
+        else if constexpr(std::is_same_v<T, undo_level_dimen_t>)
+        {
+            for(auto const& level : model.levels)
+                if(&level->metatile_layer == u.layer)
+                    note_unique(m_pending_dimens, level.get());
+        }
+        else if constexpr(std::is_same_v<T, undo_new_object_t>
+                          || std::is_same_v<T, undo_delete_object_t>
+                          || std::is_same_v<T, undo_edit_object_t>
+                          || std::is_same_v<T, undo_move_objects_t>
+                          || std::is_same_v<T, undo_level_objects_t>)
+        {
+            note_unique(m_pending_objects, u.level);
+        }
+        else if constexpr(std::is_same_v<T, undo_permute_mt_t>)
+        {
+            note_tiles(&u.metatiles->chr_layer, to_rect(u.metatiles->chr_layer.canvas_dimen()));
+            note_tiles(&u.metatiles->collision_layer, to_rect(u.metatiles->collision_layer.canvas_dimen()));
+            for(auto const& level : u.levels)
+                note_unique(m_pending_dimens, level.get());
+        }
+        else if constexpr(std::is_same_v<T, undo_permute_chr_t>)
+        {
+            note_unique(m_pending_chr, u.chr_name);
+            for(auto const& mt : u.metatiles)
+                note_tiles(&mt->chr_layer, to_rect(mt->chr_layer.canvas_dimen()));
+        }
+        else if constexpr(std::is_same_v<T, undo_chr_layers_t>)
+        {
+            for(auto const& mt : u.metatiles)
+                note_tiles(&mt->chr_layer, to_rect(mt->chr_layer.canvas_dimen()));
+        }
+        else if constexpr(std::is_same_v<T, undo_group_t>)
+        {
+            for(undo_t const& child : u.undos)
+                note(child);
+        }
+    }, undo);
+}
+
+int journal_t::level_index(level_model_t const* level) const
+{
+    for(unsigned i = 0; i < model.levels.size(); ++i)
+        if(model.levels[i].get() == level)
+            return i;
+    return -1;
+}
+
+bool journal_t::write_layer_target(std::vector<std::uint8_t>& out, tile_layer_t const* layer) const
+{
+    auto const target = [&](target_kind_t kind, unsigned index, std::string const& name)
+    {
+        put<std::uint8_t>(out, kind);
+        put<std::uint32_t>(out, index);
+        put_str(out, name);
+        return true;
+    };
+
+    if(layer == &model.palette.color_layer)
+        return target(TARGET_PALETTE, 0, {});
+    for(unsigned i = 0; i < model.metatiles.size(); ++i)
+    {
+        if(layer == &model.metatiles[i]->chr_layer)
+            return target(TARGET_CHR, i, model.metatiles[i]->name);
+        if(layer == &model.metatiles[i]->collision_layer)
+            return target(TARGET_COLLISION, i, model.metatiles[i]->name);
+    }
+    for(unsigned i = 0; i < model.levels.size(); ++i)
+        if(layer == &model.levels[i]->metatile_layer)
+            return target(TARGET_LEVEL, i, model.levels[i]->name);
+    return false;
+}
+
+void journal_t::begin_record(std::vector<std::uint8_t>& out, record_kind_t kind)
+{
+    out.resize(out.size() + RECORD_HEADER);
+    put<std::uint64_t>(out, m_sequence + 1);
+    put<std::uint8_t>(out, kind);
+}
+
+void journal_t::end_record(std::vector<std::uint8_t>& out, std::size_t start)
+{
+    std::size_t const payload = start + RECORD_HEADER;
+    std::vector<std::uint8_t> header;
+    put<std::uint32_t>(header, out.size() - payload);
+    put<std::uint32_t>(header, checksum(out.data() + payload, out.size() - payload));
+    std::copy(header.begin(), header.end(), out.begin() + start);
+    ++m_sequence;
+}
+
+void journal_t::flush()
+{
+    if(m_path.empty())
+        return;
+    if(!m_pending_palette_num && m_pending_tiles.empty() && m_pending_dimens.empty() && m_pending_objects.empty()
+       && m_pending_chr.empty() && m_pending_metatile_nums.empty())
+    {
+        return;
+    }
+
+    std::vector<std::uint8_t> out;
+
+    // Dimensions go first, so the tile records after them fit the levels they land in.
+    if(m_pending_palette_num)
+    {
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_PALETTE_NUM);
+        put<std::uint16_t>(out, model.palette.num);
+        end_record(out, start);
+    }
+
+    for(metatile_model_t const* metatiles : m_pending_metatile_nums)
+    {
+        auto it = std::find_if(model.metatiles.begin(), model.metatiles.end(), [&](auto const& ptr) { return ptr.get() == metatiles; });
+        if(it == model.metatiles.end())
+            continue;
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_METATILE_NUM);
+        put<std::uint32_t>(out, it - model.metatiles.begin());
+        put_str(out, metatiles->name);
+        put<std::uint16_t>(out, metatiles->num);
+        end_record(out, start);
+    }
+
+    for(level_model_t const* level : m_pending_dimens)
+    {
+        int const index = level_index(level);
+        if(index < 0)
+            continue;
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_LEVEL_DIMEN);
+        put<std::uint32_t>(out, index);
+        put_str(out, level->name);
+        put<std::int32_t>(out, level->dimen().w);
+        put<std::int32_t>(out, level->dimen().h);
+        put_runs(out, tile_runs_t(level->metatile_layer.tiles));
+        end_record(out, start);
+    }
+
+    for(level_model_t const* level : m_pending_objects)
+    {
+        int const index = level_index(level);
+        if(index < 0)
+            continue;
+        std::vector<std::uint16_t> vec;
+        for(object_t const& object : level->objects)
+            object.append_vec(model, vec);
+
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_LEVEL_OBJECTS);
+        put<std::uint32_t>(out, index);
+        put_str(out, level->name);
+        put<std::uint32_t>(out, level->objects.size());
+        put<std::uint32_t>(out, vec.size());
+        for(std::uint16_t word : vec)
+            put(out, word);
+        end_record(out, start);
+    }
+
+    for(std::string const& name : m_pending_chr)
+    {
+        chr_file_t const* file = model.chr_file(name);
+        if(!file)
+            continue;
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_CHR_ORDER);
+        put_str(out, name);
+        for(std::uint8_t index : file->order)
+            put(out, index);
+        end_record(out, start);
+    }
+
+    for(auto const& [layer, noted] : m_pending_tiles)
+    {
+        rect_t const rect = crop(noted, layer->canvas_dimen());
+        if(!rect)
+            continue;
+
+        std::size_t const start = out.size();
+        begin_record(out, RECORD_TILES);
+        if(!write_layer_target(out, layer))
+        {
+            out.resize(start);
+            continue;
+        }
+
+        std::vector<std::uint16_t> values(rect.d.w * rect.d.h);
+        layer->read_rect(rect, values.data());
+        put<std::int32_t>(out, rect.c.x);
+        put<std::int32_t>(out, rect.c.y);
+        put<std::int32_t>(out, rect.d.w);
+        put<std::int32_t>(out, rect.d.h);
+        put_runs(out, tile_runs_t(values.data(), values.size()));
+        end_record(out, start);
+    }
+
+    m_pending_palette_num = false;
+    m_pending_tiles.clear();
+    m_pending_dimens.clear();
+    m_pending_objects.clear();
+    m_pending_chr.clear();
+    m_pending_metatile_nums.clear();
+
+    if(!out.empty())
+        enqueue({ op_t::APPEND, {}, std::move(out) });
+}
+
+void journal_t::enqueue(op_t op)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ops.push_back(std::move(op));
+    }
+    m_cv.notify_one();
+}
+
+void journal_t::write_loop()
+{
+    FILE* fp = nullptr;
+    auto const close = [&]()
+    {
+        if(fp)
+            std::fclose(fp);
+        fp = nullptr;
+    };
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+        m_cv.wait(lock, [&]{ return m_stop || !m_ops.empty(); });
+        if(m_ops.empty())
+            break;
+
+        op_t op = std::move(m_ops.front());
+        m_ops.pop_front();
+        bool ok = !m_failed;
+        lock.unlock();
+
+        switch(op.type)
+        {
+        case op_t::OPEN:
+            close();
+            fp = std::fopen(op.path.string().c_str(), "wb");
+            ok = fp && std::fwrite(MAGIC, sizeof(MAGIC), 1, fp) == 1 && std::fflush(fp) == 0;
+            break;
+
+        case op_t::RESUME:
+            {
+                close();
+                std::error_code ec;
+                if(op.size < sizeof(MAGIC))
+                {
+                    fp = std::fopen(op.path.string().c_str(), "wb");
+                    ok = fp && std::fwrite(MAGIC, sizeof(MAGIC), 1, fp) == 1 && std::fflush(fp) == 0;
+                }
+                else
+                {
+                    std::filesystem::resize_file(op.path, op.size, ec);
+                    fp = std::fopen(op.path.string().c_str(), "ab");
+                    ok = !ec && fp;
+                }
+            }
+            break;
+
+        case op_t::APPEND:
+            if(ok && fp)
+                ok = std::fwrite(op.bytes.data(), op.bytes.size(), 1, fp) == 1 && std::fflush(fp) == 0;
+            break;
+
+        case op_t::DISCARD:
+            {
+                close();
+                std::error_code ec;
+                std::filesystem::remove(op.path, ec);
+            }
+            break;
+        }
+
+        lock.lock();
+        if(op.type == op_t::OPEN || op.type == op_t::RESUME)
+            m_failed = !ok;
+        else if(!ok)
+            m_failed = true;
+    }
+
+    close();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// recovery ////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<std::uint8_t> read_journal(std::filesystem::path const& path)
+{
+    std::vector<std::uint8_t> ret;
+    FILE* fp = std::fopen(path.string().c_str(), "rb");
+    if(!fp)
+        return ret;
+    std::uint8_t buffer[1 << 14];
+    while(std::size_t const n = std::fread(buffer, 1, sizeof(buffer), fp))
+        ret.insert(ret.end(), buffer, buffer + n);
+    std::fclose(fp);
+
+    if(ret.size() < sizeof(MAGIC) || std::memcmp(ret.data(), MAGIC, sizeof(MAGIC)) != 0)
+        ret.clear();
+    return ret;
+}
+
+bool journal_t::needs_recovery(std::filesystem::path const& project)
+{
+    std::filesystem::path const path = path_for(project);
+    std::error_code ec;
+    if(std::filesystem::file_size(path, ec) <= sizeof(MAGIC) + RECORD_HEADER || ec)
+        return false;
+
+    char magic[sizeof(MAGIC)] = {};
+    FILE* fp = std::fopen(path.string().c_str(), "rb");
+    if(!fp)
+        return false;
+    bool const ok = std::fread(magic, sizeof(magic), 1, fp) == 1;
+    std::fclose(fp);
+    return ok && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+journal_t::replay_result_t journal_t::replay(model_t& model, std::filesystem::path const& project)
+{
+    replay_result_t result;
+
+    std::vector<std::uint8_t> const data = read_journal(path_for(project));
+    if(data.empty())
+        return result;
+
+    auto const layer_target = [&](reader_t& in) -> tile_layer_t*
+    {
+        target_kind_t const kind = target_kind_t(in.get<std::uint8_t>());
+        std::size_t const index = in.get<std::uint32_t>();
+        std::string const name = in.get_str();
+
+        switch(kind)
+        {
+        case TARGET_PALETTE:
+            return &model.palette.color_layer;
+        case TARGET_CHR:
+        case TARGET_COLLISION:
+            if(index >= model.metatiles.size() || model.metatiles[index]->name != name)
+                return nullptr;
+            if(kind == TARGET_CHR)
+                return &model.metatiles[index]->chr_layer;
+            return &model.metatiles[index]->collision_layer;
+        case TARGET_LEVEL:
+            if(index >= model.levels.size() || model.levels[index]->name != name)
+                return nullptr;
+            return &model.levels[index]->metatile_layer;
+        default:
+            return nullptr;
+        }
+    };
+
+    auto const level_target = [&](reader_t& in) -> level_model_t*
+    {
+        std::size_t const index = in.get<std::uint32_t>();
+        std::string const name = in.get_str();
+        if(index >= model.levels.size() || model.levels[index]->name != name)
+            return nullptr;
+        return model.levels[index].get();
+    };
+
+    auto const decode = [&](reader_t& in, record_kind_t kind) -> undo_t
+    {
+        switch(kind)
+        {
+        case RECORD_TILES:
+            {
+                tile_layer_t* layer = layer_target(in);
+                rect_t rect;
+                rect.c.x = in.get<std::int32_t>();
+                rect.c.y = in.get<std::int32_t>();
+                rect.d.w = in.get<std::int32_t>();
+                rect.d.h = in.get<std::int32_t>();
+                tile_runs_t runs = in.get_runs();
+                if(!layer || !rect || rect.c.x < 0 || rect.c.y < 0
+                   || rect.e().x > layer->canvas_dimen().w || rect.e().y > layer->canvas_dimen().h
+                   || runs.size() != std::size_t(rect.d.w) * rect.d.h || !runs.valid())
+                {
+                    return {};
+                }
+                return undo_tiles_t{ layer, rect, std::move(runs) };
+            }
+
+        case RECORD_PALETTE_NUM:
+            return undo_palette_num_t{ in.get<std::uint16_t>() };
+
+        case RECORD_LEVEL_DIMEN:
+            {
+                level_model_t* level = level_target(in);
+                dimen_t dimen;
+                dimen.w = in.get<std::int32_t>();
+                dimen.h = in.get<std::int32_t>();
+                tile_runs_t runs = in.get_runs();
+                if(!level || dimen.w < 0 || dimen.h < 0
+                   || runs.size() != std::size_t(dimen.w) * dimen.h || !runs.valid())
+                {
+                    return {};
+                }
+                return undo_level_dimen_t{ &level->metatile_layer, dimen, std::move(runs) };
+            }
+
+        case RECORD_LEVEL_OBJECTS:
+            {
+                level_model_t* level = level_target(in);
+                std::size_t const num = in.get<std::uint32_t>();
+                std::vector<std::uint16_t> vec(in.get<std::uint32_t>());
+                for(std::uint16_t& word : vec)
+                    word = in.get<std::uint16_t>();
+                if(!level)
+                    return {};
+
+                undo_level_objects_t ret = { level, {}, model.class_layouts };
+                std::uint16_t const* ptr = vec.data();
+                for(std::size_t i = 0; i < num; ++i)
+                    ret.objects.emplace_back().from_vec(model, ptr, vec.data() + vec.size());
+                return ret;
+            }
+
+        case RECORD_CHR_ORDER:
+            {
+                std::string const name = in.get_str();
+                tile_lut_t order;
+                for(std::uint8_t& index : order)
+                    index = in.get<std::uint8_t>();
+                std::array<bool, 256> seen = {};
+                for(std::uint8_t index : order)
+                    if(std::exchange(seen[index], true))
+                        return {}; // Not a permutation.
+                chr_file_t const* file = model.chr_file(name);
+                if(!file)
+                    return {};
+
+                // The record holds the order from disk; reorder relative to where the tiles are now.
+                tile_lut_t const current = invert_lut(file->order);
+                tile_lut_t lut;
+                for(unsigned i = 0; i < 256; ++i)
+                    lut[i] = order[current[i]];
+                return undo_permute_chr_t{ name, {}, lut };
+            }
+
+        case RECORD_METATILE_NUM:
+            {
+                std::size_t const index = in.get<std::uint32_t>();
+                std::string const name = in.get_str();
+                std::uint16_t const num = in.get<std::uint16_t>();
+                if(index >= model.metatiles.size() || model.metatiles[index]->name != name || num < 1 || num > 256)
+                    return {};
+                return undo_metatile_num_t{ model.metatiles[index].get(), num };
+            }
+
+        default:
+            throw std::runtime_error("Unknown journal record.");
+        }
+    };
+
+    std::size_t pos = sizeof(MAGIC);
+    result.valid_size = pos;
+    while(data.size() - pos >= RECORD_HEADER)
+    {
+        reader_t header(&data[pos], &data[pos] + RECORD_HEADER);
+        std::size_t const size = header.get<std::uint32_t>();
+        std::uint32_t const sum = header.get<std::uint32_t>();
+        std::uint8_t const* payload = &data[pos] + RECORD_HEADER;
+
+        if(data.size() - pos - RECORD_HEADER < size || checksum(payload, size) != sum)
+            break;
+
+        try
+        {
+            reader_t in(payload, payload + size);
+            std::uint64_t const sequence = in.get<std::uint64_t>();
+            if(sequence != result.last_sequence + 1)
+                break;
+            undo_t const undo = decode(in, record_kind_t(in.get<std::uint8_t>()));
+
+            if(std::holds_alternative<std::monostate>(undo))
+                ++result.skipped;
+            else
+            {
+                model.undo(undo);
+                ++result.applied;
+            }
+            result.last_sequence = sequence;
+        }
+        catch(std::runtime_error const&)
+        {
+            break;
+        }
+
+        pos += RECORD_HEADER + size;
+        result.valid_size = pos;
+    }
+
+    return result;
+}
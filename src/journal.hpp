@@ -0,0 +1,136 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "model.hpp"
+
+// An append-only log of edits, kept next to the project so they can be recovered after a crash.
+//
+// Records are redo records: each holds the state part of the project was left in, such as a rect
+// of tiles or a level's objects, and replays through model_t's undo visitors.
+// Undo records are pushed before their edit happens, so the journal only notes what a record touches,
+// then captures that state on the next flush(). Capturing current state makes the records idempotent,
+// so replaying them in order lands on the state of the last flush.
+//
+// Only edits that go through undo_history_t are logged. Renaming, adding or removing tabs,
+// and editing object classes or CHR paths aren't; records whose target no longer matches are skipped.
+// Reordered CHR tiles are logged as their order relative to the file on disk, which is only
+// rewritten when the project is saved.
+//
+// Writes happen on a background thread, so the UI never waits on the disk.
+class journal_t
+{
+public:
+    static constexpr char const* EXTENSION = ".journal";
+
+    explicit journal_t(model_t& model);
+    // Finishes the writes already handed over. Edits noted since then are dropped without reading the model,
+    // which is mid-destruction when its journal goes, so flush() first to keep them.
+    ~journal_t();
+
+    journal_t(journal_t const&) = delete;
+    journal_t& operator=(journal_t const&) = delete;
+
+    static std::filesystem::path path_for(std::filesystem::path const& project);
+
+    struct replay_result_t
+    {
+        std::size_t applied = 0;
+        std::size_t skipped = 0; // Records whose target no longer matches.
+        std::uint64_t last_sequence = 0;
+        std::uintmax_t valid_size = 0; // In bytes, up to the end of the last intact record.
+    };
+
+    // Starts journaling for 'project' with an empty journal. Call after every successful save.
+    // A journal open at another path is deleted, as its project was just saved elsewhere.
+    void open(std::filesystem::path const& project);
+    // Keeps appending to a journal that was just replayed, dropping any torn tail.
+    void resume(std::filesystem::path const& project, replay_result_t const& replayed);
+    // Deletes the journal and stops journaling.
+    void discard();
+
+    // Remembers what 'undo' touches, so that state gets captured at the next flush().
+    void note(undo_t const& undo);
+    // Captures everything noted and hands it to the writer. Cheap when nothing is pending.
+    void flush();
+
+    // True if the writer hit an I/O error; journaling stops until the next open().
+    bool failed() const;
+
+    // True if 'project' has a journal holding records, meaning edits since its last save were never checkpointed.
+    static bool needs_recovery(std::filesystem::path const& project);
+
+    // Applies the journal of 'project' to 'model', which should be freshly read from that project.
+    // A torn or corrupt tail, as left by a crash mid-write, ends the replay.
+    static replay_result_t replay(model_t& model, std::filesystem::path const& project);
+
+private:
+    enum target_kind_t : std::uint8_t
+    {
+        TARGET_PALETTE,
+        TARGET_CHR,
+        TARGET_COLLISION,
+        TARGET_LEVEL,
+    };
+
+    enum record_kind_t : std::uint8_t
+    {
+        RECORD_TILES,
+        RECORD_PALETTE_NUM,
+        RECORD_LEVEL_DIMEN,
+        RECORD_LEVEL_OBJECTS,
+        RECORD_CHR_ORDER,
+        RECORD_METATILE_NUM,
+    };
+
+    struct op_t
+    {
+        enum { OPEN, RESUME, APPEND, DISCARD } type;
+        std::filesystem::path path;
+        std::vector<std::uint8_t> bytes;
+        std::uintmax_t size = 0; // For RESUME.
+    };
+
+    model_t& model;
+
+    std::filesystem::path m_path; // Empty while not journaling.
+    std::uint64_t m_sequence = 0;
+
+    // Noted since the last flush:
+    bool m_pending_palette_num = false;
+    std::vector<std::pair<tile_layer_t*, rect_t>> m_pending_tiles; // One bounding rect per layer.
+    std::vector<level_model_t*> m_pending_dimens;
+    std::vector<level_model_t*> m_pending_objects;
+    std::vector<std::string> m_pending_chr; // CHR file names.
+    std::vector<metatile_model_t*> m_pending_metatile_nums;
+
+    // Shared with the writer thread:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<op_t> m_ops;
+    bool m_stop = false;
+    bool m_failed = false;
+    std::thread m_writer;
+
+    void note_tiles(tile_layer_t* layer, rect_t rect);
+    template<typename T>
+    static void note_unique(std::vector<T>& vec, T value);
+
+    void begin_record(std::vector<std::uint8_t>& out, record_kind_t kind);
+    void end_record(std::vector<std::uint8_t>& out, std::size_t start);
+    bool write_layer_target(std::vector<std::uint8_t>& out, tile_layer_t const* layer) const;
+    int level_index(level_model_t const* level) const;
+
+    void enqueue(op_t op);
+    void write_loop();
+};
+
+#endif
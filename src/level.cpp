@@ -1,6 +1,10 @@
 #include "level.hpp"
 
 #include <ranges>
+#include <tuple>
+#include <utility>
+
+#include "journal.hpp"
 
 void draw_metatile(level_model_t const& model, render_t& gc, std::uint8_t tile, coord_t at)
 {
@@ -19,13 +23,14 @@ void draw_metatile(level_model_t const& model, render_t& gc, std::uint8_t tile,
 object_field_t::object_field_t(wxWindow* parent, model_t& model, object_t& object, class_field_t const& field, bool picker)
 : wxPanel(parent, wxID_ANY)
 , object(object)
-, field_name(field.name)
+, slot(field.slot)
 , model(model)
 {
     wxBoxSizer* row_sizer = new wxBoxSizer(wxHORIZONTAL);
 
-    wxStaticText* label = new wxStaticText(this, wxID_ANY, field.type + " " + field_name, wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    wxTextCtrl* entry = new wxTextCtrl(this, wxID_ANY, object.fields[field_name]);
+    wxStaticText* label = new wxStaticText(this, wxID_ANY, field.type + " " + field.name, wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    // Read-only, as the non-const overload grows 'fields' and would count as an edit.
+    wxTextCtrl* entry = new wxTextCtrl(this, wxID_ANY, std::as_const(object).field(slot));
     entry->SetMinSize(wxSize(picker ? 96 : 300, 24));
 
     row_sizer->Add(label, wxSizerFlags().Proportion(1).Center());
@@ -39,7 +44,7 @@ object_field_t::object_field_t(wxWindow* parent, model_t& model, object_t& objec
 
 void object_field_t::on_entry(wxCommandEvent& event)
 { 
-    object.fields[field_name] = event.GetString().ToStdString(); 
+    object.field(slot) = event.GetString().ToStdString(); 
     model.modify();
 }
 
@@ -144,6 +149,7 @@ object_editor_t::object_editor_t(wxWindow* parent, model_t& model, object_t& obj
 
     combo->Bind(wxEVT_COMBOBOX, &object_editor_t::on_combo_select, this);
     combo->Bind(wxEVT_TEXT, &object_editor_t::on_combo_text, this);
+    combo->Bind(wxEVT_KILL_FOCUS, &object_editor_t::on_combo_focus, this);
     if(name)
         name->Bind(wxEVT_TEXT, &object_editor_t::on_name, this);
     if(x_ctrl)
@@ -158,7 +164,7 @@ void object_editor_t::update_classes()
     combo->Clear();
     for(auto const& ptr : model.object_classes)
         combo->Append(ptr->name);
-    combo->SetValue(oclass);
+    combo->SetValue(model.class_name(oclass));
 }
 
 void object_editor_t::load_fields()
@@ -192,16 +198,9 @@ void object_editor_t::load_object()
             y_ctrl->SetValue(object.position.y);
     }
 
-    for(auto const& ptr : model.object_classes)
-    {
-        if(ptr->name == object.oclass)
-        {
-            oc = ptr;
-            break;
-        }
-    }
+    oc = model.object_class_ptr(object.oclass);
 
-    combo->SetValue(object.oclass);
+    combo->SetValue(model.class_name(object.oclass));
     if(name)
         name->SetValue(object.name);
 
@@ -213,12 +212,15 @@ void object_editor_t::on_combo_select(wxCommandEvent& event)
     int const index = event.GetSelection();
     if(index >= 0 && index < model.object_classes.size())
     {
+        auto const prev = std::move(oc);
         oc = model.object_classes[index];
         if(oc)
         {
-            if(object.oclass != oc->name)
+            class_id_t const id = model.class_id(oc->name);
+            if(object.oclass != id)
                 model.modify();
-            object.oclass = oc->name;
+            object.oclass = id;
+            object.migrate_fields(prev.get(), oc.get());
         }
     }
 
@@ -227,22 +229,49 @@ void object_editor_t::on_combo_select(wxCommandEvent& event)
 
 void object_editor_t::on_combo_text(wxCommandEvent& event)
 {
-    object.oclass = combo->GetValue();
+    // Partial names are looked up without interning them, so typing doesn't grow the class table.
+    // Names matching no class are only interned once committed, by commit_class().
+    std::string const name = combo->GetValue().ToStdString();
+    if(!model.find_class(name))
+        return;
 
-    for(auto const& ptr : model.object_classes)
+    object.oclass = model.class_id(name);
+
+    // 'oc' keeps the class the fields are laid out for while the name is being typed.
+    if(auto ptr = model.object_class_ptr(object.oclass))
     {
-        if(ptr->name == object.oclass)
+        if(oc != ptr)
         {
-            if(oc != ptr)
-                model.modify();
-            oc = ptr;
-            break;
+            object.migrate_fields(oc.get(), ptr.get());
+            model.modify();
         }
+        oc = std::move(ptr);
     }
 
     load_fields();
 }
 
+void object_editor_t::on_combo_focus(wxFocusEvent& event)
+{
+    commit_class();
+    event.Skip();
+}
+
+void object_editor_t::commit_class()
+{
+    class_id_t const prev = object.oclass;
+    model.set_class(object, combo->GetValue().ToStdString(), oc);
+    if(object.oclass != prev)
+        model.modify();
+
+    // The name's ID can already be laid out for another class, as one deleted:
+    if(oc != model.class_layouts[object.oclass])
+    {
+        oc = model.class_layouts[object.oclass];
+        load_fields();
+    }
+}
+
 void object_editor_t::on_name(wxCommandEvent& event)
 { 
     if(object.name != event.GetString().ToStdString())
@@ -317,6 +346,13 @@ object_dialog_t::object_dialog_t(wxWindow* parent, model_t& model, object_t& obj
     reset_button->Bind(wxEVT_BUTTON, &object_editor_t::on_reset, editor);
 }
 
+void object_dialog_t::EndModal(int ret_code)
+{
+    // Closing doesn't always take focus from the class combo first:
+    editor->commit_class();
+    wxDialog::EndModal(ret_code);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // metatile_picker_t //////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -380,55 +416,64 @@ void level_canvas_t::draw_tiles(render_t& gc)
     gc.SetLogicalScale(1.0f / scale, 1.0f / scale);
 #endif
 
+    // Gather the visible objects in index order, which is their drawing order.
+    // Consecutive objects sharing a (class, selected, in bounds) key share pens and brushes,
+    // so state only changes between runs:
+    using batch_key_t = std::tuple<class_id_t, bool, bool>;
+    std::vector<std::pair<batch_key_t, coord_t>> visible_objects;
+
+    rect_t const visible = visible_pixels();
+    dimen_t const level_pixels = { level->dimen().w * 16, level->dimen().h * 16 };
+
     for(unsigned i = 0; i < level->objects.size(); ++i)
     {
         auto const& object = level->objects[i];
-        coord_t const at = vec_mul(crop(object.position) + to_coord(margin()), scale);
+        coord_t const cropped = crop(object.position);
 
-        if(level->object_selector.count(i))
-        {
-            gc.SetPen(wxPen());
-            gc.SetBrush(wxBrush(wxColor(255, 255, 255, 128)));
-        }
-        else
-        {
-            gc.SetPen(wxPen());
-            gc.SetBrush(wxBrush(wxColor(255, 255, 255, 32)));
-        }
-        draw_circle(gc, at.x, at.y, object_radius() * 3 / 2);
+        if(!in_bounds(cropped, visible))
+            continue;
+
+        bool const selected = level->object_selector.count(level->objects.handle(i));
+        bool const in_level = in_bounds(object.position, level_pixels);
+
+        visible_objects.push_back({ { object.oclass, selected, in_level }, vec_mul(cropped + to_coord(margin()), scale) });
     }
 
-    for(unsigned i = 0; i < level->objects.size(); ++i)
+    gc.SetPen(wxPen());
+    for(std::size_t i = 0; i < visible_objects.size(); ++i)
     {
-        auto const& object = level->objects[i];
+        auto const& [key, at] = visible_objects[i];
+        bool const selected = std::get<1>(key);
 
-        auto style = wxPENSTYLE_SOLID;
-        if(!in_bounds(object.position, vec_mul(level->metatile_layer.tiles.dimen(), 16)))
-            style = wxPENSTYLE_DOT;
+        if(i == 0 || selected != std::get<1>(visible_objects[i-1].first))
+            gc.SetBrush(wxBrush(wxColor(255, 255, 255, selected ? 128 : 32)));
 
-        rgb_t color = { 120, 120, 120 };
+        draw_circle(gc, at.x, at.y, object_radius() * 3 / 2);
+    }
 
-        for(auto const& ptr : model.object_classes)
+    for(std::size_t i = 0; i < visible_objects.size(); ++i)
+    {
+        auto const& [key, at] = visible_objects[i];
+
+        if(i == 0 || key != visible_objects[i-1].first)
         {
-            if(ptr->name == object.oclass)
+            auto const [id, selected, in_level] = key;
+            auto const style = in_level ? wxPENSTYLE_SOLID : wxPENSTYLE_DOT;
+            object_class_t const* oc = model.object_class(id);
+            rgb_t const color = oc ? oc->color : rgb_t{ 120, 120, 120 };
+
+            if(selected)
             {
-                color = ptr->color;
-                break;
+                gc.SetPen(wxPen(wxColor(color.r, color.g, color.b), 0, style));
+                gc.SetBrush(wxBrush(wxColor(color.r, color.g, color.b, 127)));
+            }
+            else
+            {
+                gc.SetPen(wxPen(wxColor(color.r, color.g, color.b, 200), 0, style));
+                gc.SetBrush(wxBrush(wxColor(color.r, color.g, color.b, 60)));
             }
         }
 
-        if(level->object_selector.count(i))
-        {
-            gc.SetPen(wxPen(wxColor(color.r, color.g, color.b), 0, style));
-            gc.SetBrush(wxBrush(wxColor(color.r, color.g, color.b, 127)));
-        }
-        else
-        {
-            gc.SetPen(wxPen(wxColor(color.r, color.g, color.b, 200), 0, style));
-            gc.SetBrush(wxBrush(wxColor(color.r, color.g, color.b, 60)));
-        }
-
-        coord_t const at = vec_mul(crop(object.position) + to_coord(margin()), scale);
         draw_circle(gc, at.x, at.y, object_radius());
         draw_point(gc, at.x, at.y);
     }
@@ -478,6 +523,37 @@ void level_canvas_t::draw_tiles(render_t& gc)
     }
 }
 
+rect_t level_canvas_t::visible_pixels() const
+{
+    wxSize const size = GetClientSize();
+    coord_t const c0 = from_screen({ 0, 0 }, { 1, 1 });
+    coord_t const c1 = from_screen({ size.GetWidth(), size.GetHeight() }, { 1, 1 });
+
+    // Pad by the largest radius drawn, so partially visible objects aren't culled:
+    int const pad = std::ceil(object_radius() * 3 / 2);
+    return rect_from_2_coords(c0 - coord_t{ pad, pad }, c1 + coord_t{ pad, pad });
+}
+
+std::vector<object_handle_t> level_canvas_t::objects_at(coord_t at)
+{
+    coord_t const pixel256 = from_screen(at, {1,1}, 256);
+    coord_t const pixel = from_screen(at, {1,1});
+    int const r = std::ceil(object_radius() / scale) + 1;
+
+    std::vector<object_handle_t> ret;
+    level->object_index().for_each_near({ pixel - coord_t{ r, r }, { r*2 + 1, r*2 + 1 } }, [&](object_handle_t handle)
+    {
+        coord_t const at = crop(level->objects.at(handle).position) + to_coord(margin());
+        if(e_dist(vec_mul(at, 256), pixel256) <= object_radius() * 256.0 / scale)
+            ret.push_back(handle);
+    });
+    std::sort(ret.begin(), ret.end(), [&](object_handle_t a, object_handle_t b)
+    {
+        return level->objects.index(a) < level->objects.index(b);
+    });
+    return ret;
+}
+
 void level_canvas_t::on_down(mouse_button_t mb, coord_t at)
 {
     auto const save_objects = [&]()
@@ -486,129 +562,98 @@ void level_canvas_t::on_down(mouse_button_t mb, coord_t at)
             return;
 
         undo_move_objects_t undo = { level.get() };
-        for(int i : level->object_selector)
+        for(object_handle_t handle : level->object_selector)
         {
-            if(i < level->objects.size())
+            if(object_t const* object = level->objects.get(handle))
             {
-                auto const& object = level->objects[i];
-                undo.indices.push_back(i);
-                undo.positions.push_back(object.position);
+                undo.handles.push_back(handle);
+                undo.positions.push_back(object->position);
             }
         }
 
-        static_cast<level_editor_t*>(GetParent())->history.push(std::move(undo));
+        static_cast<level_editor_t*>(GetParent())->history.push(std::move(undo), { level.get(), MERGE_MOVE_OBJECTS });
     };
 
     if(level->current_layer == OBJECT_LAYER)
     {
-        coord_t const pixel256 = from_screen(at, {1,1}, 256);
         coord_t const pixel = from_screen(at, {1,1});
         bool const shift = wxGetKeyState(WXK_SHIFT);
         selecting_objects = false;
 
+        // Sorted by index; later objects are drawn on top.
+        std::vector<object_handle_t> const hits = objects_at(at);
+
         if(model.tool == TOOL_DROPPER || wxGetKeyState(WXK_CONTROL))
         {
-            for(int i = level->objects.size() - 1; i >= 0; --i)
+            if(!hits.empty())
             {
-                auto const& object = level->objects[i];
-                coord_t const at = crop(object.position) + to_coord(margin());
-
-                if(e_dist(vec_mul(at, 256), pixel256) <= object_radius() * 256.0 / scale)
-                {
-                    model.object_picker = object;
-                    static_cast<level_editor_t*>(GetParent())->object_editor->load_object();
-                    break;
-                }
+                model.object_picker = level->objects.at(hits.back());
+                static_cast<level_editor_t*>(GetParent())->object_editor->load_object();
             }
         }
 
         if((model.tool == TOOL_STAMP || model.tool == TOOL_SELECT) && !model.paste)
         {
-            for(int i : level->object_selector)
+            for(object_handle_t handle : hits)
             {
-                if(i >= level->objects.size())
+                if(!level->object_selector.count(handle))
                     continue;
 
-                auto& object = level->objects[i];
-                coord_t const at = crop(object.position) + to_coord(margin());
-
-                if(e_dist(vec_mul(at, 256), pixel256) <= object_radius() * 256.0 / scale)
+                if(mb == MBTN_LEFT)
                 {
-                    if(mb == MBTN_LEFT)
+                    CallAfter([this, handle]()
                     {
-                        CallAfter([&, i]()
-                        {
-                            object_t prev = object;
+                        object_t* object = level->objects.get(handle);
+                        if(!object)
+                            return;
 
-                            object_dialog_t dialog(this, model, object);
-                            dialog.ShowModal();
-                            dialog.Destroy();
-                            SetFocus();
+                        object_t prev = *object;
 
-                            if(prev != object)
-                                static_cast<level_editor_t*>(GetParent())->history.push(undo_edit_object_t{ level.get(), i, std::move(prev) });
-                        });
-                        goto selected;
-                    }
+                        object_dialog_t dialog(this, model, *object);
+                        dialog.ShowModal();
+                        dialog.Destroy();
+                        SetFocus();
+
+                        if(prev != *object)
+                        {
+                            level->object_moved(handle, prev.position);
+                            static_cast<level_editor_t*>(GetParent())->history.push(undo_edit_object_t{ level.get(), handle, std::move(prev), model.class_layouts });
+                        }
+                    });
+                    goto selected;
                 }
             }
 
-            for(int i = level->objects.size() - 1; i >= 0; --i)
+            if(!hits.empty())
             {
-                auto const& object = level->objects[i];
-                coord_t const at = crop(object.position) + to_coord(margin());
-
-                if(e_dist(vec_mul(at, 256), pixel256) <= object_radius() * 256.0 / scale)
+                object_handle_t const handle = hits.back();
+                if(mb == MBTN_LEFT)
                 {
-                    if(mb == MBTN_LEFT)
+                    if(!shift)
+                        level->object_selector.clear();
+                    level->object_selector.insert(handle);
+                }
+                else if(mb == MBTN_RIGHT)
+                {
+                    if(!level->object_selector.count(handle))
                     {
                         if(!shift)
                             level->object_selector.clear();
-                        level->object_selector.insert(i);
+                        level->object_selector.insert(handle);
                     }
-                    else if(mb == MBTN_RIGHT)
-                    {
-                        if(!level->object_selector.count(i))
-                        {
-                            if(!shift)
-                                level->object_selector.clear();
-                            level->object_selector.insert(i);
-                        }
 
-                        if(!dragging_objects)
-                            save_objects();
-
-                        dragging_objects = true;
-                        drag_last = pixel;
-                    }
+                    if(!dragging_objects)
+                        save_objects();
 
-                    goto selected;
+                    dragging_objects = true;
+                    drag_last = pixel;
                 }
+
+                goto selected;
             }
 
             if(model.tool == TOOL_SELECT)
             {
-                if(mb == MBTN_RIGHT)
-                {
-                    for(int i = level->objects.size() - 1; i >= 0; --i)
-                    {
-                        auto const& object = level->objects[i];
-                        coord_t const at = crop(object.position) + to_coord(margin());
-
-                        if(e_dist(vec_mul(at, 256), pixel256) <= object_radius() * 256.0 / scale)
-                        {
-                            if(!shift && !level->object_selector.count(i))
-                                level->object_selector.clear();
-                            level->object_selector.insert(i);
-                            if(!dragging_objects)
-                                save_objects();
-                            dragging_objects = true;
-                            drag_last = pixel;
-                            return;
-                        }
-                    }
-                }
-
                 object_select_start = at;
                 selecting_objects = true;
                 return;
@@ -619,14 +664,12 @@ void level_canvas_t::on_down(mouse_button_t mb, coord_t at)
 
                 if(mb == MBTN_LEFT && !dragging_objects)
                 {
-                    level->object_selector.insert(level->objects.size());
-
                     object_t object = model.object_picker;
                     object.position = pixel;
 
-
-                    static_cast<level_editor_t*>(GetParent())->history.push(undo_new_object_t{ level.get(), { level->objects.size() } });
-                    level->objects.push_back(std::move(object));
+                    object_handle_t const handle = level->push_object(std::move(object));
+                    level->object_selector.insert(handle);
+                    static_cast<level_editor_t*>(GetParent())->history.push(undo_new_object_t{ level.get(), { handle } });
 
                     dragging_objects = true;
                     drag_last = pixel;
@@ -661,14 +704,12 @@ void level_canvas_t::on_up(mouse_button_t mb, coord_t at)
                 {
                     undo_new_object_t undo = { level.get() };
 
-                    for(auto const& object : *objects)
+                    for(object_t object : *objects)
                     {
-                        undo.indices.push_back(level->objects.size());
-                        auto& new_object = level->objects.emplace_back(object);
-                        new_object.position += from_screen(at, {1,1});
+                        object.position += from_screen(at, {1,1});
+                        undo.handles.push_back(level->push_object(std::move(object)));
                     }
 
-                    std::sort(undo.indices.begin(), undo.indices.end(), std::greater<>());
                     static_cast<level_editor_t*>(GetParent())->history.push(std::move(undo));
                 }
 
@@ -682,6 +723,12 @@ void level_canvas_t::on_up(mouse_button_t mb, coord_t at)
         }
 
         bool const shift = wxGetKeyState(WXK_SHIFT);
+
+        // The drag was journaled as it began, which may have been flushed mid-drag.
+        // Noting it again captures where the objects ended up.
+        if(dragging_objects)
+            if(journal_t* journal = static_cast<level_editor_t*>(GetParent())->history.journal)
+                journal->note(undo_move_objects_t{ level.get() });
         dragging_objects = false;
 
         if(selecting_objects && model.tool == TOOL_SELECT)
@@ -691,19 +738,16 @@ void level_canvas_t::on_up(mouse_button_t mb, coord_t at)
 
             rect_t const r = rect_from_2_coords(from_screen(object_select_start, {1,1}), from_screen(at, {1,1}));
 
-            for(int i = 0; i < level->objects.size(); ++i)
+            level->object_index().for_each_near(r, [&](object_handle_t handle)
             {
-                auto const& object = level->objects[i];
-                coord_t const at = crop(object.position);
-
-                if(in_bounds(at, r))
+                if(in_bounds(crop(level->objects.at(handle).position), r))
                 {
                     if(mb == MBTN_LEFT)
-                        level->object_selector.insert(i);
+                        level->object_selector.insert(handle);
                     else
-                        level->object_selector.erase(i);
+                        level->object_selector.erase(handle);
                 }
-            }
+            });
         }
     }
 
@@ -717,9 +761,9 @@ void level_canvas_t::on_motion(coord_t at)
     {
         coord_t const pixel = from_screen(at, {1,1});
 
-        for(int i : level->object_selector)
-            if(i < level->objects.size())
-                level->objects[i].position += (pixel - drag_last);
+        for(object_handle_t handle : level->object_selector)
+            if(object_t const* object = level->objects.get(handle))
+                level->move_object(handle, object->position + (pixel - drag_last));
 
         drag_last = pixel;
 
@@ -735,7 +779,7 @@ void level_canvas_t::on_motion(coord_t at)
 ////////////////////////////////////////////////////////////////////////////////
 
 level_editor_t::level_editor_t(wxWindow* parent, model_t& model, std::shared_ptr<level_model_t> level)
-: editor_t(parent)
+: editor_t(parent, model)
 , model(model)
 , level(level)
 {
@@ -912,8 +956,7 @@ void level_editor_t::on_change_palette(wxSpinEvent& event)
 
 void level_editor_t::on_change_width(wxSpinEvent& event)
 {
-    if(!history.on_top<undo_level_dimen_t>())
-        history.push(level->metatile_layer.save());
+    history.push(level->metatile_layer.save(), { level.get(), MERGE_LEVEL_DIMEN, true });
     int const w = event.GetPosition(); 
     level->resize({ w, level->dimen().h });
     model.modify();
@@ -923,8 +966,7 @@ void level_editor_t::on_change_width(wxSpinEvent& event)
 
 void level_editor_t::on_change_height(wxSpinEvent& event)
 {
-    if(!history.on_top<undo_level_dimen_t>())
-        history.push(level->metatile_layer.save());
+    history.push(level->metatile_layer.save(), { level.get(), MERGE_LEVEL_DIMEN, true });
     int const h = event.GetPosition(); 
     level->resize({ level->dimen().w, h });
     model.modify();
@@ -959,8 +1001,8 @@ void level_editor_t::model_refresh()
 
 void level_editor_t::load_metatiles()
 {
-    auto* chr_file = lookup_name(level->chr_name, model.chr_files);
-    auto* metatiles = lookup_name_ptr(level->metatiles_name, model.metatiles).get();
+    auto* chr_file = model.chr_file(level->chr_name);
+    auto* metatiles = model.metatile_set(level->metatiles_name).get();
     if(chr_file && metatiles)
     {
         level->refresh_metatiles(*metatiles, chr_file->chr, 
@@ -1022,17 +1064,8 @@ void level_editor_t::on_delete(wxCommandEvent& event)
     if(level->object_selector.empty())
         return;
 
-    undo_delete_object_t undo = { level.get() };
-
-    for(int i : level->object_selector)
-        if(i < level->objects.size())
-            undo.objects.emplace_back(i, level->objects.at(i));
-
-    history.push(std::move(undo));
-
-    for(int i : level->object_selector | std::views::reverse)
-        if(i < level->objects.size())
-            level->objects.erase(level->objects.begin() + i);
+    std::vector<object_handle_t> const handles(level->object_selector.begin(), level->object_selector.end());
+    history.push(undo_delete_object_t{ level.get(), level->erase_objects(handles), model.class_layouts });
 
     level->object_selector.clear();
     model.modify();
@@ -1052,44 +1085,29 @@ tile_copy_t level_editor_t::copy(bool cut)
     {
         std::vector<object_t> objects;
 
-        coord_t avg = {};
-        unsigned count = 0;
-        for(int i : level->object_selector)
-        {
-            if(i >= level->objects.size())
-                continue;
-            avg += level->objects.at(i).position;
-            count += 1;
-        }
+        // Copied last to first:
+        std::vector<object_handle_t> selected;
+        for(int i = level->objects.size() - 1; i >= 0; --i)
+            if(level->object_selector.count(level->objects.handle(i)))
+                selected.push_back(level->objects.handle(i));
 
-        if(count > 0)
-            avg = vec_div(avg, count);
-
-        if(cut && !level->object_selector.empty())
-        {
-            undo_delete_object_t undo = { level.get() };
-
-            for(int i : level->object_selector)
-                if(i < level->objects.size())
-                    undo.objects.emplace_back(i, level->objects.at(i));
+        coord_t avg = {};
+        for(object_handle_t handle : selected)
+            avg += level->objects.at(handle).position;
 
-            history.push(std::move(undo));
-        }
+        if(!selected.empty())
+            avg = vec_div(avg, selected.size());
 
-        for(int i : level->object_selector | std::views::reverse)
+        for(object_handle_t handle : selected)
         {
-            if(i >= level->objects.size())
-                continue;
-
-            auto& copied = objects.emplace_back(level->objects.at(i));
+            auto& copied = objects.emplace_back(level->objects.at(handle));
             copied.position -= avg;
-            
-            if(cut)
-                level->objects.erase(level->objects.begin() + i);
         }
 
         if(cut)
         {
+            if(!selected.empty())
+                history.push(undo_delete_object_t{ level.get(), level->erase_objects(selected), model.class_layouts });
             level->object_selector.clear();
             Refresh();
         }
@@ -1106,8 +1124,8 @@ void level_editor_t::select_all(bool select)
     {
         if(select)
         {
-            for(unsigned i = 0; i < level->objects.size(); ++i)
-                level->object_selector.insert(i);
+            for(object_handle_t handle : level->objects.handles())
+                level->object_selector.insert(handle);
         }
         else
             level->object_selector.clear();
@@ -1123,9 +1141,9 @@ void level_editor_t::select_invert()
     {
         decltype(level->object_selector) new_selector;
 
-        for(unsigned i = 0; i < level->objects.size(); ++i)
-            if(level->object_selector.count(i) == 0)
-                new_selector.insert(i);
+        for(object_handle_t handle : level->objects.handles())
+            if(level->object_selector.count(handle) == 0)
+                new_selector.insert(handle);
 
         level->object_selector = std::move(new_selector);
 
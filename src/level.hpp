@@ -28,7 +28,7 @@ public:
     void on_entry(wxCommandEvent& event);
 
     object_t& object;
-    std::string const field_name;
+    unsigned const slot;
 
 private:
     model_t& model;
@@ -44,6 +44,8 @@ public:
 
     void load_object();
     void update_classes();
+    // Interns the class name typed so far and assigns it to 'object'.
+    void commit_class();
 private:
     model_t& model;
 
@@ -65,6 +67,7 @@ private:
 
     void on_combo_select(wxCommandEvent& event);
     void on_combo_text(wxCommandEvent& event);
+    void on_combo_focus(wxFocusEvent& event);
     void on_name(wxCommandEvent& event);
     void on_change_x(wxSpinEvent& event);
     void on_change_y(wxSpinEvent& event);
@@ -77,6 +80,8 @@ class object_dialog_t : public wxDialog
 public:
     object_dialog_t(wxWindow* parent, model_t& model, object_t& object, bool picker = false);
 
+    virtual void EndModal(int ret_code) override;
+
     object_t& object;
 private:
     model_t& model;
@@ -128,6 +133,12 @@ public:
 
     double object_radius() const { return 8.0f; }
 
+    // The area of the level currently on screen, in pixels.
+    rect_t visible_pixels() const;
+
+    // Indices of the objects under the cursor, sorted.
+    std::vector<object_handle_t> objects_at(coord_t at);
+
     virtual void on_down(mouse_button_t mb, coord_t at) override;
     virtual void on_up(mouse_button_t mb, coord_t at) override;
     virtual void on_motion(coord_t at) override;
@@ -211,7 +222,8 @@ struct level_policy_t
     {
         page.model_refresh();
     }
-    static void rename(model_t& m, std::string const& old_name, std::string const& new_name) {}
+    static void on_collection_change(model_t& m) { m.index_names(); }
+    static void rename(model_t& m, std::string const& old_name, std::string const& new_name) { m.index_names(); }
 };
 
 class levels_panel_t : public tab_panel_t<level_policy_t>
@@ -5,10 +5,12 @@
 #include <wx/bookctrl.h>
 #include <wx/mstream.h>
 #include <wx/clipbrd.h>
+#include <wx/numdlg.h>
 
 #include <filesystem>
 #include <cstring>
 #include <map>
+#include <utility>
 
 #include "2d/geometry.hpp"
 
@@ -19,12 +21,15 @@
 #include "model.hpp"
 #include "convert.hpp"
 #include "metatiles.hpp"
+#include "journal.hpp"
 #include "palette.hpp"
+#include "parallel.hpp"
 #include "level.hpp"
 #include "class.hpp"
 #include "id.hpp"
 #include "tool.hpp"
 #include "chr.hpp"
+#include "compress.hpp"
 
 using namespace i2d;
 
@@ -171,9 +176,13 @@ inline wxDataFormat tiles_format() { return wxDataFormat("tiles"); }
 class clip_data_t : public wxDataObjectSimple
 {
 public:
-    explicit clip_data_t(tile_copy_t const& cp = {}) 
+    clip_data_t() 
     : wxDataObjectSimple(tiles_format())
-    , data(cp.to_vec())
+    {}
+
+    clip_data_t(model_t const& model, tile_copy_t const& cp) 
+    : wxDataObjectSimple(tiles_format())
+    , data(cp.to_vec(model))
     {}
 
     virtual size_t GetDataSize() const override
@@ -194,7 +203,7 @@ public:
         return true;
     }
 
-    tile_copy_t get() const { return tile_copy_t::from_vec(data); }
+    tile_copy_t get(model_t& model) const { return tile_copy_t::from_vec(model, data); }
 
 private:
     std::vector<std::uint16_t> data;
@@ -236,32 +245,51 @@ private:
     void on_save(wxCommandEvent& event);
     void on_save_as(wxCommandEvent& event);
     void do_save();
+    void on_export_levels(wxCommandEvent& event);
+    void on_export_columns(wxCommandEvent& event);
+    void on_export_shared(wxCommandEvent& event);
     void refresh_title();
     void on_tab_change(wxNotebookEvent& event);
     void refresh_tab(int tab);
     void refresh_tab();
 
     void on_close(wxCloseEvent& event);
+    void on_journal_timer(wxTimerEvent& event);
 
     template<undo_type_t U>
     void on_undo(wxCommandEvent& event)
     {
-        if(editor_t* editor = get_editor())
-            editor->history.undo<U>(model);
+        if(undo_history_t* history = get_history())
+            history->undo<U>(model);
         Update();
         Refresh();
     }
  
+    void on_undo_budget(wxCommandEvent& event)
+    {
+        long const mib = wxGetNumberFromUser(
+            "Oldest undo steps are discarded once an editor's history uses more memory than this.", 
+            "MiB:", "Undo Memory Limit", undo_history_t::budget >> 20, 1, 4096, this);
+        if(mib > 0)
+            undo_history_t::budget = std::size_t(mib) << 20;
+    }
+
     void refresh_menus()
     {
         for(unsigned i = 0; i < 2; ++i)
         {
-            if(editor_t* editor = get_editor())
-                undo_item[i]->Enable(!editor->history.empty(undo_type_t(i)));
+            if(undo_history_t* history = get_history())
+                undo_item[i]->Enable(!history->empty(undo_type_t(i)));
             else
                 undo_item[i]->Enable(false);
         }
 
+        wxString undo_status;
+        if(undo_history_t* history = get_history())
+            undo_status.Printf("Undo: %.1f KiB / %lu MiB", history->bytes() / 1024.0, (unsigned long)(undo_history_t::budget >> 20));
+        if(model.status_bar->GetStatusText(1) != undo_status)
+            model.status_bar->SetStatusText(undo_status, 1);
+
         bool editing = false;
 
         if(editor_t* editor = get_editor())
@@ -334,15 +362,15 @@ private:
             {
                 if(std::filesystem::exists(model.collision_path))
                 {
-                    auto bm = load_collision_file(model.collision_path.string());
-                    model.collision_bitmaps = std::move(bm.first);
-                    model.collision_wx_bitmaps = std::move(bm.second);
+                    model.set_collision_bitmaps(load_collision_file(model.collision_path.string()));
                 }
             }
             catch(...) {}
 
             for(auto& chr : model.chr_files)
             {
+                if(chr.modified())
+                    continue; // Reloading would lose reordered tiles.
                 try
                 {
                     chr.load();
@@ -411,7 +439,7 @@ private:
         if(wxTheClipboard->Open())
         {
             if(editor_t* editor = get_editor())
-                wxTheClipboard->SetData(new clip_data_t(editor->copy(Cut)));
+                wxTheClipboard->SetData(new clip_data_t(model, editor->copy(Cut)));
             wxTheClipboard->Close();
         }
     }
@@ -428,7 +456,7 @@ private:
                 {
                     clip_data_t data;
                     wxTheClipboard->GetData(data);
-                    copy = data.get();
+                    copy = data.get(model);
                     ret = true;
                 }
                 wxTheClipboard->Close();
@@ -444,6 +472,7 @@ private:
         if(get_paste(copy))
         {
             model.paste.reset(new tile_copy_t(std::move(copy)));
+            model.paste_serial += 1;
             Refresh();
         }
     }
@@ -469,7 +498,7 @@ private:
                     clip_data_t data;
                     wxTheClipboard->GetData(data);
                     model.modify();
-                    editor->history.push(editor->layer().fill_paste(data.get()));
+                    editor->history.push(editor->layer().fill_paste(data.get(model)));
                     Refresh();
                 }
                 wxTheClipboard->Close();
@@ -556,30 +585,18 @@ private:
         }
 
         // CHR
-        std::map<std::string, std::array<int, 256>> chr_map;
-        for(auto const& mt : model.metatiles)
-        {
-            auto& map = chr_map[mt->chr_name];
-            for(std::uint8_t t : mt->chr_layer.tiles)
-                map[t] += 1;
-        }
+        auto chr_map = model.chr_usage();
 
         for(auto const& mt : model.metatiles)
         {
             auto& map = chr_map[mt->chr_name];
             mt->chr_layer.picker_selector.select_all(false);
             for(unsigned i = 0; i < 256; ++i)
-                if(map[i] <= usage)
+                if(int(map[i]) <= usage)
                     mt->chr_layer.picker_selector.select(coord_t{ i % 16, i / 16 });
         }
 
-        std::map<std::string, std::array<int, 256>> mt_map;
-        for(auto const& level : model.levels)
-        {
-            auto& map = mt_map[level->metatiles_name];
-            for(std::uint8_t t : level->metatile_layer.tiles)
-                map[t] += 1;
-        }
+        auto mt_map = model.metatile_usage();
 
         for(auto const& level : model.levels)
         {
@@ -588,17 +605,20 @@ private:
 
             if(!mtt)
             {
-                for(coord_t c : dimen_range(level->metatile_layer.tiles.dimen()))
+                auto const& tiles = std::as_const(level->metatile_layer.tiles);
+                level->metatile_layer.canvas_selector.begin_batch();
+                tiles.for_each_span(to_rect(tiles.dimen()), [&](coord_t at, std::uint8_t const* span, int n)
                 {
-                    std::uint8_t const t = level->metatile_layer.tiles[c];
-                    if(map[t] <= usage)
-                        level->metatile_layer.canvas_selector.select(c);
-                }
+                    for(int i = 0; i < n; ++i)
+                        if(int(map[span[i]]) <= usage)
+                            level->metatile_layer.canvas_selector.select(coord_t{ at.x + i, at.y });
+                });
+                level->metatile_layer.canvas_selector.commit_batch();
             }
 
             level->metatile_layer.picker_selector.select_all(false);
             for(unsigned i = 0; i < 256; ++i)
-                if(map[i] <= usage)
+                if(int(map[i]) <= usage)
                     level->metatile_layer.picker_selector.select(coord_t{ (i % 16), (i / 16) });
         }
 
@@ -606,79 +626,62 @@ private:
         {
             auto& map = mt_map[mt->name];
             mt->chr_layer.canvas_selector.select_all(false);
+            mt->chr_layer.canvas_selector.begin_batch();
             for(unsigned i = 0; i < 256; ++i)
             {
-                if(map[i] <= usage)
+                if(int(map[i]) <= usage)
                 {
                     for(unsigned x = 0; x < 2; ++x)
                     for(unsigned y = 0; y < 2; ++y)
                         mt->chr_layer.canvas_selector.select(coord_t{ (i % 16)*2 + x, (i / 16)*2+y });
                 }
             }
+            mt->chr_layer.canvas_selector.commit_batch();
         }
 
         // Collisions
-        std::array<int, 64> collision_map = {};
-
-        for(auto const& mt : model.metatiles)
-            for(std::uint8_t t : mt->collision_layer.tiles)
-                collision_map[t] += 1;
+        auto const collision_map = model.collision_usage();
 
         for(auto const& mt : model.metatiles)
         {
             mt->collision_layer.picker_selector.select_all(false);
             for(unsigned i = 0; i < 64; ++i)
-                if(collision_map[i] <= usage)
+                if(int(collision_map[i]) <= usage)
                     mt->collision_layer.picker_selector.select(coord_t{ i % 8, i / 8 });
         }
 
         // Metatiles
         if(mtt)
         {
-            using mtt_t = std::array<std::uint8_t, 4>;
-            std::map<std::string, std::map<mtt_t, int>> mtt_map;
+            auto const mtt_map = model.mtt_usage();
 
-            auto const get_mtt = [&](auto const& level, unsigned x, unsigned y) -> mtt_t
+            // Finding the rare blocks reads tiles only, so it's split across threads.
+            // Selecting touches shared state and stays on this one.
+            std::vector<std::vector<coord_t>> rare(model.levels.size());
+            parallel_for(model.levels.size(), [&](std::size_t i)
             {
-                std::uint8_t nw = 0;
-                std::uint8_t ne = 0;
-                std::uint8_t sw = 0;
-                std::uint8_t se = 0;
-
-                nw = level->metatile_layer.tiles[{ x+0, y+0 }];
-                if(x+1 < level->metatile_layer.tiles.dimen().w)
+                auto const& level = *model.levels[i];
+                auto const& stats = mtt_map.at(level.metatiles_name);
+                mtt_stats_t::for_each_block(level.metatile_layer.tiles, [&](coord_t at, mtt_stats_t::key_t key)
                 {
-                    ne = level->metatile_layer.tiles[{ x+1, y+0 }];
-                    if(y+1 < level->metatile_layer.tiles.dimen().h)
-                        se = level->metatile_layer.tiles[{ x+1, y+1 }];
-                }
-                if(y+1 < level->metatile_layer.tiles.dimen().h)
-                    sw = level->metatile_layer.tiles[{ x+0, y+1 }];
-
-                return {{ nw, ne, sw, se }};
-            };
+                    if(int(stats.count(key)) <= usage)
+                        rare[i].push_back(at);
+                });
+            });
 
-            for(auto const& level : model.levels)
+            for(std::size_t i = 0; i < model.levels.size(); ++i)
             {
-                auto& map = mtt_map[level->metatiles_name];
-                for(unsigned y = 0; y < level->metatile_layer.tiles.dimen().h; y += 2)
-                for(unsigned x = 0; x < level->metatile_layer.tiles.dimen().w; x += 2)
-                    map[get_mtt(level, x, y)] += 1;
-            }
-
-            for(auto const& level : model.levels)
-            {
-                auto& map = mtt_map[level->metatiles_name];
-                for(unsigned y = 0; y < level->metatile_layer.tiles.dimen().h; y += 2)
-                for(unsigned x = 0; x < level->metatile_layer.tiles.dimen().w; x += 2)
+                auto& selector = model.levels[i]->metatile_layer.canvas_selector;
+                dimen_t const dimen = model.levels[i]->dimen();
+                selector.begin_batch();
+                for(coord_t at : rare[i])
                 {
-                    if(map[get_mtt(level, x, y)] <= usage)
-                    {
-                        for(unsigned xo = 0; xo < 2; ++xo)
-                        for(unsigned yo = 0; yo < 2; ++yo)
-                            level->metatile_layer.canvas_selector.select(coord_t{ x+xo, y+yo });
-                    }
+                    for(int xo = 0; xo < 2; ++xo)
+                    for(int yo = 0; yo < 2; ++yo)
+                        if(in_bounds(coord_t{ at.x + xo, at.y + yo }, dimen))
+                            selector.select(coord_t{ at.x + xo, at.y + yo });
                 }
+                selector.commit_batch();
             }
         }
 
@@ -716,6 +719,15 @@ private:
         }
     }
 
+    undo_history_t* get_history()
+    {
+        if(notebook->GetSelection() == TAB_CHR)
+            return &chr_editor->history;
+        if(editor_t* editor = get_editor())
+            return &editor->history;
+        return nullptr;
+    }
+
     wxNotebook* notebook;
 
     chr_editor_t* chr_editor;
@@ -745,6 +757,10 @@ private:
     std::vector<wxToolBarToolBase*> tools;
 
     std::unique_ptr<wxFileSystemWatcher> watcher;
+
+    static constexpr int JOURNAL_INTERVAL = 1000; // In milliseconds.
+    wxTimer journal_timer;
+    bool journal_warned = false;
 };
 
 bool app_t::OnInit()
@@ -759,17 +775,25 @@ bool app_t::OnInit()
 frame_t::frame_t()
 : wxFrame(nullptr, wxID_ANY, "MapFab", wxDefaultPosition, wxSize(800, 600))
 {
+    // Editors pick this up as they're constructed:
+    model.journal = std::make_shared<journal_t>(model);
+
     wxMenu* menu_file = new wxMenu;
     menu_file->Append(wxID_NEW, "&New Project Window\tCTRL+N");
     menu_file->Append(wxID_OPEN, "&Open Project\tCTRL+O");
     menu_file->Append(wxID_SAVE, "&Save Project\tCTRL+S");
     menu_file->Append(wxID_SAVEAS, "Save Project &As\tSHIFT+CTRL+S");
     menu_file->AppendSeparator();
+    menu_file->Append(ID_EXPORT_LEVELS, "&Export Compressed Levels...");
+    menu_file->Append(ID_EXPORT_COLUMNS, "Export &Column Streams...");
+    menu_file->Append(ID_EXPORT_SHARED, "Export with Shared &Dictionaries...");
+    menu_file->AppendSeparator();
     menu_file->Append(wxID_EXIT);
 
     wxMenu* menu_edit = new wxMenu;
     undo_item[UNDO] = menu_edit->Append(wxID_UNDO, "&Undo\tCTRL+Z");
     undo_item[REDO] = menu_edit->Append(wxID_REDO, "&Redo\tCTRL+R");
+    menu_edit->Append(ID_UNDO_BUDGET, "Undo Memory Limit...");
     menu_edit->AppendSeparator();
     cut = menu_edit->Append(wxID_CUT, "Cut\tCTRL+X");
     copy = menu_edit->Append(wxID_COPY, "Copy\tCTRL+C");
@@ -808,7 +832,9 @@ frame_t::frame_t()
 
     SetMenuBar(menu_bar);
  
-    model.status_bar = CreateStatusBar();
+    model.status_bar = CreateStatusBar(2);
+    int const status_widths[] = { -1, 200 };
+    model.status_bar->SetStatusWidths(2, status_widths);
 
     auto const make_bitmap = [&](char const* name, unsigned char const* data, std::size_t size)
     {
@@ -855,10 +881,14 @@ frame_t::frame_t()
     Bind(wxEVT_MENU, &frame_t::on_exit, this, wxID_EXIT);
     Bind(wxEVT_MENU, &frame_t::on_undo<UNDO>, this, wxID_UNDO);
     Bind(wxEVT_MENU, &frame_t::on_undo<REDO>, this, wxID_REDO);
+    Bind(wxEVT_MENU, &frame_t::on_undo_budget, this, ID_UNDO_BUDGET);
     Bind(wxEVT_MENU, &frame_t::on_new_window, this, wxID_NEW);
     Bind(wxEVT_MENU, &frame_t::on_open, this, wxID_OPEN);
     Bind(wxEVT_MENU, &frame_t::on_save, this, wxID_SAVE);
     Bind(wxEVT_MENU, &frame_t::on_save_as, this, wxID_SAVEAS);
+    Bind(wxEVT_MENU, &frame_t::on_export_levels, this, ID_EXPORT_LEVELS);
+    Bind(wxEVT_MENU, &frame_t::on_export_columns, this, ID_EXPORT_COLUMNS);
+    Bind(wxEVT_MENU, &frame_t::on_export_shared, this, ID_EXPORT_SHARED);
     Bind(wxEVT_MENU, &frame_t::on_copy<true>, this, wxID_CUT);
     Bind(wxEVT_MENU, &frame_t::on_copy<false>, this, wxID_COPY);
     Bind(wxEVT_MENU, &frame_t::on_paste, this, wxID_PASTE);
@@ -885,6 +915,10 @@ frame_t::frame_t()
     Bind(wxEVT_CLOSE_WINDOW, &frame_t::on_close, this);
     Bind(wxEVT_FSWATCHER, &frame_t::on_watcher, this);
 
+    journal_timer.SetOwner(this);
+    Bind(wxEVT_TIMER, &frame_t::on_journal_timer, this, journal_timer.GetId());
+    journal_timer.Start(JOURNAL_INTERVAL);
+
     notebook->Bind(wxEVT_NOTEBOOK_PAGE_CHANGED, &frame_t::on_tab_change, this);
 
 
@@ -912,8 +946,25 @@ void frame_t::on_close(wxCloseEvent& event)
         }
     }
 
+    // Unsaved edits are only worth recovering if the close couldn't ask about them.
+    // Those noted since the last timer tick are captured now, while the model is intact.
+    if(event.CanVeto() || !model.modified_since_save)
+        model.journal->discard();
+    else
+        model.journal->flush();
+
     Destroy();
 }
+
+void frame_t::on_journal_timer(wxTimerEvent& event)
+{
+    model.journal->flush();
+    if(!journal_warned && model.journal->failed())
+    {
+        model.status_bar->SetStatusText("Unable to write the crash recovery journal.");
+        journal_warned = true;
+    }
+}
  
 void frame_t::on_about(wxCommandEvent& event)
 {
@@ -962,6 +1013,23 @@ void frame_t::on_open(wxCommandEvent& event)
         else
             frame->model.read_file(fp, frame->model.project_path);
 
+        if(journal_t::needs_recovery(frame->model.project_path))
+        {
+            wxMessageDialog dialog(frame, "This project has edits that were never saved. Recover them?", 
+                                   "Recover Unsaved Edits", wxYES_NO | wxICON_QUESTION);
+            if(dialog.ShowModal() == wxID_YES)
+            {
+                auto const replayed = journal_t::replay(frame->model, frame->model.project_path);
+                frame->model.journal->resume(frame->model.project_path, replayed);
+                frame->model.status_bar->SetStatusText(wxString::Format("Recovered %lu edits, skipped %lu.", 
+                    (unsigned long)replayed.applied, (unsigned long)replayed.skipped));
+            }
+            else
+                frame->model.journal->open(frame->model.project_path);
+        }
+        else
+            frame->model.journal->open(frame->model.project_path);
+
         path project(frame->model.project_path);
         if(project.has_filename())
             project.remove_filename();
@@ -1005,6 +1073,66 @@ void frame_t::on_save_as(wxCommandEvent& event)
     }
 
 }
+// Shows a plain-text table in a fixed-width font.
+static void show_report(wxWindow* parent, wxString const& title, std::string const& table)
+{
+    wxDialog report(parent, wxID_ANY, title, wxDefaultPosition, wxSize(960, 400),
+                    wxDEFAULT_DIALOG_STYLE | wxRESIZE_BORDER);
+    wxTextCtrl* text = new wxTextCtrl(&report, wxID_ANY, table, wxDefaultPosition, wxDefaultSize,
+                                      wxTE_MULTILINE | wxTE_READONLY | wxTE_DONTWRAP);
+    text->SetFont(wxFont(wxFontInfo().Family(wxFONTFAMILY_TELETYPE)));
+    wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
+    sizer->Add(text, wxSizerFlags(1).Expand().Border());
+    sizer->Add(report.CreateButtonSizer(wxOK), wxSizerFlags().Expand().Border());
+    report.SetSizer(sizer);
+    report.ShowModal();
+}
+
+void frame_t::on_export_levels(wxCommandEvent& event)
+{
+    wxDirDialog dir_dialog(this, "Export compressed levels to", wxEmptyString, wxDD_DEFAULT_STYLE | wxDD_DIR_MUST_EXIST);
+    if(dir_dialog.ShowModal() == wxID_CANCEL)
+        return;
+
+    auto const levels = compress_levels(model);
+    write_compressed_levels(levels, dir_dialog.GetPath().ToStdString());
+    show_report(this, "Compressed Levels", compression_report(levels));
+}
+
+void frame_t::on_export_columns(wxCommandEvent& event)
+{
+    wxDirDialog dir_dialog(this, "Export column streams to", wxEmptyString, wxDD_DEFAULT_STYLE | wxDD_DIR_MUST_EXIST);
+    if(dir_dialog.ShowModal() == wxID_CANCEL)
+        return;
+
+    int const rle = wxMessageBox("Pack each column with RLE?", "Column Streams", wxYES_NO | wxCANCEL, this);
+    if(rle == wxCANCEL)
+        return;
+
+    std::filesystem::path const dir = dir_dialog.GetPath().ToStdString();
+    auto const levels = encode_column_levels(model, rle == wxYES);
+    write_column_levels(levels, dir);
+    validate_column_levels(model, dir);
+
+    std::size_t bytes = 0;
+    for(auto const& level : levels)
+        bytes += level.bytes.size();
+    wxMessageBox(wxString::Format("Exported and verified %lu levels, %lu bytes in all.",
+                                  (unsigned long)levels.size(), (unsigned long)bytes),
+                 "Column Streams", wxOK, this);
+}
+
+void frame_t::on_export_shared(wxCommandEvent& event)
+{
+    wxDirDialog dir_dialog(this, "Export levels with shared dictionaries to", wxEmptyString, wxDD_DEFAULT_STYLE | wxDD_DIR_MUST_EXIST);
+    if(dir_dialog.ShowModal() == wxID_CANCEL)
+        return;
+
+    auto const dictionaries = train_shared_dictionaries(model);
+    write_shared_dictionaries(model, dictionaries, dir_dialog.GetPath().ToStdString());
+    show_report(this, "Shared Dictionaries", shared_dictionary_report(dictionaries, compress_levels(model)));
+}
+
 void frame_t::do_save()
 {
     using namespace std::filesystem;
@@ -1016,6 +1144,21 @@ void frame_t::do_save()
     if(project.has_filename())
         project.remove_filename();
 
+    // Reordered CHR tiles go to disk along with the project that refers to them.
+    // A file that can't be rewritten keeps its reordering for the next save, rather than blocking this one:
+    wxString chr_errors;
+    for(auto& chr : model.chr_files)
+    {
+        try
+        {
+            chr.save();
+        }
+        catch(std::exception const& e)
+        {
+            chr_errors << e.what() << "\n";
+        }
+    }
+
     FILE* fp = std::fopen(model.project_path.string().c_str(), "wb");
     auto guard = make_scope_guard([&]{ std::fclose(fp); });
 
@@ -1024,7 +1167,12 @@ void frame_t::do_save()
     else
         model.write_file(fp, model.project_path);
     model.modified_since_save = false;
+    model.journal->open(model.project_path);
     Update();
+
+    if(!chr_errors.IsEmpty())
+        wxMessageBox("The project was saved, but not these reordered CHR tiles:\n\n" + chr_errors, 
+                     "Save", wxOK | wxICON_WARNING, this);
 }
 
 void frame_t::refresh_title()
@@ -90,12 +90,20 @@ void metatile_canvas_t::draw_tiles(render_t& gc)
     draw_overlays(gc);
 }
 
+void metatile_canvas_t::draw_paste_tile(render_t& gc, std::uint16_t value, coord_t at)
+{
+    if(metatiles->collisions())
+        draw_collision_tile(model, gc, value, at);
+    else
+        draw_chr_tile(*metatiles, gc, value & 0xFF, value >> 8, at);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // metatile_editor_t ///////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 metatile_editor_t::metatile_editor_t(wxWindow* parent, model_t& model, std::shared_ptr<metatile_model_t> metatiles_)
-: editor_t(parent)
+: editor_t(parent, model)
 , model(model)
 , metatiles(std::move(metatiles_))
 {
@@ -106,6 +114,9 @@ metatile_editor_t::metatile_editor_t(wxWindow* parent, model_t& model, std::shar
     picker = new chr_picker_t(left_panel, model, metatiles);
 
     wxButton* reorder_button = new wxButton(left_panel, wxID_ANY, "Shift Metatiles");
+    wxButton* sort_button = new wxButton(left_panel, wxID_ANY, "Sort by Usage");
+    wxButton* merge_button = new wxButton(left_panel, wxID_ANY, "Merge Duplicates");
+    wxButton* similar_button = new wxButton(left_panel, wxID_ANY, "Find Similar");
 
     attributes[0] = new wxRadioButton(left_panel, wxID_ANY, "Attribute 0  (F1)", wxDefaultPosition, wxDefaultSize, wxRB_GROUP);
     attributes[1] = new wxRadioButton(left_panel, wxID_ANY, "Attribute 1  (F2)");
@@ -131,6 +142,9 @@ metatile_editor_t::metatile_editor_t(wxWindow* parent, model_t& model, std::shar
         wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
         sizer->Add(picker, wxSizerFlags().Expand().Proportion(1));
         sizer->Add(reorder_button, wxSizerFlags().Border(wxLEFT | wxDOWN));
+        sizer->Add(sort_button, wxSizerFlags().Border(wxLEFT | wxDOWN));
+        sizer->Add(merge_button, wxSizerFlags().Border(wxLEFT | wxDOWN));
+        sizer->Add(similar_button, wxSizerFlags().Border(wxLEFT | wxDOWN));
         for(auto* ptr : attributes)
             sizer->Add(ptr, wxSizerFlags().Border(wxLEFT));
         sizer->Add(chr_label, wxSizerFlags().Border(wxLEFT | wxUP));
@@ -176,6 +190,9 @@ metatile_editor_t::metatile_editor_t(wxWindow* parent, model_t& model, std::shar
     Bind(wxEVT_MENU, &metatile_editor_t::on_active<ACTIVE_COLLISION>, this, ID_COLLISION);
 
     reorder_button->Bind(wxEVT_BUTTON, &metatile_editor_t::on_reorder, this);
+    sort_button->Bind(wxEVT_BUTTON, &metatile_editor_t::on_sort_by_usage, this);
+    merge_button->Bind(wxEVT_BUTTON, &metatile_editor_t::on_merge_duplicates, this);
+    similar_button->Bind(wxEVT_BUTTON, &metatile_editor_t::on_find_similar, this);
 
     model_refresh();
 }
@@ -243,21 +260,121 @@ void metatile_editor_t::on_reorder(wxCommandEvent& event)
         int num = dialog.num_ctrl->GetValue();
 
         if(num != 0)
+            permute(shift_lut(from, to, num));
+    }
+
+    dialog.Destroy();
+    SetFocus();
+}
+
+void metatile_editor_t::on_sort_by_usage(wxCommandEvent& event)
+{
+    auto const usage = model.metatile_usage();
+    auto it = usage.find(metatiles->name);
+    if(it != usage.end())
+        permute(sort_lut(it->second, metatiles->num));
+    SetFocus();
+}
+
+void metatile_editor_t::on_merge_duplicates(wxCommandEvent& event)
+{
+    auto const duplicates = model.duplicate_metatiles();
+
+    // One line per group, up to a screenful:
+    constexpr unsigned max_lines = 24;
+    unsigned lines = 0;
+    wxString report;
+    for(unsigned i = 0; i < duplicates.size(); ++i)
+    {
+        for(auto const& group : duplicates[i])
+        {
+            if(++lines > max_lines)
+                continue;
+            report << model.metatiles[i]->name << ":";
+            for(std::uint8_t index : group)
+                report << wxString::Format(" $%02X", index);
+            report << "\n";
+        }
+    }
+    if(lines > max_lines)
+        report << wxString::Format("...and %u more.\n", lines - max_lines);
+
+    if(lines == 0)
+        wxMessageBox("No metatile set has duplicates.", "Merge Duplicates", wxOK | wxICON_INFORMATION, this);
+    else if(wxMessageBox("Identical metatiles:\n\n" + report + "\nMerge each into the first of its group, in every set?", 
+                         "Merge Duplicates", wxYES_NO | wxICON_QUESTION, this) == wxYES)
+    {
+        history.push(model.merge_duplicate_metatiles());
+        Refresh();
+    }
+
+    SetFocus();
+}
+
+void metatile_editor_t::on_find_similar(wxCommandEvent& event)
+{
+    similar_dialog_t dialog(this);
+
+    if(dialog.ShowModal() == wxID_OK) 
+    {
+        bool const collisions = metatiles->collisions();
+        tile_layer_t& layer = metatiles->layer();
+
+        // Compare against the first metatile selected:
+        int selected = -1;
+        layer.canvas_selector.for_each_selected([&](coord_t c)
         {
-            std::vector<std::shared_ptr<level_model_t>> levels;
+            int const i = collisions ? c.x + c.y * 16 : (c.x / 2) + (c.y / 2) * 16;
+            if(selected < 0 || i < selected)
+                selected = i;
+        });
+
+        chr_array_t chr = {};
+        if(auto* chr_file = model.chr_file(metatiles->chr_name))
+            chr = chr_file->chr;
+        metatile_pixels_t const pixels(*metatiles, chr, model.palette_array(metatiles->palette),
+            dialog.colors_ctrl->GetValue() ? metatile_pixels_t::METRIC_COLORS : metatile_pixels_t::METRIC_PIXELS);
+        unsigned const max_distance = dialog.distance_ctrl->GetValue();
+
+        std::vector<metatile_pixels_t::match_t> matches;
+        if(dialog.pairs_ctrl->GetValue())
+            matches = pixels.pairs(max_distance);
+        else if(selected >= 0)
+        {
+            for(auto const& match : pixels.rank(selected))
+                if(match.distance <= max_distance)
+                    matches.push_back(match);
+        }
+        else
+            wxMessageBox("Select a metatile to compare against.", "Find Similar", wxOK | wxICON_INFORMATION, this);
 
-            metatiles->shift(from, to, num);
-            for(auto level : model.levels)
+        if(dialog.pairs_ctrl->GetValue() || selected >= 0)
+        {
+            layer.canvas_selector.select_all(false);
+            layer.canvas_selector.begin_batch();
+            for(auto const& match : matches)
             {
-                auto* mt = lookup_name_ptr(level->metatiles_name, model.metatiles).get();
-                if(mt == metatiles.get())
+                for(unsigned i : { match.a, match.b })
                 {
-                    level->shift(from, to, num);
-                    levels.push_back(level);
+                    if(collisions)
+                        layer.canvas_selector.select(coord_t{ i % 16, i / 16 });
+                    else
+                        layer.canvas_selector.select(rect_t{ coord_t{ (i % 16)*2, (i / 16)*2 }, dimen_t{ 2, 2 } });
                 }
             }
-
-            history.push(undo_shift_mt_t{ std::move(levels), metatiles.get(), from, to, -num });
+            layer.canvas_selector.commit_batch();
+
+            // List the closest, up to a screenful:
+            constexpr unsigned max_lines = 24;
+            wxString report;
+            for(unsigned i = 0; i < matches.size() && i < max_lines; ++i)
+                report << wxString::Format("$%02X ~ $%02X: %u pixels\n", matches[i].a, matches[i].b, matches[i].distance);
+            if(matches.size() > max_lines)
+                report << wxString::Format("...and %u more.\n", unsigned(matches.size() - max_lines));
+            if(matches.empty())
+                report = "Nothing is that close.";
+            wxMessageBox(report, "Find Similar", wxOK | wxICON_INFORMATION, this);
+            Refresh();
         }
     }
 
@@ -265,9 +382,17 @@ void metatile_editor_t::on_reorder(wxCommandEvent& event)
     SetFocus();
 }
 
+void metatile_editor_t::permute(tile_lut_t const& lut)
+{
+    if(lut == identity_lut())
+        return;
+    history.push(model.permute_metatiles(*metatiles, lut));
+    Refresh();
+}
+
 void metatile_editor_t::load_chr()
 {
-    if(auto* chr_file = lookup_name(metatiles->chr_name, model.chr_files))
+    if(auto* chr_file = model.chr_file(metatiles->chr_name))
         metatiles->refresh_chr(chr_file->chr, model.palette_array(metatiles->palette));
     else
         metatiles->clear_chr();
@@ -336,3 +461,38 @@ reorder_dialog_t::reorder_dialog_t(wxWindow* parent)
 
     //reset_button->Bind(wxEVT_BUTTON, &object_editor_t::on_reset, editor);
 }
+
+similar_dialog_t::similar_dialog_t(wxWindow* parent)
+: wxDialog(parent, wxID_ANY, "Find Similar Metatiles")
+{
+    wxBoxSizer* main_sizer = new wxBoxSizer(wxVERTICAL);
+
+    wxButton* cancel_button = new wxButton(this, wxID_CANCEL, "Cancel");
+    wxButton* ok_button = new wxButton(this, wxID_OK, "Ok");
+
+    auto* label = new wxStaticText(this, wxID_ANY, "Selects metatiles close to the selected one.");
+
+    auto* distance_label = new wxStaticText(this, wxID_ANY, "Maximum Differing Pixels:");
+    distance_ctrl = new wxSpinCtrl(this);
+    distance_ctrl->SetRange(0, 256);
+    distance_ctrl->SetValue(8);
+
+    colors_ctrl = new wxCheckBox(this, wxID_ANY, "Compare Colors");
+    pairs_ctrl = new wxCheckBox(this, wxID_ANY, "All Pairs");
+
+    wxBoxSizer* ctrl_sizer = new wxBoxSizer(wxHORIZONTAL);
+    wxBoxSizer* ctrl2_sizer = new wxBoxSizer(wxHORIZONTAL);
+    wxBoxSizer* button_sizer = new wxBoxSizer(wxHORIZONTAL);
+    button_sizer->Add(cancel_button, 0, wxALL, 32);
+    button_sizer->Add(ok_button, 0, wxALL, 32);
+    ctrl_sizer->Add(distance_label, wxSizerFlags().Border(wxLEFT | wxUP));
+    ctrl_sizer->Add(distance_ctrl, wxSizerFlags().Border(wxLEFT | wxRIGHT));
+    ctrl2_sizer->Add(colors_ctrl, wxSizerFlags().Border(wxLEFT | wxRIGHT));
+    ctrl2_sizer->Add(pairs_ctrl, wxSizerFlags().Border(wxLEFT | wxRIGHT));
+    main_sizer->Add(label, wxSizerFlags().Border(wxLEFT | wxUP | wxRIGHT));
+    main_sizer->Add(ctrl_sizer, wxSizerFlags().Border(wxLEFT | wxUP | wxDOWN | wxRIGHT));
+    main_sizer->Add(ctrl2_sizer, wxSizerFlags().Border(wxLEFT | wxUP | wxDOWN | wxRIGHT));
+    main_sizer->Add(button_sizer, 0, wxALIGN_CENTER);
+
+    SetSizerAndFit(main_sizer);
+}
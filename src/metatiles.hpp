@@ -52,6 +52,7 @@ private:
     }
 
     virtual void draw_tiles(render_t& gc) override;
+    virtual void draw_paste_tile(render_t& gc, std::uint16_t value, coord_t at) override;
 };
 
 class metatile_editor_t : public editor_t
@@ -83,6 +84,12 @@ private:
     void on_combo_select(wxCommandEvent& event);
     void on_combo_text(wxCommandEvent& event);
     void on_reorder(wxCommandEvent& event);
+    void on_sort_by_usage(wxCommandEvent& event);
+    void on_merge_duplicates(wxCommandEvent& event);
+    void on_find_similar(wxCommandEvent& event);
+
+    // Reorders the metatiles and the levels using them as one undoable step.
+    void permute(tile_lut_t const& lut);
 
     template<unsigned I>
     void on_active(wxCommandEvent& event) { on_active(I); }
@@ -98,11 +105,13 @@ struct metatile_policy_t
     static constexpr char const* name = "Metatiles";
     static auto& collection(model_t& m) { return m.metatiles; }
     static void on_page_changing(page_type& page, object_type& object) { page.model_refresh(); }
+    static void on_collection_change(model_t& m) { m.index_names(); }
     static void rename(model_t& m, std::string const& old_name, std::string const& new_name)
     {
         for(auto& level : m.levels)
             if(level->metatiles_name == old_name)
                 level->metatiles_name = new_name;
+        m.index_names();
     }
 };
 
@@ -127,5 +136,16 @@ private:
     wxSpinCtrl* num_ctrl;
 };
 
+class similar_dialog_t : public wxDialog
+{
+friend class metatile_editor_t;
+public:
+    explicit similar_dialog_t(wxWindow* parent);
+private:
+    wxSpinCtrl* distance_ctrl;
+    wxCheckBox* colors_ctrl;
+    wxCheckBox* pairs_ctrl;
+};
+
 #endif
 
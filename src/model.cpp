@@ -1,9 +1,13 @@
 #include "model.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <ranges>
 
 #include "json.hpp"
 #include "graphics.hpp"
+#include "journal.hpp"
+#include "parallel.hpp"
 
 using json = nlohmann::json;
 
@@ -11,7 +15,7 @@ using json = nlohmann::json;
 // object_t ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-void object_t::append_vec(std::vector<std::uint16_t>& vec) const
+void object_t::append_vec(model_t const& model, std::vector<std::uint16_t>& vec) const
 {
     auto const append_str = [&](std::string const& str)
     {
@@ -23,16 +27,20 @@ void object_t::append_vec(std::vector<std::uint16_t>& vec) const
     vec.push_back(position.x);
     vec.push_back(position.y);
     append_str(name);
-    append_str(oclass);
-    vec.push_back(fields.size());
-    for(auto const& field : fields)
+    append_str(model.class_name(oclass));
+    object_class_t const* oc = model.object_class(oclass);
+    vec.push_back(oc ? oc->fields.size() : 0);
+    if(oc)
     {
-        append_str(field.first);
-        append_str(field.second);
+        for(auto const& field : oc->fields)
+        {
+            append_str(field.name);
+            append_str(this->field(field.slot));
+        }
     }
 }
 
-void object_t::from_vec(std::uint16_t const*& ptr, std::uint16_t const* end)
+void object_t::from_vec(model_t& model, std::uint16_t const*& ptr, std::uint16_t const* end)
 {
     auto const get = [&]() -> std::uint16_t
     {
@@ -52,47 +60,212 @@ void object_t::from_vec(std::uint16_t const*& ptr, std::uint16_t const* end)
     position.x = static_cast<std::int16_t>(get());
     position.y = static_cast<std::int16_t>(get());
     name = from_str();
-    oclass = from_str();
+    oclass = model.class_id(from_str());
 
-    unsigned const num_fields = *ptr++;
+    object_class_t const* oc = model.object_class(oclass);
+    unsigned const num_fields = get();
     fields.clear();
     for(unsigned i = 0; i < num_fields; ++i)
-        fields.insert({ from_str(), from_str() });
+    {
+        std::string const field_name = from_str();
+        std::string value = from_str();
+        if(oc)
+            for(auto const& field : oc->fields)
+                if(field.name == field_name)
+                    this->field(field.slot) = std::move(value);
+    }
+}
+
+std::string const& object_t::field(unsigned slot) const
+{
+    static std::string const empty;
+    return slot < fields.size() ? fields[slot] : empty;
+}
+
+std::string& object_t::field(unsigned slot)
+{
+    if(slot >= fields.size())
+        fields.resize(slot + 1);
+    return fields[slot];
+}
+
+void object_t::migrate_fields(object_class_t const* from, object_class_t const* to)
+{
+    if(from == to)
+        return;
+
+    std::vector<std::string> old_fields = std::move(fields);
+    fields.clear();
+
+    if(!from || !to)
+        return;
+
+    for(auto const& old_field : from->fields)
+    {
+        if(old_field.slot >= old_fields.size())
+            continue;
+        for(auto const& new_field : to->fields)
+            if(new_field.name == old_field.name)
+                field(new_field.slot) = std::move(old_fields[old_field.slot]);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // select_map_t ////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-void select_map_t::select_all(bool select)
-{ 
-    m_selection.fill(select); 
-    if(select)
-        m_select_rect = to_rect(dimen());
+select_map_t::word_t select_map_t::span_mask(int w, int x0, int x1)
+{
+    int const lo = std::max(x0 - w * WORD_BITS, 0);
+    int const hi = std::min(x1 - w * WORD_BITS, WORD_BITS);
+    if(lo >= hi)
+        return 0;
+    word_t const ones = (hi - lo == WORD_BITS) ? ~word_t(0) : ((word_t(1) << (hi - lo)) - 1);
+    return ones << lo;
+}
+
+void select_map_t::allocate()
+{
+    if(m_words.empty())
+    {
+        m_words.assign(m_row_words * dimen().h, 0);
+        m_row_counts.assign(dimen().h, 0);
+        m_col_counts.assign(dimen().w, 0);
+    }
+}
+
+void select_map_t::set_word(int y, int w, word_t bits)
+{
+    word_t& word = m_words[y * m_row_words + w];
+    word_t const added = bits & ~word;
+    word_t const removed = word & ~bits;
+    word = bits;
+
+    m_row_counts[y] += std::popcount(added);
+    m_row_counts[y] -= std::popcount(removed);
+
+    word_t const changed = added | removed;
+    if(m_cols_stale || !changed)
+        return;
+    if(changed & (changed - 1))
+        m_cols_stale = true;
     else
-        m_select_rect = {}; 
+        m_col_counts[w * WORD_BITS + std::countr_zero(changed)] += added ? 1 : -1;
 }
 
-void select_map_t::select_invert()
+void select_map_t::count_cols()
 {
-    coord_t min = { INT_MAX, INT_MAX };
-    coord_t max = { 0, 0 };
+    if(!m_cols_stale)
+        return;
+    m_cols_stale = false;
+    std::fill(m_col_counts.begin(), m_col_counts.end(), 0);
+    if(m_words.empty())
+        return;
 
-    for(coord_t c : dimen_range(dimen()))
+    // Counts the 64 columns of a word at once, as bit-sliced counters:
+    // bit i of planes[k] is bit k of column i's count, and adding a row ripples a carry up the planes.
+    std::vector<word_t> planes(std::bit_width(unsigned(dimen().h)));
+    for(int w = 0; w < m_row_words; ++w)
     {
-        if((m_selection[c] = !m_selection[c]))
+        std::fill(planes.begin(), planes.end(), 0);
+        for(int y = 0; y < dimen().h; ++y)
         {
-            min.x = std::min(c.x, min.x);
-            min.y = std::min(c.y, min.y);
-            max.x = std::max(c.x, max.x);
-            max.y = std::max(c.y, max.y);
+            word_t carry = m_words[y * m_row_words + w];
+            for(std::size_t k = 0; carry && k < planes.size(); ++k)
+            {
+                word_t const sum = planes[k] ^ carry;
+                carry &= planes[k];
+                planes[k] = sum;
+            }
         }
+
+        for(std::size_t k = 0; k < planes.size(); ++k)
+            for(word_t b = planes[k]; b; b &= b - 1)
+                m_col_counts[w * WORD_BITS + std::countr_zero(b)] += 1u << k;
     }
+}
 
-    if(min.x > max.x || min.y > max.y)
-        m_select_rect = {};
+void select_map_t::begin_batch()
+{
+    m_batch_depth += 1;
+}
+
+void select_map_t::commit_batch()
+{
+    assert(m_batch_depth > 0);
+    if(--m_batch_depth == 0)
+        recalc_select_rect();
+}
+
+void select_map_t::select_all(bool select)
+{ 
+    touch();
+    if(select && dimen().w > 0 && dimen().h > 0)
+    {
+        allocate();
+        for(int y = 0; y < dimen().h; ++y)
+            for(int w = 0; w < m_row_words; ++w)
+                m_words[y * m_row_words + w] = span_mask(w, 0, dimen().w);
+        std::fill(m_row_counts.begin(), m_row_counts.end(), dimen().w);
+        std::fill(m_col_counts.begin(), m_col_counts.end(), dimen().h);
+        m_cols_stale = false;
+        m_select_rect = to_rect(dimen());
+    }
     else
-        m_select_rect = rect_from_2_coords(min, max);
+    {
+        m_words.clear();
+        m_row_counts.clear();
+        m_col_counts.clear();
+        m_cols_stale = false;
+        m_select_rect = {}; 
+    }
+}
+
+void select_map_t::select_invert()
+{
+    touch();
+    if(dimen().w <= 0 || dimen().h <= 0)
+        return;
+
+    allocate();
+    for(int y = 0; y < dimen().h; ++y)
+        for(int w = 0; w < m_row_words; ++w)
+            m_words[y * m_row_words + w] ^= span_mask(w, 0, dimen().w);
+    for(unsigned& count : m_row_counts)
+        count = dimen().w - count;
+    for(unsigned& count : m_col_counts)
+        count = dimen().h - count;
+    recalc_select_rect();
+}
+
+void select_map_t::select_union(select_map_t const& other)
+{
+    touch();
+    assert(other.dimen() == dimen());
+    if(other.m_words.empty() || !other.m_select_rect)
+        return;
+
+    allocate();
+    for(int y = 0; y < dimen().h; ++y)
+        for(int w = 0; w < m_row_words; ++w)
+            set_word(y, w, m_words[y * m_row_words + w] | other.m_words[y * m_row_words + w]);
+    if(!m_batch_depth)
+        m_select_rect = grow_rect_to_contain(m_select_rect, other.m_select_rect);
+}
+
+void select_map_t::select_intersection(select_map_t const& other)
+{
+    touch();
+    assert(other.dimen() == dimen());
+    if(m_words.empty())
+        return;
+    if(other.m_words.empty())
+        return select_all(false);
+
+    for(int y = 0; y < dimen().h; ++y)
+        for(int w = 0; w < m_row_words; ++w)
+            set_word(y, w, m_words[y * m_row_words + w] & other.m_words[y * m_row_words + w]);
+    shrink_select_rect();
 }
 
 void select_map_t::select(std::uint8_t tile, bool select_)
@@ -107,53 +280,121 @@ void select_map_t::select_transpose(std::uint8_t tile, bool select_)
 
 void select_map_t::select(coord_t c, bool select)
 { 
+    touch();
     if(!in_bounds(c, dimen()))
         return;
-    m_selection.at(c) = select; 
     if(select)
-        m_select_rect = grow_rect_to_contain(m_select_rect, c);
-    else
-        recalc_select_rect(m_select_rect);
+    {
+        allocate();
+        set_word(c.y, c.x / WORD_BITS, word(c) | (word_t(1) << (c.x % WORD_BITS)));
+        if(!m_batch_depth)
+            m_select_rect = grow_rect_to_contain(m_select_rect, c);
+    }
+    else if(!m_words.empty())
+    {
+        set_word(c.y, c.x / WORD_BITS, word(c) & ~(word_t(1) << (c.x % WORD_BITS)));
+        shrink_select_rect();
+    }
 }
 
 void select_map_t::select(rect_t r, bool select) 
 { 
+    touch();
     if((r = crop(r, dimen())))
     {
-        for(coord_t c : rect_range(r))
+        if(!select && m_words.empty())
+            return;
+        allocate();
+
+        int const w0 = r.c.x / WORD_BITS;
+        int const w1 = (r.e().x + WORD_BITS - 1) / WORD_BITS;
+        for(int y = r.c.y; y < r.e().y; ++y)
         {
-            assert(in_bounds(c, dimen()));
-            m_selection.at(c) = select; 
+            for(int w = w0; w < w1; ++w)
+            {
+                word_t const mask = span_mask(w, r.c.x, r.e().x);
+                word_t const old = m_words[y * m_row_words + w];
+                set_word(y, w, select ? (old | mask) : (old & ~mask));
+            }
         }
-        if(select)
+
+        if(!select)
+            shrink_select_rect();
+        else if(!m_batch_depth)
             m_select_rect = grow_rect_to_contain(m_select_rect, r);
-        else
-            recalc_select_rect(m_select_rect);
     }
 }
 
 void select_map_t::resize(dimen_t d) 
 { 
-    m_selection.resize(d);
-    recalc_select_rect(to_rect(d));
+    touch();
+    int const row_words = (std::max(d.w, 0) + WORD_BITS - 1) / WORD_BITS;
+
+    if(!m_words.empty())
+    {
+        // Keep whatever still fits:
+        std::vector<word_t> words(row_words * std::max(d.h, 0), 0);
+        for(int y = 0; y < std::min(d.h, dimen().h); ++y)
+            for(int w = 0; w < std::min(row_words, m_row_words); ++w)
+                words[y * row_words + w] = m_words[y * m_row_words + w] & span_mask(w, 0, d.w);
+        m_words = std::move(words);
+
+        m_row_counts.assign(std::max(d.h, 0), 0);
+        m_col_counts.assign(std::max(d.w, 0), 0);
+        m_cols_stale = true;
+        for(int y = 0; y < d.h; ++y)
+            for(int w = 0; w < row_words; ++w)
+                m_row_counts[y] += std::popcount(m_words[y * row_words + w]);
+    }
+
+    m_dimen = d;
+    m_row_words = row_words;
+    recalc_select_rect();
 }
 
-void select_map_t::recalc_select_rect(rect_t range)
+void select_map_t::recalc_select_rect()
 {
-    coord_t min = to_coord(dimen());
-    coord_t max = { 0, 0 };
+    if(m_batch_depth)
+        return;
+    count_cols();
 
-    for(coord_t c : rect_range(range))
+    auto const nonzero = [](unsigned count) { return count != 0; };
+    auto const y0 = std::find_if(m_row_counts.begin(), m_row_counts.end(), nonzero);
+    auto const x0 = std::find_if(m_col_counts.begin(), m_col_counts.end(), nonzero);
+
+    if(y0 == m_row_counts.end() || x0 == m_col_counts.end())
     {
-        if(m_selection[c])
-        {
-            min.x = std::min<int>(min.x, c.x);
-            min.y = std::min<int>(min.y, c.y);
-            max.x = std::max<int>(max.x, c.x);
-            max.y = std::max<int>(max.y, c.y);
-        }
+        m_select_rect = {};
+        return;
     }
 
+    auto const y1 = std::find_if(m_row_counts.rbegin(), m_row_counts.rend(), nonzero);
+    auto const x1 = std::find_if(m_col_counts.rbegin(), m_col_counts.rend(), nonzero);
+
+    m_select_rect = rect_from_2_coords(
+        { int(x0 - m_col_counts.begin()), int(y0 - m_row_counts.begin()) }, 
+        { int(m_col_counts.rend() - x1) - 1, int(m_row_counts.rend() - y1) - 1 });
+}
+
+void select_map_t::shrink_select_rect()
+{
+    if(m_batch_depth || !m_select_rect)
+        return;
+    count_cols();
+
+    // Each edge only moves inward, so this is amortized O(1) per deselected cell:
+    coord_t min = m_select_rect.c;
+    coord_t max = m_select_rect.e() - coord_t{ 1, 1 };
+
+    while(min.y <= max.y && !m_row_counts[min.y])
+        ++min.y;
+    while(min.y <= max.y && !m_row_counts[max.y])
+        --max.y;
+    while(min.x <= max.x && !m_col_counts[min.x])
+        ++min.x;
+    while(min.x <= max.x && !m_col_counts[max.x])
+        --max.x;
+
     if(min.x <= max.x && min.y <= max.y)
         m_select_rect = rect_from_2_coords(min, max);
     else
@@ -164,6 +405,38 @@ void select_map_t::recalc_select_rect(rect_t range)
 // tile_layer_t ///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+// Calls 'fn(rect_t run)' with each horizontal run of cells in 'rect' where 'skip' doesn't hold,
+// so that a layer's bulk write sees exactly the cells a per-cell loop would.
+template<typename Skip, typename Fn>
+static void for_each_run(rect_t rect, Skip const& skip, Fn const& fn)
+{
+    for(int y = rect.c.y; y < rect.e().y; ++y)
+    {
+        for(int x = rect.c.x; x < rect.e().x;)
+        {
+            if(skip(coord_t{ x, y }))
+            {
+                ++x;
+                continue;
+            }
+
+            int const x0 = x;
+            while(x < rect.e().x && !skip(coord_t{ x, y }))
+                ++x;
+            fn(rect_t{ { x0, y }, { x - x0, 1 } });
+        }
+    }
+}
+
+// Writes the cells of 'rect' from 'values', except those where 'skip' holds.
+template<typename Skip>
+static void write_runs(tile_layer_t& layer, rect_t rect, std::uint16_t const* values, Skip const& skip)
+{
+    auto const value_at = [&](coord_t c) { return values + (c.y - rect.c.y) * rect.d.w + (c.x - rect.c.x); };
+    for_each_run(rect, [&](coord_t c) { return skip(c, *value_at(c)); },
+                 [&](rect_t run) { layer.write_rect(run, value_at(run.c)); });
+}
+
 tile_copy_t tile_layer_t::copy(undo_t* cut)
 {
     rect_t const rect = crop(canvas_selector.select_rect(), canvas_dimen());
@@ -173,16 +446,14 @@ tile_copy_t tile_layer_t::copy(undo_t* cut)
     if(cut)
         *cut = save(rect);
 
-    for(coord_t c : rect_range(rect))
+    if(rect)
     {
-        if(canvas_selector[c])
-        {
-            tiles[c - rect.c] = get(c);
-            if(cut)
-                reset(c);
-        }
-        else
-            tiles[c - rect.c] = ~0u;
+        read_rect(rect, &tiles[{ 0, 0 }]);
+        for(coord_t c : rect_range(rect))
+            if(!canvas_selector[c])
+                tiles[c - rect.c] = ~0u;
+        if(cut)
+            for_each_run(rect, [&](coord_t c) { return !canvas_selector[c]; }, [&](rect_t run) { reset_rect(run); });
     }
     copy.data = std::move(tiles);
     return copy;
@@ -191,9 +462,17 @@ tile_copy_t tile_layer_t::copy(undo_t* cut)
 void tile_layer_t::paste(tile_copy_t const& copy, coord_t at)
 {
     if(auto* grid = std::get_if<grid_t<std::uint16_t>>(&copy.data))
-        for(coord_t c : dimen_range(grid->dimen()))
-            if((*grid)[c] != std::uint16_t(~0u) && in_bounds(at + c, canvas_dimen()))
-                set(at + c, (*grid)[c]);
+    {
+        rect_t const rect = crop(rect_t{ at, grid->dimen() }, canvas_dimen());
+        if(!rect)
+            return;
+
+        std::vector<std::uint16_t> buffer;
+        buffer.reserve(rect.d.w * rect.d.h);
+        for(coord_t c : rect_range(rect))
+            buffer.push_back((*grid)[c - at]);
+        write_runs(*this, rect, buffer.data(), [](coord_t, std::uint16_t value) { return value == std::uint16_t(~0u); });
+    }
 }
 
 void tile_layer_t::dropper(coord_t at) 
@@ -211,13 +490,29 @@ undo_t tile_layer_t::fill()
         return {};
 
     undo_t ret = save(canvas_rect);
+    auto const unselected = [&](coord_t c) { return !canvas_selector[c]; };
+
+    // A single picked tile fills whole runs with one value:
+    if(picker_rect.d.w == 1 && picker_rect.d.h == 1)
+    {
+        std::uint16_t const tile = to_tile(picker_rect.c);
+        for_each_run(canvas_rect, unselected, [&](rect_t run) { fill_rect(run, tile); });
+        return ret;
+    }
+
+    // Look up the picked tiles once, rather than once per cell filled:
+    grid_t<std::uint16_t> pattern(picker_rect.d);
+    for(coord_t c : rect_range(picker_rect))
+        pattern[c - picker_rect.c] = to_tile(c);
 
+    std::vector<std::uint16_t> filled(canvas_rect.d.w * canvas_rect.d.h);
     canvas_selector.for_each_selected([&](coord_t c)
     {
         coord_t const o = c - canvas_rect.c;
-        coord_t const p = coord_t{ o.x % picker_rect.d.w, o.y % picker_rect.d.h } + picker_rect.c;
-        set(c, to_tile(p));
+        if(in_bounds(o, canvas_rect.d))
+            filled[o.y * canvas_rect.d.w + o.x] = pattern[{ o.x % picker_rect.d.w, o.y % picker_rect.d.h }];
     });
+    write_runs(*this, canvas_rect, filled.data(), [&](coord_t c, std::uint16_t) { return unselected(c); });
 
     return ret;
 }
@@ -234,13 +529,17 @@ undo_t tile_layer_t::fill_paste(tile_copy_t const& copy)
 
         undo_t ret = save(canvas_rect);
 
+        std::vector<std::uint16_t> filled(canvas_rect.d.w * canvas_rect.d.h, std::uint16_t(~0u));
         canvas_selector.for_each_selected([&](coord_t c)
         {
             coord_t const o = c - canvas_rect.c;
             coord_t const p = coord_t{ o.x % copy_dimen.w, o.y % copy_dimen.h };
-
-            if((*grid)[p] != std::uint16_t(~0u) && in_bounds(c, canvas_dimen()))
-                set(c, (*grid)[p]);
+            if(in_bounds(o, canvas_rect.d))
+                filled[o.y * canvas_rect.d.w + o.x] = (*grid)[p];
+        });
+        write_runs(*this, canvas_rect, filled.data(), [&](coord_t c, std::uint16_t value) 
+        { 
+            return value == std::uint16_t(~0u) || !canvas_selector[c]; 
         });
 
         return ret;
@@ -252,10 +551,101 @@ undo_t tile_layer_t::fill_paste(tile_copy_t const& copy)
 undo_t tile_layer_t::save(rect_t rect)
 {
     rect = crop(rect, canvas_dimen());
-    undo_tiles_t ret = { this, rect };
-    for(coord_t c : rect_range(rect))
-        ret.tiles.push_back(get(c));
-    return undo_t(std::move(ret));
+    std::vector<std::uint16_t> tiles(rect.d.w * rect.d.h);
+    read_rect(rect, tiles.data());
+    return undo_tiles_t{ this, rect, tile_runs_t(tiles.data(), tiles.size()) };
+}
+
+void tile_layer_t::write_tile(coord_t c, std::uint8_t value)
+{
+    bool const counting = usage_current();
+    std::uint8_t& tile = tiles.at(c);
+    if(counting)
+    {
+        --m_usage[tile];
+        ++m_usage[value];
+        m_usage_revision = tiles.revision();
+    }
+    tile = value;
+}
+
+void tile_layer_t::remap(std::array<std::uint8_t, 256> const& lut)
+{
+    bool const counting = usage_current();
+    tiles.for_each_span(to_rect(tiles.dimen()), [&](coord_t, std::uint8_t* span, int n)
+    {
+        for(int i = 0; i < n; ++i)
+            span[i] = lut[span[i]];
+    });
+
+    if(counting)
+    {
+        std::array<unsigned, 256> usage = {};
+        for(unsigned i = 0; i < 256; ++i)
+            usage[lut[i]] += m_usage[i];
+        m_usage = usage;
+        m_usage_revision = tiles.revision();
+    }
+}
+
+std::array<unsigned, 256> const& tile_layer_t::usage() const
+{
+    if(!usage_current())
+    {
+        m_usage.fill(0);
+        tiles.for_each_span(to_rect(tiles.dimen()), [&](coord_t, std::uint8_t const* span, int n)
+        {
+            for(int i = 0; i < n; ++i)
+                ++m_usage[span[i]];
+        });
+        m_usage_revision = tiles.revision();
+    }
+    return m_usage;
+}
+
+void tile_layer_t::do_read_rect(rect_t rect, std::uint16_t* out) const
+{
+    tiles.for_each_span(rect, [&](coord_t, std::uint8_t const* span, int n)
+    {
+        out = std::copy(span, span + n, out);
+    });
+}
+
+void tile_layer_t::do_write_rect(rect_t rect, std::uint16_t const* in)
+{
+    bool const counting = usage_current();
+    tiles.for_each_span(rect, [&](coord_t, std::uint8_t* span, int n)
+    {
+        if(counting)
+        {
+            for(int i = 0; i < n; ++i)
+            {
+                --m_usage[span[i]];
+                ++m_usage[std::uint8_t(in[i])];
+            }
+        }
+        std::transform(in, in + n, span, [](std::uint16_t value) { return std::uint8_t(value); });
+        in += n;
+    });
+    if(counting)
+        m_usage_revision = tiles.revision();
+}
+
+void tile_layer_t::do_fill_rect(rect_t rect, std::uint16_t value)
+{
+    bool const counting = usage_current();
+    tiles.for_each_span(rect, [&](coord_t, std::uint8_t* span, int n)
+    {
+        if(counting)
+        {
+            for(int i = 0; i < n; ++i)
+                --m_usage[span[i]];
+            m_usage[std::uint8_t(value)] += n;
+        }
+        std::memset(span, std::uint8_t(value), n);
+    });
+    if(counting)
+        m_usage_revision = tiles.revision();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -279,6 +669,35 @@ undo_t chr_layer_t::fill_attribute()
     return ret;
 }
 
+// The attribute of each 2x2 block is held in the high byte of every cell's value.
+// Like set(), writing assigns a block's attribute from each of its cells in turn.
+
+void chr_layer_t::do_read_rect(rect_t rect, std::uint16_t* out) const
+{
+    tile_layer_t::do_read_rect(rect, out);
+    for(int y = rect.c.y; y < rect.e().y; ++y, out += rect.d.w)
+        for(int x = 0; x < rect.d.w; ++x)
+            out[x] |= attributes.at({ (rect.c.x + x) / 2, y / 2 }) << 8;
+}
+
+void chr_layer_t::do_write_rect(rect_t rect, std::uint16_t const* in)
+{
+    tile_layer_t::do_write_rect(rect, in);
+    for(int y = rect.c.y; y < rect.e().y; ++y, in += rect.d.w)
+        for(int x = 0; x < rect.d.w; ++x)
+            attributes.at({ (rect.c.x + x) / 2, y / 2 }) = in[x] >> 8;
+}
+
+void chr_layer_t::do_fill_rect(rect_t rect, std::uint16_t value)
+{
+    tile_layer_t::do_fill_rect(rect, value);
+    coord_t const c0 = vec_div(rect.c, 2);
+    coord_t const c1 = vec_div(rect.e() - coord_t{ 1, 1 }, 2);
+    for(int y = c0.y; y <= c1.y; ++y)
+        for(int x = c0.x; x <= c1.x; ++x)
+            attributes.at({ x, y }) = value >> 8;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // metatile_model_t ////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -286,6 +705,7 @@ undo_t chr_layer_t::fill_attribute()
 void metatile_model_t::clear_chr()
 {
     chr_bitmaps.clear();
+    ++bitmaps_serial;
 }
 
 void metatile_model_t::refresh_chr(chr_array_t const& chr, palette_array_t const& palette)
@@ -295,93 +715,770 @@ void metatile_model_t::refresh_chr(chr_array_t const& chr, palette_array_t const
     chr_bitmaps.reserve(bmp.size());
     for(unsigned i = 0; i < bmp.size(); ++i)
         chr_bitmaps.push_back(convert_bitmap(bmp[i]));
+    ++bitmaps_serial;
 }
 
-void metatile_model_t::shift(std::uint8_t from, std::uint8_t to, int amount)
+tile_lut_t identity_lut()
 {
-    chr_layer_t chr_copy = chr_layer;
-    collision_layer_t collision_copy = collision_layer;
+    tile_lut_t lut;
+    for(unsigned i = 0; i < 256; ++i)
+        lut[i] = i;
+    return lut;
+}
 
-    int len = int(to) - int(from);
-    if(len < 0)
-        len += 256;
+tile_lut_t invert_lut(tile_lut_t const& lut)
+{
+    tile_lut_t inverse;
+    for(unsigned i = 0; i < 256; ++i)
+        inverse[lut[i]] = i;
+    return inverse;
+}
 
-    int j = 0;
-    for(std::uint8_t i = from; i != to; i += 1, j += 1)
+tile_lut_t shift_lut(std::uint8_t from, std::uint8_t to, int amount)
+{
+    tile_lut_t lut = identity_lut();
+    int const len = std::uint8_t(to - from);
+    for(int j = 0; j < len; ++j)
     {
-        unsigned tx = (i % 16);
-        unsigned ty = (i / 16);
-
         int k = (j + amount) % len;
         if(k < 0)
             k += len;
+        lut[std::uint8_t(from + j)] = std::uint8_t(from + k);
+    }
+    return lut;
+}
+
+tile_lut_t compact_lut(std::array<unsigned, 256> const& usage)
+{
+    tile_lut_t lut;
+    unsigned next = 0;
+    for(unsigned i = 0; i < 256; ++i)
+        if(usage[i])
+            lut[i] = next++;
+    for(unsigned i = 0; i < 256; ++i)
+        if(!usage[i])
+            lut[i] = next++;
+    return lut;
+}
+
+tile_lut_t swap_lut(std::uint8_t a, std::uint8_t b)
+{
+    tile_lut_t lut = identity_lut();
+    std::swap(lut[a], lut[b]);
+    return lut;
+}
+
+tile_lut_t sort_lut(std::array<unsigned, 256> const& usage, unsigned num)
+{
+    num = std::min(num, 256u);
+    std::array<std::uint8_t, 256> order;
+    for(unsigned i = 0; i < 256; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.begin() + num, [&](unsigned a, unsigned b) { return usage[a] > usage[b]; });
+
+    tile_lut_t lut;
+    for(unsigned i = 0; i < 256; ++i)
+        lut[order[i]] = i;
+    return lut;
+}
+
+void metatile_model_t::permute(tile_lut_t const& lut)
+{
+    // Metatile i is cell (i % 16, i / 16) of 'collision_layer' and 'chr_layer.attributes',
+    // and the 2x2 cells from twice that in 'chr_layer'.
+    rect_t const chr_rect = to_rect(chr_layer.canvas_dimen());
+    rect_t const collision_rect = to_rect(collision_layer.canvas_dimen());
+    assert(chr_rect.d.w == 32 && chr_rect.d.h == 32 && collision_rect.d.w == 16 && collision_rect.d.h == 16);
+
+    std::vector<std::uint16_t> chr(32 * 32);
+    std::vector<std::uint16_t> collision(16 * 16);
+    chr_layer.read_rect(chr_rect, chr.data());
+    collision_layer.read_rect(collision_rect, collision.data());
+
+    std::vector<std::uint16_t> new_chr(chr.size());
+    std::vector<std::uint16_t> new_collision(collision.size());
+    for(unsigned i = 0; i < 256; ++i)
+    {
+        unsigned const j = lut[i];
+        new_collision[j] = collision[i];
+        for(unsigned y = 0; y < 2; ++y)
+        for(unsigned x = 0; x < 2; ++x)
+            new_chr[((j / 16)*2 + y)*32 + (j % 16)*2 + x] = chr[((i / 16)*2 + y)*32 + (i % 16)*2 + x];
+    }
 
-        unsigned ux = (std::uint8_t(from + k) % 16);
-        unsigned uy = (std::uint8_t(from + k) / 16);
+    chr_layer.write_rect(chr_rect, new_chr.data());
+    collision_layer.write_rect(collision_rect, new_collision.data());
+}
 
-        for(unsigned y = 0; y < 2; y += 1)
-        for(unsigned x = 0; x < 2; x += 1)
-            chr_layer.set({ ux*2+x, uy*2+y }, chr_copy.get({ tx*2+x, ty*2+y }));
-        collision_layer.set({ ux, uy, }, collision_copy.get({ tx, ty }));
+auto metatile_model_t::duplicates() const -> duplicate_groups_t
+{
+    std::vector<std::uint16_t> chr(32 * 32);
+    std::vector<std::uint16_t> collision(16 * 16);
+    chr_layer.read_rect(to_rect(chr_layer.canvas_dimen()), chr.data());
+    collision_layer.read_rect(to_rect(collision_layer.canvas_dimen()), collision.data());
+
+    // Keyed by the four CHR tiles, then the attribute and collision:
+    std::unordered_map<std::uint64_t, std::uint8_t> first;
+    std::array<int, 256> group_of;
+    group_of.fill(-1);
+    duplicate_groups_t groups;
+
+    unsigned const n = std::min<unsigned>(num, 256);
+    first.reserve(n);
+    for(unsigned i = 0; i < n; ++i)
+    {
+        std::uint16_t const* cell = &chr[(i / 16)*2*32 + (i % 16)*2];
+        std::uint64_t key = collision[i];
+        key = (key << 8) | (cell[0] >> 8);
+        for(std::uint16_t tile : { cell[0], cell[1], cell[32], cell[33] })
+            key = (key << 8) | (tile & 0xFF);
+
+        auto const [it, inserted] = first.emplace(key, i);
+        if(inserted)
+            continue;
+        int& group = group_of[it->second];
+        if(group < 0)
+        {
+            group = groups.size();
+            groups.push_back({ it->second });
+        }
+        groups[group].push_back(i);
     }
+
+    return groups;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// level_model_t ///////////////////////////////////////////////////////////////
+// metatile_pixels_t ///////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-void level_model_t::shift(std::uint8_t from, std::uint8_t to, int amount)
+metatile_pixels_t::metatile_pixels_t(metatile_model_t const& metatiles, chr_array_t const& chr, 
+                                     palette_array_t const& palette, metric_t metric)
+: m_num(std::min<unsigned>(metatiles.num, 256))
+, m_planes(metric == METRIC_COLORS ? 6 : 2) // NES colors fit in 6 bits.
+, m_words(m_num * m_planes * PLANE_WORDS)
 {
-    int len = int(to) - int(from);
-    if(len < 0)
-        len += 256;
+    std::vector<std::uint16_t> cells(32 * 32);
+    metatiles.chr_layer.read_rect(to_rect(metatiles.chr_layer.canvas_dimen()), cells.data());
 
-    for(std::uint8_t& mt : metatile_layer.tiles)
+    for(unsigned i = 0; i < m_num; ++i)
     {
-        int a = mt - int(from);
-        if(a >= 0 && a < len)
+        std::uint16_t const* cell = &cells[(i / 16)*2*32 + (i % 16)*2];
+        std::array<std::uint64_t, PLANE_WORDS * 2> bits = {};
+        for(unsigned y = 0; y < 16; ++y)
+        {
+            std::uint8_t const* left = &chr[(cell[(y / 8)*32] & 0xFF) * 16 + y % 8];
+            std::uint8_t const* right = &chr[(cell[(y / 8)*32 + 1] & 0xFF) * 16 + y % 8];
+            unsigned const shift = (y % 4) * 16;
+            for(unsigned plane = 0; plane < 2; ++plane)
+                bits[plane * PLANE_WORDS + y / 4] |= std::uint64_t((left[plane * 8] << 8) | right[plane * 8]) << shift;
+        }
+
+        std::uint64_t* out = &m_words[i * m_planes * PLANE_WORDS];
+        if(metric == METRIC_PIXELS)
+        {
+            std::copy(bits.begin(), bits.end(), out);
+            continue;
+        }
+
+        // Turn the two planes of pixel values into six planes of color bits:
+        unsigned const attribute = cell[0] >> 8;
+        for(unsigned w = 0; w < PLANE_WORDS; ++w)
         {
-            a += amount;
-            a %= len;
-            if(a < 0)
-                a += len;
-            mt = std::uint8_t(from + a);
+            std::uint64_t const lo = bits[w];
+            std::uint64_t const hi = bits[PLANE_WORDS + w];
+            std::array<std::uint64_t, 4> const masks = { ~lo & ~hi, lo & ~hi, ~lo & hi, lo & hi };
+            for(unsigned value = 0; value < 4; ++value)
+            {
+                unsigned const color = palette[(attribute * 4 + value) % palette.size()];
+                for(unsigned plane = 0; plane < m_planes; ++plane)
+                    if((color >> plane) & 1)
+                        out[plane * PLANE_WORDS + w] |= masks[value];
+            }
         }
     }
 }
 
-void level_model_t::clear_metatiles()
+unsigned metatile_pixels_t::distance(unsigned a, unsigned b) const
 {
-    metatile_bitmaps.clear();
+    std::uint64_t const* wa = words(a);
+    std::uint64_t const* wb = words(b);
+    unsigned ret = 0;
+    for(unsigned w = 0; w < PLANE_WORDS; ++w)
+    {
+        std::uint64_t diff = 0;
+        for(unsigned plane = 0; plane < m_planes; ++plane)
+            diff |= wa[plane * PLANE_WORDS + w] ^ wb[plane * PLANE_WORDS + w];
+        ret += std::popcount(diff);
+    }
+    return ret;
 }
 
-void level_model_t::refresh_metatiles(
-    metatile_model_t const& metatiles, chr_array_t const& chr, 
-    std::vector<wxBitmap> const* collision_bitmaps, palette_array_t const& palette)
+auto metatile_pixels_t::rank(std::uint8_t metatile) const -> std::vector<match_t>
 {
-    auto chr_bitmaps = chr_to_bitmaps(chr.data(), chr.size(), palette.data());
+    std::vector<match_t> ret;
+    if(metatile >= m_num)
+        return ret;
+    ret.reserve(m_num);
+    for(unsigned i = 0; i < m_num; ++i)
+        if(i != metatile)
+            ret.push_back({ metatile, std::uint8_t(i), distance(metatile, i) });
+    std::stable_sort(ret.begin(), ret.end(), [](match_t const& a, match_t const& b) { return a.distance < b.distance; });
+    return ret;
+}
 
-    unsigned i = 0;
-    metatile_bitmaps.clear();
-    for(coord_t c : dimen_range({ 16, 16 }))
+auto metatile_pixels_t::pairs(unsigned max_distance) const -> std::vector<match_t>
+{
+    std::vector<match_t> ret;
+    for(unsigned a = 0; a < m_num; ++a)
+    for(unsigned b = a + 1; b < m_num; ++b)
     {
-        wxBitmap bitmap(wxSize(16, 16));
+        unsigned const d = distance(a, b);
+        if(d <= max_distance)
+            ret.push_back({ std::uint8_t(a), std::uint8_t(b), d });
+    }
+    std::stable_sort(ret.begin(), ret.end(), [](match_t const& a, match_t const& b) { return a.distance < b.distance; });
+    return ret;
+}
 
-        {
-            wxMemoryDC dc;
-            dc.SelectObject(bitmap);
+////////////////////////////////////////////////////////////////////////////////
+// object class interning //////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 
-            for(int y = 0; y < 2; ++y)
-            for(int x = 0; x < 2; ++x)
-            {
-                coord_t const c0 = { c.x*2 + x, c.y*2 + y };
-                if(in_bounds(c0, metatiles.chr_layer.tiles.dimen()))
-                {
-                    std::uint8_t const i = metatiles.chr_layer.tiles.at({ c.x*2 + x, c.y*2 + y });
-                    std::uint8_t const a = metatiles.chr_layer.attributes.at(c);
-                    dc.DrawBitmap(chr_bitmaps.at(i)[a], { x*8, y*8 }, false);
-                }
-            }
+class_id_t model_t::class_id(std::string const& name)
+{
+    auto const [it, inserted] = class_ids.emplace(name, class_names.size());
+    if(inserted)
+        class_names.push_back(name);
+    return it->second;
+}
+
+void model_t::index_classes()
+{
+    std::unordered_map<std::string, std::shared_ptr<object_class_t>> by_name;
+    for(auto const& oc : object_classes)
+    {
+        class_id(oc->name);
+        by_name.emplace(oc->name, oc);
+    }
+
+    // Resolve by name, so that IDs left behind by 'rename_class' still work:
+    class_ptrs.resize(class_names.size());
+    class_layouts.resize(class_names.size());
+    for(class_id_t id = 0; id < class_names.size(); ++id)
+    {
+        auto it = by_name.find(class_names[id]);
+        class_ptrs[id] = it != by_name.end() ? it->second : nullptr;
+
+        // A name can be bound to a different class after a delete and re-add.
+        // Move the objects' fields over to the new class's layout:
+        if(class_ptrs[id] && class_layouts[id] && class_ptrs[id] != class_layouts[id])
+        {
+            for_each_object([&](object_t& object)
+            {
+                if(object.oclass == id)
+                    object.migrate_fields(class_layouts[id].get(), class_ptrs[id].get());
+            });
+        }
+
+        if(class_ptrs[id])
+            class_layouts[id] = class_ptrs[id];
+    }
+}
+
+void model_t::set_class(object_t& object, std::string const& name, std::shared_ptr<object_class_t> const& layout)
+{
+    class_id_t const id = class_id(name);
+    class_layouts.resize(class_names.size());
+    if(!class_layouts[id])
+        class_layouts[id] = layout;
+    object.migrate_fields(layout.get(), class_layouts[id].get());
+    object.oclass = id;
+}
+
+void model_t::reset_classes()
+{
+    std::vector<object_t*> kept;
+    for_each_object([&](object_t& object) { kept.push_back(&object); });
+
+    std::vector<std::pair<std::string, std::shared_ptr<object_class_t>>> classes;
+    for(object_t const* object : kept)
+    {
+        auto layout = object->oclass < class_layouts.size() ? class_layouts[object->oclass] : nullptr;
+        classes.emplace_back(class_name(object->oclass), std::move(layout));
+    }
+
+    class_names = { "" };
+    class_ids = {{ "", 0 }};
+    class_ptrs.clear();
+    class_layouts.clear();
+
+    for(std::size_t i = 0; i < kept.size(); ++i)
+    {
+        class_id_t const id = class_id(classes[i].first);
+        class_layouts.resize(class_names.size());
+        if(!class_layouts[id])
+            class_layouts[id] = classes[i].second;
+        kept[i]->oclass = id;
+    }
+}
+
+void model_t::relayout(object_t& object, class_layouts_t const& layouts) const
+{
+    // As in index_classes, objects of an ID that had no layout keep their fields as they are:
+    object_class_t const* from = object.oclass < layouts.size() ? layouts[object.oclass].get() : nullptr;
+    object_class_t const* to = object.oclass < class_layouts.size() ? class_layouts[object.oclass].get() : nullptr;
+    if(from && to)
+        object.migrate_fields(from, to);
+}
+
+void model_t::rename_class(std::string const& old_name, std::string const& new_name)
+{
+    auto it = class_ids.find(old_name);
+    if(it != class_ids.end() && old_name != new_name)
+    {
+        // Objects keep their ID; only its name changes.
+        class_id_t const id = it->second;
+        class_ids.erase(it);
+        auto const [new_it, inserted] = class_ids.emplace(new_name, id);
+        class_names[id] = new_name;
+
+        if(!inserted)
+        {
+            // Objects were already using 'new_name' without a class; merge them into 'id'.
+            class_id_t const orphan = new_it->second;
+            new_it->second = id;
+            class_layouts.resize(class_names.size());
+
+            for_each_object([&](object_t& object)
+            {
+                if(object.oclass == orphan)
+                {
+                    object.oclass = id;
+                    object.migrate_fields(class_layouts[orphan].get(), class_layouts[id].get());
+                }
+            });
+        }
+    }
+    index_classes();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// name lookups ////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    template<typename C, typename Get>
+    void index_by_name(std::unordered_map<std::string, std::size_t>& index, C const& c, Get const& get)
+    {
+        index.clear();
+        for(std::size_t i = 0; i < c.size(); ++i)
+            index.emplace(get(c[i]).name, i);
+    }
+
+    // A miss is authoritative, as every add, removal, and rename calls index_names().
+    // A hit that no longer matches means 'c' changed since, so that case alone scans.
+    // The scan doesn't rebuild the index, as lookups also run on worker threads (see merge_duplicates).
+    template<typename C, typename Get>
+    auto find_by_name(std::unordered_map<std::string, std::size_t> const& index, C& c, std::string const& name, Get const& get)
+        -> decltype(&c[0])
+    {
+        auto it = index.find(name);
+        if(it == index.end())
+            return nullptr;
+        if(it->second < c.size() && get(c[it->second]).name == name)
+            return &c[it->second];
+        for(auto& e : c)
+            if(get(e).name == name)
+                return &e;
+        return nullptr;
+    }
+}
+
+void model_t::index_names()
+{
+    auto const value = [](auto const& e) -> auto const& { return e; };
+    auto const deref = [](auto const& e) -> auto const& { return *e; };
+    index_by_name(chr_index, chr_files, value);
+    index_by_name(metatile_index, metatiles, deref);
+    index_by_name(level_index, levels, deref);
+}
+
+chr_file_t* model_t::chr_file(std::string const& name)
+{
+    return find_by_name(chr_index, chr_files, name, [](auto const& e) -> auto const& { return e; });
+}
+
+std::shared_ptr<metatile_model_t> model_t::metatile_set(std::string const& name) const
+{
+    auto const* ptr = find_by_name(metatile_index, metatiles, name, [](auto const& e) -> auto const& { return *e; });
+    return ptr ? *ptr : nullptr;
+}
+
+std::shared_ptr<level_model_t> model_t::level(std::string const& name) const
+{
+    auto const* ptr = find_by_name(level_index, levels, name, [](auto const& e) -> auto const& { return *e; });
+    return ptr ? *ptr : nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// mtt_stats_t /////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+mtt_stats_t::mtt_stats_t(chunk_grid_t<std::uint8_t> const& tiles)
+{
+    for_each_block(tiles, [&](coord_t, key_t key) { add(key); });
+}
+
+void mtt_stats_t::add(key_t key, unsigned count)
+{
+    if(count == 0)
+        return;
+    if((m_unique + 1) * 2 > m_counts.size())
+        grow();
+
+    m_total += count;
+    for(std::size_t i = slot(key);; i = (i + 1) & (m_counts.size() - 1))
+    {
+        if(!m_counts[i])
+        {
+            m_keys[i] = key;
+            m_counts[i] = count;
+            ++m_unique;
+            return;
+        }
+        if(m_keys[i] == key)
+        {
+            m_counts[i] += count;
+            return;
+        }
+    }
+}
+
+void mtt_stats_t::merge(mtt_stats_t const& other)
+{
+    other.for_each([&](key_t key, unsigned count) { add(key, count); });
+}
+
+unsigned mtt_stats_t::count(key_t key) const
+{
+    if(m_counts.empty())
+        return 0;
+    for(std::size_t i = slot(key);; i = (i + 1) & (m_counts.size() - 1))
+    {
+        if(!m_counts[i])
+            return 0;
+        if(m_keys[i] == key)
+            return m_counts[i];
+    }
+}
+
+void mtt_stats_t::grow()
+{
+    std::vector<key_t> keys(m_counts.empty() ? 64 : m_counts.size() * 2);
+    std::vector<unsigned> counts(keys.size());
+    std::swap(keys, m_keys);
+    std::swap(counts, m_counts);
+    m_shift = 32 - std::countr_zero(m_counts.size());
+
+    for(std::size_t j = 0; j < counts.size(); ++j)
+    {
+        if(!counts[j])
+            continue;
+        std::size_t i = slot(keys[j]);
+        while(m_counts[i])
+            i = (i + 1) & (m_counts.size() - 1);
+        m_keys[i] = keys[j];
+        m_counts[i] = counts[j];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// object_index_t //////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void object_index_t::reset(dimen_t level_dimen)
+{
+    m_level_dimen = level_dimen;
+    m_size = 0;
+    dimen_t const pixels = vec_mul(level_dimen, 16);
+    m_buckets.resize({ (pixels.w + CELL_SIZE - 1) / CELL_SIZE, (pixels.h + CELL_SIZE - 1) / CELL_SIZE });
+    for(auto& bucket : m_buckets)
+        bucket.clear();
+}
+
+coord_t object_index_t::to_cell(coord_t position) const
+{
+    position = crop(position, to_rect(vec_mul(m_level_dimen, 16)));
+    return crop(vec_div(position, CELL_SIZE), to_rect(m_buckets.dimen()));
+}
+
+void object_index_t::insert(object_handle_t handle, coord_t position)
+{
+    if(m_buckets.dimen().w <= 0 || m_buckets.dimen().h <= 0)
+        return;
+    m_buckets[to_cell(position)].push_back(handle);
+    ++m_size;
+}
+
+void object_index_t::erase(object_handle_t handle, coord_t position)
+{
+    if(m_buckets.dimen().w <= 0 || m_buckets.dimen().h <= 0)
+        return;
+    auto& bucket = m_buckets[to_cell(position)];
+    auto it = std::find(bucket.begin(), bucket.end(), handle);
+    if(it != bucket.end())
+    {
+        *it = bucket.back();
+        bucket.pop_back();
+        --m_size;
+    }
+}
+
+void object_index_t::move(object_handle_t handle, coord_t from, coord_t to)
+{
+    if(m_buckets.dimen().w <= 0 || m_buckets.dimen().h <= 0 || to_cell(from) == to_cell(to))
+        return;
+    erase(handle, from);
+    insert(handle, to);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// object_list_t ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+int object_list_t::index(object_handle_t handle) const
+{
+    if(handle.slot >= m_slots.size())
+        return -1;
+    slot_t const& slot = m_slots[handle.slot];
+    if(!slot.live || slot.generation != handle.generation)
+        return -1;
+    return slot.index;
+}
+
+object_t& object_list_t::at(object_handle_t handle)
+{
+    if(object_t* object = get(handle))
+        return *object;
+    throw std::runtime_error("Stale object handle.");
+}
+
+void object_list_t::free_slot(std::uint32_t i)
+{
+    slot_t& slot = m_slots[i];
+    slot.live = false;
+    if(!slot.in_free)
+    {
+        slot.in_free = true;
+        m_free.push_back(i);
+    }
+}
+
+object_handle_t object_list_t::push_back(object_t object)
+{
+    while(!m_free.empty() && m_slots[m_free.back()].live)
+    {
+        m_slots[m_free.back()].in_free = false;
+        m_free.pop_back();
+    }
+
+    std::uint32_t i;
+    if(m_free.empty())
+    {
+        i = m_slots.size();
+        m_slots.emplace_back();
+    }
+    else
+    {
+        i = m_free.back();
+        m_free.pop_back();
+        m_slots[i].in_free = false;
+    }
+
+    slot_t& slot = m_slots[i];
+    slot.index = m_objects.size();
+    slot.generation = slot.next_generation++;
+    slot.live = true;
+
+    object_handle_t const handle = { i, slot.generation };
+    m_objects.push_back(std::move(object));
+    m_handles.push_back(handle);
+    return handle;
+}
+
+void object_list_t::clear()
+{
+    for(object_handle_t handle : m_handles)
+        free_slot(handle.slot);
+    m_objects.clear();
+    m_handles.clear();
+}
+
+std::vector<removed_object_t> object_list_t::erase(std::vector<object_handle_t> const& handles)
+{
+    std::vector<bool> doomed(m_objects.size());
+    for(object_handle_t handle : handles)
+    {
+        int const i = index(handle);
+        if(i >= 0)
+            doomed[i] = true;
+    }
+
+    std::vector<removed_object_t> removed;
+    unsigned j = 0;
+    for(unsigned i = 0; i < m_objects.size(); ++i)
+    {
+        if(doomed[i])
+        {
+            free_slot(m_handles[i].slot);
+            removed.push_back({ i, m_handles[i], std::move(m_objects[i]) });
+        }
+        else
+        {
+            if(i != j)
+            {
+                m_objects[j] = std::move(m_objects[i]);
+                m_handles[j] = m_handles[i];
+            }
+            m_slots[m_handles[j].slot].index = j;
+            ++j;
+        }
+    }
+
+    m_objects.resize(j);
+    m_handles.resize(j);
+    return removed;
+}
+
+void object_list_t::restore(std::vector<removed_object_t> const& removed)
+{
+    std::vector<object_t> objects;
+    std::vector<object_handle_t> handles;
+    objects.reserve(m_objects.size() + removed.size());
+    handles.reserve(m_objects.size() + removed.size());
+
+    unsigned i = 0;
+    auto const take = [&]()
+    {
+        objects.push_back(std::move(m_objects[i]));
+        handles.push_back(m_handles[i]);
+        ++i;
+    };
+
+    for(auto const& r : removed)
+    {
+        while(objects.size() < r.index && i < m_objects.size())
+            take();
+        objects.push_back(r.object);
+        handles.push_back(r.handle);
+
+        if(r.handle.slot >= m_slots.size())
+            m_slots.resize(r.handle.slot + 1);
+        slot_t& slot = m_slots[r.handle.slot];
+        slot.generation = r.handle.generation;
+        slot.next_generation = std::max(slot.next_generation, r.handle.generation + 1);
+        slot.live = true;
+    }
+    while(i < m_objects.size())
+        take();
+
+    m_objects = std::move(objects);
+    m_handles = std::move(handles);
+    for(unsigned j = 0; j < m_handles.size(); ++j)
+        m_slots[m_handles[j].slot].index = j;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// level_model_t ///////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void level_model_t::reindex_objects()
+{
+    m_object_index.reset(dimen());
+    for(unsigned i = 0; i < objects.size(); ++i)
+        m_object_index.insert(objects.handle(i), objects[i].position);
+}
+
+object_handle_t level_model_t::push_object(object_t object)
+{
+    bool const in_sync = m_object_index.size() == objects.size() && m_object_index.level_dimen() == dimen();
+    coord_t const position = object.position;
+    object_handle_t const handle = objects.push_back(std::move(object));
+    if(in_sync)
+        m_object_index.insert(handle, position);
+    return handle;
+}
+
+void level_model_t::move_object(object_handle_t handle, coord_t position)
+{
+    object_t& object = objects.at(handle);
+    coord_t const from = object.position;
+    object.position = position;
+    object_moved(handle, from);
+}
+
+void level_model_t::object_moved(object_handle_t handle, coord_t from)
+{
+    m_object_index.move(handle, from, objects.at(handle).position);
+}
+
+std::vector<removed_object_t> level_model_t::erase_objects(std::vector<object_handle_t> const& handles)
+{
+    for(object_handle_t handle : handles)
+        if(object_t const* object = objects.get(handle))
+            m_object_index.erase(handle, object->position);
+    return objects.erase(handles);
+}
+
+void level_model_t::restore_objects(std::vector<removed_object_t> const& removed)
+{
+    objects.restore(removed);
+    for(auto const& r : removed)
+        m_object_index.insert(r.handle, r.object.position);
+}
+
+object_index_t const& level_model_t::object_index()
+{
+    if(m_object_index.level_dimen() != dimen() || m_object_index.size() != objects.size())
+        reindex_objects();
+    return m_object_index;
+}
+
+void level_model_t::clear_metatiles()
+{
+    metatile_bitmaps.clear();
+    ++bitmaps_serial;
+}
+
+void level_model_t::refresh_metatiles(
+    metatile_model_t const& metatiles, chr_array_t const& chr, 
+    std::vector<wxBitmap> const* collision_bitmaps, palette_array_t const& palette)
+{
+    auto chr_bitmaps = chr_to_bitmaps(chr.data(), chr.size(), palette.data());
+
+    unsigned i = 0;
+    metatile_bitmaps.clear();
+    for(coord_t c : dimen_range({ 16, 16 }))
+    {
+        wxBitmap bitmap(wxSize(16, 16));
+
+        {
+            wxMemoryDC dc;
+            dc.SelectObject(bitmap);
+
+            for(int y = 0; y < 2; ++y)
+            for(int x = 0; x < 2; ++x)
+            {
+                coord_t const c0 = { c.x*2 + x, c.y*2 + y };
+                if(in_bounds(c0, metatiles.chr_layer.tiles.dimen()))
+                {
+                    std::uint8_t const i = metatiles.chr_layer.tiles.at({ c.x*2 + x, c.y*2 + y });
+                    std::uint8_t const a = metatiles.chr_layer.attributes.at(c);
+                    dc.DrawBitmap(chr_bitmaps.at(i)[a], { x*8, y*8 }, false);
+                }
+            }
 
             if(collision_bitmaps)
             {
@@ -390,107 +1487,396 @@ void level_model_t::refresh_metatiles(
                     dc.DrawBitmap((*collision_bitmaps)[tile], { 0, 0 }, false);
             }
 
-            if(i >= metatiles.num)
-            {
-                dc.SetPen(wxPen(wxColor(255, 0, 0), 2, wxPENSTYLE_SOLID));
-                dc.DrawLine(1, 1, 14, 14);
-                dc.SetPen(wxPen(wxColor(0, 0, 255), 2, wxPENSTYLE_SOLID));
-                dc.DrawLine(1, 14, 14, 1);
-            }
-        }
+            if(i >= metatiles.num)
+            {
+                dc.SetPen(wxPen(wxColor(255, 0, 0), 2, wxPENSTYLE_SOLID));
+                dc.DrawLine(1, 1, 14, 14);
+                dc.SetPen(wxPen(wxColor(0, 0, 255), 2, wxPENSTYLE_SOLID));
+                dc.DrawLine(1, 14, 14, 1);
+            }
+        }
+
+#ifdef GC_RENDER
+        metatile_bitmaps.push_back(get_renderer()->CreateBitmap(std::move(bitmap)));
+#else
+        metatile_bitmaps.push_back(std::move(bitmap));
+#endif
+        ++i;
+    }
+    ++bitmaps_serial;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// model_t /////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+undo_t model_t::operator()(undo_tiles_t const& undo)
+{ 
+    auto ret = undo.layer->save(undo.rect);
+    std::vector<std::uint16_t> tiles(undo.tiles.size());
+    undo.tiles.decode(tiles.data());
+    undo.layer->write_rect(undo.rect, tiles.data());
+    return ret;
+}
+
+undo_t model_t::operator()(undo_palette_num_t const& undo)
+{
+    auto ret = undo_palette_num_t{ palette.num };
+    palette.num = undo.num;
+    return ret;
+}
+
+undo_t model_t::operator()(undo_metatile_num_t const& undo)
+{
+    auto ret = undo_metatile_num_t{ undo.metatiles, undo.metatiles->num };
+    undo.metatiles->num = undo.num;
+    return ret;
+}
+
+undo_t model_t::operator()(undo_level_dimen_t const& undo)
+{
+    auto ret = undo.layer->save();
+    undo.layer->tiles.resize(undo.dimen);
+    undo.tiles.decode(undo.layer->tiles);
+    return ret;
+}
+
+undo_t model_t::operator()(undo_new_object_t const& undo)
+{
+    return undo_delete_object_t{ undo.level, undo.level->erase_objects(undo.handles), class_layouts };
+}
+
+undo_t model_t::operator()(undo_delete_object_t const& undo)
+{
+    auto ret = undo_new_object_t{ undo.level };
+    std::vector<removed_object_t> objects = undo.objects;
+    for(auto& r : objects)
+    {
+        ret.handles.push_back(r.handle);
+        relayout(r.object, undo.layouts);
+    }
+    undo.level->restore_objects(objects);
+    return ret;
+}
+
+undo_t model_t::operator()(undo_edit_object_t const& undo)
+{
+    auto ret = undo_edit_object_t{ undo.level, undo.handle, undo.level->objects.at(undo.handle), class_layouts };
+    object_t& object = undo.level->objects.at(undo.handle);
+    object = undo.object;
+    relayout(object, undo.layouts);
+    undo.level->object_moved(undo.handle, ret.object.position);
+    return ret;
+}
+
+undo_t model_t::operator()(undo_move_objects_t const& undo)
+{
+    auto ret = undo_move_objects_t{ undo.level, undo.handles };
+    for(auto handle : undo.handles)
+        ret.positions.push_back(undo.level->objects.at(handle).position);
+    for(unsigned i = 0; i < undo.handles.size(); ++i)
+        undo.level->move_object(undo.handles.at(i), undo.positions.at(i));
+    return ret;
+}
+
+undo_t model_t::operator()(undo_level_objects_t const& undo)
+{
+    auto ret = undo_level_objects_t{ undo.level, { undo.level->objects.begin(), undo.level->objects.end() }, class_layouts };
+    undo.level->object_selector.clear();
+    undo.level->objects.clear();
+    for(object_t object : undo.objects)
+    {
+        relayout(object, undo.layouts);
+        undo.level->objects.push_back(std::move(object));
+    }
+    undo.level->reindex_objects();
+    return ret;
+}
+
+// Levels can share chunks, as clones do, so they get their own before being written in parallel.
+template<typename Levels>
+static void detach_levels(Levels const& levels)
+{
+    for(auto const& level : levels)
+        level->metatile_layer.tiles.detach_all();
+}
+
+undo_t model_t::operator()(undo_permute_mt_t const& undo)
+{
+    undo.metatiles->permute(undo.lut);
+    detach_levels(undo.levels);
+    parallel_for(undo.levels.size(), [&](std::size_t i)
+    {
+        undo.levels[i]->metatile_layer.remap(undo.lut);
+    });
+    return undo_permute_mt_t{ undo.metatiles, undo.levels, invert_lut(undo.lut) };
+}
+
+undo_t model_t::operator()(undo_permute_chr_t const& undo)
+{
+    if(chr_file_t* file = chr_file(undo.chr_name))
+        file->permute(undo.lut);
+    for(auto const& mt : undo.metatiles)
+        mt->chr_layer.remap(undo.lut);
+    return undo_permute_chr_t{ undo.chr_name, undo.metatiles, invert_lut(undo.lut) };
+}
+
+static tile_runs_t whole_layer(tile_layer_t const& layer)
+{
+    rect_t const rect = to_rect(layer.canvas_dimen());
+    std::vector<std::uint16_t> tiles(rect.d.w * rect.d.h);
+    layer.read_rect(rect, tiles.data());
+    return tile_runs_t(tiles);
+}
 
-#ifdef GC_RENDER
-        metatile_bitmaps.push_back(get_renderer()->CreateBitmap(std::move(bitmap)));
-#else
-        metatile_bitmaps.push_back(std::move(bitmap));
-#endif
-        ++i;
+undo_t model_t::operator()(undo_chr_layers_t const& undo)
+{
+    undo_chr_layers_t ret = { undo.metatiles };
+    for(unsigned i = 0; i < undo.metatiles.size(); ++i)
+    {
+        chr_layer_t& layer = undo.metatiles[i]->chr_layer;
+        ret.tiles.push_back(whole_layer(layer));
+
+        rect_t const rect = to_rect(layer.canvas_dimen());
+        std::vector<std::uint16_t> tiles(rect.d.w * rect.d.h);
+        undo.tiles[i].decode(tiles.data());
+        layer.write_rect(rect, tiles.data());
     }
+    return ret;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// model_t /////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
+undo_t model_t::operator()(undo_group_t const& undo)
+{
+    // Applying in reverse leaves the inverses in the order redo needs.
+    undo_group_t ret;
+    ret.undos.reserve(undo.undos.size());
+    for(auto it = undo.undos.rbegin(); it != undo.undos.rend(); ++it)
+        ret.undos.push_back(std::visit(*this, *it));
+    return ret;
+}
 
-undo_t model_t::operator()(undo_tiles_t const& undo)
-{ 
-    auto ret = undo.layer->save(undo.rect);
-    unsigned i = 0;
-    for(coord_t c : rect_range(undo.rect))
-        undo.layer->set(c, undo.tiles[i++]);
+palette_array_t model_t::palette_array(unsigned palette_index)
+{
+    std::array<std::uint8_t, 16> ret;
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        ret[i*4] = palette.color_layer.tiles.at({ 24, palette_index });
+        for(unsigned j = 0; j < 3; ++j)
+            ret[i*4+j+1] = palette.color_layer.tiles.at({ i*3 + j, palette_index });
+    }
     return ret;
 }
 
-undo_t model_t::operator()(undo_palette_num_t const& undo)
+void model_t::set_collision_bitmaps(std::pair<std::vector<bitmap_t>, std::vector<wxBitmap>> bitmaps)
 {
-    auto ret = undo_palette_num_t{ palette.num };
-    palette.num = undo.num;
+    collision_bitmaps = std::move(bitmaps.first);
+    collision_wx_bitmaps = std::move(bitmaps.second);
+    for(auto& mt : metatiles)
+        ++mt->bitmaps_serial;
+    for(auto& level : levels)
+        ++level->bitmaps_serial;
+}
+
+std::map<std::string, model_t::usage_t> model_t::chr_usage() const
+{
+    std::map<std::string, usage_t> ret;
+    for(auto const& mt : metatiles)
+    {
+        auto const& usage = mt->chr_layer.usage();
+        auto& sum = ret.try_emplace(mt->chr_name).first->second;
+        for(unsigned i = 0; i < 256; ++i)
+            sum[i] += usage[i];
+    }
     return ret;
 }
 
-undo_t model_t::operator()(undo_level_dimen_t const& undo)
+std::map<std::string, model_t::usage_t> model_t::metatile_usage() const
 {
-    auto ret = undo_level_dimen_t{ undo.layer, undo.layer->tiles };
-    undo.layer->tiles = undo.tiles;
+    std::map<std::string, usage_t> ret;
+    for(auto const& level : levels)
+    {
+        auto const& usage = level->metatile_layer.usage();
+        auto& sum = ret.try_emplace(level->metatiles_name).first->second;
+        for(unsigned i = 0; i < 256; ++i)
+            sum[i] += usage[i];
+    }
     return ret;
 }
 
-undo_t model_t::operator()(undo_new_object_t const& undo)
+model_t::usage_t model_t::collision_usage() const
 {
-    auto ret = undo_delete_object_t{ undo.level };
-    for(unsigned index : undo.indices | std::views::reverse)
-        ret.objects.emplace_back(index, undo.level->objects.at(index));
-    for(unsigned index : undo.indices)
-        undo.level->objects.erase(undo.level->objects.begin() + index);
+    usage_t ret = {};
+    for(auto const& mt : metatiles)
+    {
+        auto const& usage = mt->collision_layer.usage();
+        for(unsigned i = 0; i < 256; ++i)
+            ret[i] += usage[i];
+    }
     return ret;
 }
 
-undo_t model_t::operator()(undo_delete_object_t const& undo)
+undo_t model_t::permute_chr(chr_file_t& file, tile_lut_t const& lut)
 {
-    auto ret = undo_new_object_t{ undo.level };
-    for(auto const& pair : undo.objects | std::views::reverse)
-        ret.indices.push_back(pair.first);
-    for(auto const& pair : undo.objects)
-        undo.level->objects.insert(undo.level->objects.begin() + pair.first, pair.second);
+    undo_permute_chr_t permute = { file.name, {}, lut };
+    for(auto const& mt : metatiles)
+        if(chr_file(mt->chr_name) == &file)
+            permute.metatiles.push_back(mt);
+    modify();
+    return (*this)(permute);
+}
+
+undo_t model_t::permute_metatiles(metatile_model_t& metatiles, tile_lut_t const& lut)
+{
+    undo_permute_mt_t permute = { &metatiles, {}, lut };
+    for(auto const& level : levels)
+        if(metatile_set(level->metatiles_name).get() == &metatiles)
+            permute.levels.push_back(level);
+    modify();
+    return (*this)(permute);
+}
+
+undo_t model_t::merge_duplicate_chr(chr_file_t const& file)
+{
+    // Within a group, tiles with the same flip are identical. Each goes to the first of them.
+    tile_lut_t lut = identity_lut();
+    for(auto const& group : chr_duplicates(file.chr.data(), file.chr.size()))
+    {
+        for(chr_duplicate_t const& dup : group)
+        {
+            auto const same = std::find_if(group.begin(), group.end(), [&](chr_duplicate_t const& d) { return d.flip == dup.flip; });
+            lut[dup.tile] = same->tile;
+        }
+    }
+
+    undo_chr_layers_t ret;
+    for(auto const& mt : metatiles)
+    {
+        if(chr_file(mt->chr_name) != &file)
+            continue;
+        auto const& usage = mt->chr_layer.usage();
+        bool const uses_duplicate = std::ranges::any_of(std::views::iota(0u, 256u), [&](unsigned i) { return lut[i] != i && usage[i]; });
+        if(!uses_duplicate)
+            continue;
+
+        ret.metatiles.push_back(mt);
+        ret.tiles.push_back(whole_layer(mt->chr_layer));
+        mt->chr_layer.remap(lut);
+    }
+
+    if(ret.metatiles.empty())
+        return {};
+    modify();
     return ret;
 }
 
-undo_t model_t::operator()(undo_edit_object_t const& undo)
+std::vector<metatile_model_t::duplicate_groups_t> model_t::duplicate_metatiles() const
 {
-    auto ret = undo_edit_object_t{ undo.level, undo.index, undo.level->objects.at(undo.index) };
-    undo.level->objects.at(undo.index) = undo.object;
+    std::vector<metatile_model_t::duplicate_groups_t> ret(metatiles.size());
+    parallel_for(metatiles.size(), [&](std::size_t i)
+    {
+        ret[i] = metatiles[i]->duplicates();
+    });
     return ret;
 }
 
-undo_t model_t::operator()(undo_move_objects_t const& undo)
+// Merges the duplicates of one set. Only touches the set and the levels using it,
+// so different sets can be merged at once.
+static undo_t merge_duplicates(model_t& model, metatile_model_t& metatiles)
 {
-    auto ret = undo_move_objects_t{ undo.level, undo.indices };
-    for(auto i : undo.indices)
-        ret.positions.push_back(undo.level->objects.at(i).position);
-    for(unsigned i = 0; i < undo.indices.size(); ++i)
-        undo.level->objects.at(undo.indices.at(i)).position = undo.positions.at(i);
+    auto const groups = metatiles.duplicates();
+    if(groups.empty())
+        return {};
+
+    // 'merge' points each duplicate at the first of its group.
+    // 'pack' then moves the duplicates to the end, closing the gaps they leave.
+    tile_lut_t merge = identity_lut();
+    std::array<unsigned, 256> keep;
+    keep.fill(1);
+    unsigned merged = 0;
+    for(auto const& group : groups)
+    {
+        for(unsigned i = 1; i < group.size(); ++i, ++merged)
+        {
+            merge[group[i]] = group[0];
+            keep[group[i]] = 0;
+        }
+    }
+    tile_lut_t const pack = compact_lut(keep);
+    tile_lut_t combined;
+    for(unsigned i = 0; i < 256; ++i)
+        combined[i] = pack[merge[i]];
+
+    // Levels using a duplicate lose information, so they're saved whole.
+    // The rest get renumbered by 'pack', which can be undone by its inverse.
+    undo_group_t ret;
+    undo_permute_mt_t permute = { &metatiles, {}, pack };
+    std::vector<level_model_t*> merging;
+    for(auto const& level : model.levels)
+    {
+        if(model.metatile_set(level->metatiles_name).get() != &metatiles)
+            continue;
+
+        auto const& usage = level->metatile_layer.usage();
+        bool const uses_duplicate = std::ranges::any_of(groups, [&](auto const& group)
+        {
+            return std::any_of(group.begin() + 1, group.end(), [&](std::uint8_t i) { return usage[i] > 0; });
+        });
+
+        if(uses_duplicate)
+        {
+            ret.undos.push_back(level->metatile_layer.save());
+            merging.push_back(level.get());
+        }
+        else
+            permute.levels.push_back(level);
+    }
+
+    detach_levels(merging);
+    parallel_for(merging.size(), [&](std::size_t i)
+    {
+        merging[i]->metatile_layer.remap(combined);
+    });
+    ret.undos.push_back(model(permute));
+    ret.undos.push_back(model(undo_metatile_num_t{ &metatiles, std::uint16_t(metatiles.num - merged) }));
     return ret;
 }
 
-undo_t model_t::operator()(undo_shift_mt_t const& undo)
+undo_t model_t::merge_duplicate_metatiles()
 {
-    undo.metatiles->shift(undo.from, undo.to, undo.num);
-    for(auto level : undo.levels)
-        level->shift(undo.from, undo.to, undo.num);
+    // Each set is merged on its own thread, so levels of different sets mustn't share chunks.
+    detach_levels(levels);
+    std::vector<undo_t> merged(metatiles.size());
+    parallel_for(metatiles.size(), [&](std::size_t i)
+    {
+        merged[i] = merge_duplicates(*this, *metatiles[i]);
+    });
 
-    undo_shift_mt_t ret = undo;
-    ret.num = -ret.num;
+    undo_group_t ret;
+    for(undo_t& undo : merged)
+        if(!std::holds_alternative<std::monostate>(undo))
+            ret.undos.push_back(std::move(undo));
+    if(ret.undos.empty())
+        return {};
+    modify();
     return ret;
 }
 
-palette_array_t model_t::palette_array(unsigned palette_index)
+std::map<std::string, mtt_stats_t> model_t::mtt_usage() const
 {
-    std::array<std::uint8_t, 16> ret;
-    for(unsigned i = 0; i < 4; ++i)
+    std::vector<mtt_stats_t> per_level(levels.size());
+    parallel_for(levels.size(), [&](std::size_t i)
     {
-        ret[i*4] = palette.color_layer.tiles.at({ 24, palette_index });
-        for(unsigned j = 0; j < 3; ++j)
-            ret[i*4+j+1] = palette.color_layer.tiles.at({ i*3 + j, palette_index });
+        per_level[i] = mtt_stats_t(levels[i]->metatile_layer.tiles);
+    });
+
+    std::map<std::string, mtt_stats_t> ret;
+    for(std::size_t i = 0; i < levels.size(); ++i)
+    {
+        auto [it, inserted] = ret.try_emplace(levels[i]->metatiles_name);
+        if(inserted)
+            it->second = std::move(per_level[i]);
+        else
+            it->second.merge(per_level[i]);
     }
     return ret;
 }
@@ -589,23 +1975,13 @@ void model_t::write_file(FILE* fp, std::filesystem::path base_path) const
         for(auto const& obj : level->objects)
         {
             write_str(obj.name.c_str());
-            write_str(obj.oclass.c_str());
+            write_str(class_name(obj.oclass).c_str());
             write16(obj.position.x);
             write16(obj.position.y);
-            for(auto const& oc : object_classes)
+            if(object_class_t const* oc = object_class(obj.oclass))
             {
-                if(oc->name == obj.oclass)
-                {
-                    for(auto const& field : oc->fields)
-                    {
-                        auto it = obj.fields.find(field.name);
-                        if(it != obj.fields.end())
-                            write_str(it->second);
-                        else
-                            write8(0);
-                    }
-                    break;
-                }
+                for(auto const& field : oc->fields)
+                    write_str(obj.field(field.slot));
             }
         }
     }
@@ -663,9 +2039,7 @@ void model_t::read_file(FILE* fp, std::filesystem::path base_path)
 
     // Collision file:
     collision_path = get_path();
-    auto collisions = load_collision_file(collision_path.string());
-    collision_bitmaps = std::move(collisions.first);
-    collision_wx_bitmaps = std::move(collisions.second);
+    set_collision_bitmaps(load_collision_file(collision_path.string()));
 
     // CHR:
     unsigned const num_chr = get8(true);
@@ -703,6 +2077,8 @@ void model_t::read_file(FILE* fp, std::filesystem::path base_path)
     }
 
     // Object classes:
+    levels.clear();
+    reset_classes();
     unsigned const num_oc = get8(true);
     object_classes.clear();
     for(unsigned i = 0; i < num_oc; ++i)
@@ -717,11 +2093,12 @@ void model_t::read_file(FILE* fp, std::filesystem::path base_path)
         oc.fields.clear();
         for(unsigned i = 0; i < num_fields; ++i)
         {
-            auto& field = oc.fields.emplace_back();
+            auto& field = oc.new_field();
             field.name = get_str();
             field.type = get_str();
         }
     }
+    index_classes();
 
     // Levels:
     unsigned const num_levels = get8(true);
@@ -743,22 +2120,18 @@ void model_t::read_file(FILE* fp, std::filesystem::path base_path)
             auto& obj = level.objects.emplace_back();
 
             obj.name = get_str();
-            obj.oclass = get_str();
+            obj.oclass = class_id(get_str());
             obj.position.x = static_cast<std::int16_t>(get16());
             obj.position.y = static_cast<std::int16_t>(get16());
 
-            for(auto const& oc : object_classes)
-            {
-                if(oc->name == obj.oclass)
-                {
-                    for(auto const& field : oc->fields)
-                        obj.fields.emplace(field.name, get_str());
-                    break;
-                }
-            }
+            if(object_class_t const* oc = object_class(obj.oclass))
+                for(auto const& field : oc->fields)
+                    obj.field(field.slot) = get_str();
         }
+        level.reindex_objects();
     }
 
+    index_names();
     modified = modified_since_save = false;
 }
 
@@ -867,23 +2240,16 @@ void model_t::write_json(FILE* fp, std::filesystem::path base_path) const
             {
                 json::object_t fields;
 
-                for(auto const& oc : object_classes)
+                if(object_class_t const* oc = object_class(obj.oclass))
                 {
-                    if(oc->name == obj.oclass)
-                    {
-                        for(auto const& field : oc->fields)
-                        {
-                            auto it = obj.fields.find(field.name);
-                            if(it != obj.fields.end())
-                                fields[field.name] = it->second;
-                        }
-                        break;
-                    }
+                    for(auto const& field : oc->fields)
+                        if(field.slot < obj.fields.size())
+                            fields[field.name] = obj.fields[field.slot];
                 }
 
                 objects.push_back(json::object({
                     {"name", obj.name},
-                    {"object_class", obj.oclass},
+                    {"object_class", class_name(obj.oclass)},
                     {"fields", std::move(fields)},
                     {"x", obj.position.x},
                     {"y", obj.position.y},
@@ -932,9 +2298,7 @@ void model_t::read_json(FILE* fp, std::filesystem::path base_path)
 
     // Collision file:
     collision_path = convert_path(data.at("collision_path").get<std::string>());
-    auto collisions = load_collision_file(collision_path.string());
-    collision_bitmaps = std::move(collisions.first);
-    collision_wx_bitmaps = std::move(collisions.second);
+    set_collision_bitmaps(load_collision_file(collision_path.string()));
 
     // CHR:
     chr_files.clear();
@@ -988,6 +2352,8 @@ void model_t::read_json(FILE* fp, std::filesystem::path base_path)
     }
 
     // Object classes:
+    levels.clear();
+    reset_classes();
     {
         object_classes.clear();
         auto const& array = data.at("object_classes").get<json::array_t>();
@@ -1003,12 +2369,13 @@ void model_t::read_json(FILE* fp, std::filesystem::path base_path)
             auto const& fields = o.at("fields").get<json::array_t>();
             for(auto const& f : fields)
             {
-                auto& field = oc.fields.emplace_back();
+                auto& field = oc.new_field();
                 field.name = f.at("name").get<std::string>();
                 field.type = f.at("type").get<std::string>();
             }
         }
     }
+    index_classes();
 
     // Levels:
     {
@@ -1039,23 +2406,19 @@ void model_t::read_json(FILE* fp, std::filesystem::path base_path)
                 auto& obj = level.objects.emplace_back();
 
                 obj.name = o.at("name").get<std::string>();
-                obj.oclass = o.at("object_class").get<std::string>();
+                obj.oclass = class_id(o.at("object_class").get<std::string>());
                 obj.position.x = o.at("x").get<int>();
                 obj.position.y = o.at("y").get<int>();
 
-                for(auto const& oc : object_classes)
-                {
-                    if(oc->name == obj.oclass)
-                    {
-                        for(auto const& field : oc->fields)
-                            obj.fields.emplace(field.name, o.at("fields").at(field.name).get<std::string>());
-                        break;
-                    }
-                }
+                if(object_class_t const* oc = object_class(obj.oclass))
+                    for(auto const& field : oc->fields)
+                        obj.field(field.slot) = o.at("fields").at(field.name).get<std::string>();
             }
+            level.reindex_objects();
         }
     }
 
+    index_names();
     modified = modified_since_save = false;
 }
 
@@ -1063,21 +2426,240 @@ void model_t::read_json(FILE* fp, std::filesystem::path base_path)
 // undo_history_t //////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-void undo_history_t::cull()
+void undo_history_t::cull(undo_type_t keep)
 {
-    if(history[UNDO].size() > UNDO_LIMIT)
-        history[UNDO].resize(UNDO_LIMIT);
+    for(undo_type_t U : { keep, undo_type_t(!keep) })
+        while(bytes() > budget && history[U].size() > 1)
+            pop_back(U);
 }
 
-void undo_history_t::push(undo_t const& undo)
+void undo_history_t::push(undo_t undo, undo_merge_key_t key)
 {
     if(std::holds_alternative<std::monostate>(undo))
         return;
-    history[REDO].clear(); 
-    history[UNDO].push_front(undo); 
-    cull();
+
+    note(undo);
+
+    if(m_transaction_depth)
+    {
+        m_transaction.undos.push_back(std::move(undo));
+        return;
+    }
+
+    while(!history[REDO].empty())
+        pop_back(REDO);
+
+    auto const now = std::chrono::steady_clock::now();
+    bool const merge = key && key == m_merge_key && now - m_merge_time < MERGE_WINDOW && !history[UNDO].empty();
+    m_merge_key = key;
+    m_merge_time = now;
+
+    if(merge)
+    {
+        if(key.snapshot)
+            return;
+
+        undo_t top = pop_front(UNDO);
+        if(!std::holds_alternative<undo_group_t>(top))
+            top = undo_group_t{ { std::move(top) } };
+        std::get<undo_group_t>(top).undos.push_back(std::move(undo));
+        push_front(UNDO, std::move(top));
+    }
+    else
+        push_front(UNDO, std::move(undo));
+
+    cull(UNDO);
+}
+
+void undo_history_t::clear()
+{
+    for(undo_type_t U : { UNDO, REDO })
+    {
+        history[U].clear();
+        m_bytes[U] = 0;
+    }
+    m_merge_key = {};
+}
+
+void undo_history_t::end_transaction()
+{
+    assert(m_transaction_depth > 0);
+    if(--m_transaction_depth)
+        return;
+
+    undo_group_t group = std::move(m_transaction);
+    m_transaction = {};
+    if(group.undos.size() == 1)
+        push(std::move(group.undos.front()));
+    else if(!group.undos.empty())
+        push(std::move(group));
+}
+
+void undo_history_t::note(undo_t const& undo)
+{
+    if(journal)
+        journal->note(undo);
+}
+
+void undo_history_t::push_front(undo_type_t U, undo_t&& undo)
+{
+    m_bytes[U] += undo_bytes(undo);
+    history[U].push_front(std::move(undo));
+}
+
+undo_t undo_history_t::pop_front(undo_type_t U)
+{
+    m_bytes[U] -= undo_bytes(history[U].front());
+    undo_t ret = std::move(history[U].front());
+    history[U].pop_front();
+    return ret;
+}
+
+void undo_history_t::pop_back(undo_type_t U)
+{
+    m_bytes[U] -= undo_bytes(history[U].back());
+    history[U].pop_back();
+}
+
+static std::size_t object_bytes(object_t const& object)
+{
+    std::size_t bytes = object.name.capacity() + object.fields.capacity() * sizeof(std::string);
+    for(std::string const& field : object.fields)
+        bytes += field.capacity();
+    return bytes;
+}
+
+std::size_t undo_bytes(undo_t const& undo)
+{
+    auto const vec_bytes = [](auto const& vec) { return vec.capacity() * sizeof(vec[0]); };
+
+    return sizeof(undo_t) + std::visit([&](auto const& u) -> std::size_t
+    {
+        using T = std::decay_t<decltype(u)>;
+        if constexpr(std::is_same_v<T, undo_tiles_t> || std::is_same_v<T, undo_level_dimen_t>)
+            return u.tiles.bytes();
+        else if constexpr(std::is_same_v<T, undo_new_object_t>)
+            return vec_bytes(u.handles);
+        else if constexpr(std::is_same_v<T, undo_delete_object_t>)
+        {
+            std::size_t bytes = vec_bytes(u.objects) + vec_bytes(u.layouts);
+            for(auto const& removed : u.objects)
+                bytes += object_bytes(removed.object);
+            return bytes;
+        }
+        else if constexpr(std::is_same_v<T, undo_edit_object_t>)
+            return object_bytes(u.object) + vec_bytes(u.layouts);
+        else if constexpr(std::is_same_v<T, undo_move_objects_t>)
+            return vec_bytes(u.handles) + vec_bytes(u.positions);
+        else if constexpr(std::is_same_v<T, undo_level_objects_t>)
+        {
+            std::size_t bytes = vec_bytes(u.objects) + vec_bytes(u.layouts);
+            for(object_t const& object : u.objects)
+                bytes += object_bytes(object);
+            return bytes;
+        }
+        else if constexpr(std::is_same_v<T, undo_permute_mt_t>)
+            return vec_bytes(u.levels);
+        else if constexpr(std::is_same_v<T, undo_permute_chr_t>)
+            return u.chr_name.capacity() + vec_bytes(u.metatiles);
+        else if constexpr(std::is_same_v<T, undo_chr_layers_t>)
+        {
+            std::size_t bytes = vec_bytes(u.metatiles) + vec_bytes(u.tiles);
+            for(tile_runs_t const& runs : u.tiles)
+                bytes += runs.bytes();
+            return bytes;
+        }
+        else if constexpr(std::is_same_v<T, undo_group_t>)
+        {
+            std::size_t bytes = (u.undos.capacity() - u.undos.size()) * sizeof(undo_t);
+            for(undo_t const& child : u.undos)
+                bytes += undo_bytes(child);
+            return bytes;
+        }
+        else
+            return 0;
+    }, undo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tile_runs_t /////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+tile_runs_t::tile_runs_t(T const* values, std::size_t size)
+: m_size(size)
+{
+    constexpr std::size_t max_packet = RUN - 1;
+
+    std::size_t literal = 0; // Index of the header of the open literal packet, or 0 when none is open.
+    for(std::size_t i = 0; i < size;)
+    {
+        std::size_t run = 1;
+        while(i + run < size && run < max_packet && values[i + run] == values[i])
+            ++run;
+
+        // Runs shorter than 3 cost as much as literals do:
+        if(run >= 3)
+        {
+            m_packets.push_back(RUN | run);
+            m_packets.push_back(values[i]);
+            literal = 0;
+            i += run;
+        }
+        else
+        {
+            if(!literal || m_packets[literal - 1] == max_packet)
+            {
+                m_packets.push_back(0);
+                literal = m_packets.size();
+            }
+            m_packets[literal - 1] += 1;
+            m_packets.push_back(values[i]);
+            i += 1;
+        }
+    }
+
+    m_packets.shrink_to_fit();
+}
+
+template<typename T>
+void tile_runs_t::decode(T* out) const
+{
+    for(std::size_t i = 0; i < m_packets.size();)
+    {
+        std::uint16_t const header = m_packets[i++];
+        std::size_t const n = header & ~RUN;
+        if(header & RUN)
+            out = std::fill_n(out, n, T(m_packets[i++]));
+        else
+        {
+            out = std::transform(&m_packets[i], &m_packets[i] + n, out, [](std::uint16_t value) { return T(value); });
+            i += n;
+        }
+    }
+}
+
+bool tile_runs_t::valid() const
+{
+    std::size_t decoded = 0;
+    for(std::size_t i = 0; i < m_packets.size();)
+    {
+        std::uint16_t const header = m_packets[i++];
+        std::size_t const n = header & ~RUN;
+        std::size_t const words = (header & RUN) ? 1 : n;
+        if(i + words > m_packets.size())
+            return false;
+        i += words;
+        decoded += n;
+    }
+    return decoded == m_size;
 }
 
+template tile_runs_t::tile_runs_t(std::uint8_t const* values, std::size_t size);
+template tile_runs_t::tile_runs_t(std::uint16_t const* values, std::size_t size);
+template void tile_runs_t::decode(std::uint8_t* out) const;
+template void tile_runs_t::decode(std::uint16_t* out) const;
+
 ////////////////////////////////////////////////////////////////////////////////
 // chr_file_t //////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -1085,6 +2667,7 @@ void undo_history_t::push(undo_t const& undo)
 void chr_file_t::load()
 {
     chr = {};
+    order = identity_lut();
     if(path.empty())
         return;
     std::vector<std::uint8_t> data = read_binary_file(path.string().c_str());
@@ -1101,3 +2684,136 @@ void chr_file_t::load()
 
     std::copy_n(data.begin(), std::min(data.size(), chr.size()), chr.begin());
 }
+
+void chr_file_t::permute(tile_lut_t const& lut)
+{
+    chr_array_t const old = chr;
+    for(unsigned i = 0; i < 256; ++i)
+        std::copy_n(old.data() + i*16, 16, chr.data() + lut[i]*16);
+    for(std::uint8_t& o : order)
+        o = lut[o];
+}
+
+bool chr_file_t::on_disk() const
+{
+    std::error_code ec;
+    return !path.empty() && std::filesystem::file_size(path, ec) > 0 && !ec;
+}
+
+void chr_file_t::save()
+{
+    if(!modified())
+        return;
+
+    if(path.empty())
+        throw std::runtime_error("CHR file " + name + " has no path to save to.");
+    std::vector<std::uint8_t> data = read_binary_file(path.string().c_str());
+    if(data.empty())
+        throw std::runtime_error("Unable to read CHR file " + path.string());
+
+    std::string ext = path.extension().string();
+    for(char& c : ext)
+        c = std::tolower(c);
+
+    if(ext == ".png")
+        data = permute_png_tiles(data.data(), data.size(), order);
+    else
+    {
+        // Tiles past the first 256 stay put. The file grows if a tile moves past its end.
+        std::vector<std::uint8_t> const old(data.begin(), data.begin() + std::min<std::size_t>(data.size(), chr.size()));
+        unsigned const num = old.size() / 16;
+        unsigned needed = num;
+        for(unsigned i = 0; i < num; ++i)
+            needed = std::max(needed, order[i] + 1u);
+        if(data.size() < needed * 16)
+            data.resize(needed * 16);
+        std::fill_n(data.begin(), needed * 16, 0);
+        for(unsigned i = 0; i < num; ++i)
+            std::copy_n(old.data() + i*16, 16, data.data() + order[i]*16);
+    }
+
+    // Write alongside and then replace, so a failed write leaves the file intact.
+    std::filesystem::path tmp = path;
+    tmp += ".tmp";
+    FILE* fp = std::fopen(tmp.string().c_str(), "wb");
+    if(!fp)
+        throw std::runtime_error("Unable to write CHR file " + tmp.string());
+    bool const written = std::fwrite(data.data(), data.size(), 1, fp) == 1;
+    if(std::fclose(fp) != 0 || !written)
+        throw std::runtime_error("Unable to write CHR file " + tmp.string());
+    std::filesystem::rename(tmp, path);
+
+    order = identity_lut();
+}
+
+// Mirrors the 8 pixels of a CHR bitplane row.
+static constexpr auto reverse_bits = []
+{
+    std::array<std::uint8_t, 256> lut = {};
+    for(unsigned i = 0; i < 256; ++i)
+        for(unsigned b = 0; b < 8; ++b)
+            if(i & (1 << b))
+                lut[i] |= 0x80 >> b;
+    return lut;
+}();
+
+std::vector<std::vector<chr_duplicate_t>> chr_duplicates(std::uint8_t const* chr, std::size_t size)
+{
+    // A tile as its two bitplanes, one row per byte:
+    using tile_key_t = std::array<std::uint64_t, 2>;
+    struct key_hash_t
+    {
+        std::size_t operator()(tile_key_t const& key) const 
+        { 
+            return std::hash<std::uint64_t>()((key[0] * 0x9E3779B97F4A7C15ull) ^ key[1]); 
+        }
+    };
+
+    struct first_t
+    {
+        unsigned tile;
+        std::uint8_t flip; // Turns the tile into its key.
+        int group = -1;
+    };
+
+    std::size_t const num = size / 16;
+    std::unordered_map<tile_key_t, first_t, key_hash_t> firsts;
+    firsts.reserve(num);
+    std::vector<std::vector<chr_duplicate_t>> groups;
+
+    for(std::size_t i = 0; i < num; ++i)
+    {
+        // Every flip of the tile, indexed by its CHR_FLIP_H and CHR_FLIP_V bits shifted down.
+        // The smallest is the key all of them share.
+        std::array<tile_key_t, 4> flips = {};
+        std::uint8_t const* tile = chr + i*16;
+        for(unsigned plane = 0; plane < 2; ++plane)
+        {
+            for(unsigned y = 0; y < 8; ++y)
+            {
+                std::uint64_t const row = tile[plane*8 + y];
+                std::uint64_t const mirrored = reverse_bits[row];
+                flips[0][plane] |= row << (y * 8);
+                flips[1][plane] |= mirrored << (y * 8);
+                flips[2][plane] |= row << ((7 - y) * 8);
+                flips[3][plane] |= mirrored << ((7 - y) * 8);
+            }
+        }
+        auto const key = std::min_element(flips.begin(), flips.end());
+        std::uint8_t const flip = (key - flips.begin()) << 6;
+
+        auto const [it, inserted] = firsts.try_emplace(*key, first_t{ unsigned(i), flip });
+        if(inserted)
+            continue;
+        first_t& first = it->second;
+        if(first.group < 0)
+        {
+            first.group = groups.size();
+            groups.push_back({{ first.tile, 0 }});
+        }
+        // Flips commute and undo themselves, so going through the key composes as an XOR.
+        groups[first.group].push_back({ unsigned(i), std::uint8_t(first.flip ^ flip) });
+    }
+
+    return groups;
+}
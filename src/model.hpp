@@ -1,18 +1,22 @@
 #ifndef MODEL_HPP
 #define MODEL_HPP
 
+#include <bit>
 #include <cassert>
 #include <cstdint>
+#include <chrono>
 #include <cstdio>
 #include <memory>
 #include <variant>
 #include <set>
 #include <filesystem>
+#include <map>
 #include <vector>
 
 #include "2d/geometry.hpp"
 #include "2d/grid.hpp"
 
+#include "chunk_grid.hpp"
 #include "convert.hpp"
 #include "tool.hpp"
 
@@ -20,34 +24,119 @@ using namespace i2d;
 
 class tile_layer_t;
 class metatile_layer_t;
+class journal_t;
 class level_model_t;
 struct object_t;
+struct object_class_t;
+struct model_t;
+
+// Object classes are referred to by interned IDs, which stay stable across renames.
+// ID 0 is the empty name.
+using class_id_t = std::uint32_t;
 
 using palette_array_t = std::array<std::uint8_t, 16>;
 using chr_array_t = std::array<std::uint8_t, 16*256>;
 
 constexpr std::uint8_t ACTIVE_COLLISION = 4;
-static constexpr std::size_t UNDO_LIMIT = 256;
+static constexpr std::size_t DEFAULT_UNDO_BUDGET = 16 << 20; // In bytes, per editor.
 
 struct object_t
 {
     coord_t position;
     std::string name;
-    std::string oclass;
-    std::unordered_map<std::string, std::string> fields;
+    class_id_t oclass = 0;
+    // Field values, indexed by 'class_field_t::slot' of the object's class.
+    // Missing values are empty.
+    std::vector<std::string> fields;
+
+    std::string const& field(unsigned slot) const;
+    std::string& field(unsigned slot);
+
+    // Re-lays out 'fields' for a different class, matching fields by name.
+    void migrate_fields(object_class_t const* from, object_class_t const* to);
 
-    void append_vec(std::vector<std::uint16_t>& vec) const;
-    void from_vec(std::uint16_t const*& ptr, std::uint16_t const* end);
+    // The clipboard format is name-based, so these need the model to translate class IDs:
+    void append_vec(model_t const& model, std::vector<std::uint16_t>& vec) const;
+    void from_vec(model_t& model, std::uint16_t const*& ptr, std::uint16_t const* end);
     auto operator<=>(object_t const&) const = default;
 };
 
+// Refers to a level object regardless of where it sits in 'level_model_t::objects'.
+// Handles of deleted objects go stale instead of pointing at other objects.
+struct object_handle_t
+{
+    std::uint32_t slot = ~0u;
+    std::uint32_t generation = 0;
+
+    auto operator<=>(object_handle_t const&) const = default;
+};
+
+// A copy of model_t::class_layouts, kept by undo records holding objects.
+// Classes can change layout while the record waits, so its objects are moved to the current layouts when restored.
+using class_layouts_t = std::vector<std::shared_ptr<object_class_t>>;
+
+struct removed_object_t
+{
+    unsigned index;
+    object_handle_t handle;
+    object_t object;
+};
+
 enum undo_type_t { UNDO, REDO };
 
+// Tile values compressed for undo records, as PackBits-style packets over 16-bit words.
+// A packet's header word either holds RUN | n, followed by one value repeated n times,
+// or n, followed by n literal values.
+class tile_runs_t
+{
+public:
+    static constexpr std::uint16_t RUN = 0x8000;
+
+    tile_runs_t() = default;
+    template<typename T>
+    tile_runs_t(T const* values, std::size_t size);
+    template<typename T>
+    explicit tile_runs_t(chunk_grid_t<T> const& grid) 
+    : tile_runs_t(std::vector<T>(grid.begin(), grid.end())) {}
+    template<typename T>
+    explicit tile_runs_t(std::vector<T> const& values) 
+    : tile_runs_t(values.data(), values.size()) {}
+
+    // For deserializing; check valid() before decoding.
+    tile_runs_t(std::size_t size, std::vector<std::uint16_t> packets) 
+    : m_size(size), m_packets(std::move(packets)) {}
+
+    // The number of values encoded:
+    std::size_t size() const { return m_size; }
+    std::size_t bytes() const { return m_packets.capacity() * sizeof(std::uint16_t); }
+    std::vector<std::uint16_t> const& packets() const { return m_packets; }
+
+    // True if the packets decode to exactly size() values.
+    bool valid() const;
+
+    // 'out' must hold size() values.
+    template<typename T>
+    void decode(T* out) const;
+    template<typename T>
+    void decode(chunk_grid_t<T>& grid) const
+    {
+        assert(grid.size() == size());
+        std::vector<T> values(size());
+        decode(values.data());
+        T const* in = values.data();
+        grid.for_each_span(to_rect(grid.dimen()), [&](coord_t, T* out, int n) { std::copy_n(in, n, out); in += n; });
+    }
+
+private:
+    std::size_t m_size = 0;
+    std::vector<std::uint16_t> m_packets;
+};
+
 struct undo_tiles_t
 {
     tile_layer_t* layer;
     rect_t rect;
-    std::vector<std::uint16_t> tiles;
+    tile_runs_t tiles; // Row-major over 'rect'.
 };
 
 struct undo_palette_num_t
@@ -55,71 +144,138 @@ struct undo_palette_num_t
     int num;
 };
 
+struct undo_metatile_num_t
+{
+    class metatile_model_t* metatiles;
+    std::uint16_t num;
+};
+
 struct undo_level_dimen_t
 {
     metatile_layer_t* layer;
-    grid_t<std::uint8_t> tiles;
+    dimen_t dimen;
+    tile_runs_t tiles;
 };
 
 struct undo_new_object_t
 {
     level_model_t* level;
-    std::deque<unsigned> indices;
+    std::vector<object_handle_t> handles;
 };
 
 struct undo_delete_object_t
 {
     level_model_t* level;
-    std::deque<std::pair<unsigned, object_t>> objects;
+    std::vector<removed_object_t> objects; // Sorted by index.
+    class_layouts_t layouts; // What the objects' fields are laid out for.
 };
 
 struct undo_edit_object_t
 {
     level_model_t* level;
-    unsigned index;
+    object_handle_t handle;
     object_t object;
+    class_layouts_t layouts;
 };
 
 struct undo_move_objects_t
 {
     level_model_t* level;
-    std::vector<unsigned> indices;
+    std::vector<object_handle_t> handles;
     std::vector<coord_t> positions;
 };
 
-struct undo_shift_mt_t
+// Replaces every object of a level.
+struct undo_level_objects_t
+{
+    level_model_t* level;
+    std::vector<object_t> objects;
+    class_layouts_t layouts;
+};
+
+// A reordering of CHR tiles or metatiles, mapping each old index to its new one.
+using tile_lut_t = std::array<std::uint8_t, 256>;
+
+tile_lut_t identity_lut();
+tile_lut_t invert_lut(tile_lut_t const& lut);
+// Rotates [from, to), wrapping past 255, by 'amount' places.
+tile_lut_t shift_lut(std::uint8_t from, std::uint8_t to, int amount);
+tile_lut_t swap_lut(std::uint8_t a, std::uint8_t b);
+// Orders the first 'num' metatiles by descending usage, keeping ties in order.
+tile_lut_t sort_lut(std::array<unsigned, 256> const& usage, unsigned num);
+// Moves everything with nonzero usage to the front, keeping the order otherwise.
+tile_lut_t compact_lut(std::array<unsigned, 256> const& usage);
+
+// Renumbers the metatiles of a set, along with the levels using it.
+// 'lut' must be a permutation.
+struct undo_permute_mt_t
 {
-    std::vector<std::shared_ptr<level_model_t>> levels;
     class metatile_model_t* metatiles;
-    std::uint8_t from;
-    std::uint8_t to;
-    int num;
+    std::vector<std::shared_ptr<level_model_t>> levels;
+    tile_lut_t lut;
 };
 
+// Renumbers the tiles of a CHR file, along with the metatile sets using it.
+// The file is found by name, so the record outlives the file being deleted.
+struct undo_permute_chr_t
+{
+    std::string chr_name;
+    std::vector<std::shared_ptr<class metatile_model_t>> metatiles;
+    tile_lut_t lut;
+};
+
+// Replaces the whole chr_layer of metatile sets, holding onto them so the record
+// stays valid in histories that outlive their tabs.
+struct undo_chr_layers_t
+{
+    std::vector<std::shared_ptr<class metatile_model_t>> metatiles;
+    std::vector<tile_runs_t> tiles; // Per set, row-major over the layer.
+};
+
+struct undo_group_t;
+
 using undo_t = std::variant
     < std::monostate
     , undo_tiles_t
     , undo_palette_num_t
+    , undo_metatile_num_t
     , undo_level_dimen_t
     , undo_new_object_t
     , undo_delete_object_t
     , undo_edit_object_t
     , undo_move_objects_t
-    , undo_shift_mt_t
+    , undo_level_objects_t
+    , undo_permute_mt_t
+    , undo_permute_chr_t
+    , undo_chr_layers_t
+    , undo_group_t
     >;
 
-// Used to select and deselect specific tiles:
+// Several records undone as one step, last to first.
+struct undo_group_t
+{
+    std::vector<undo_t> undos;
+};
+
+// Used to select and deselect specific tiles.
+// Each row is packed into 64-bit words, which aren't allocated until something gets selected.
 class select_map_t
 {
 public:
+    using word_t = std::uint64_t;
+    static constexpr int WORD_BITS = 64;
+
     select_map_t() = default;
     select_map_t(dimen_t dimen) { resize(dimen); }
-    dimen_t dimen() const { return m_selection.dimen(); }
+    dimen_t dimen() const { return m_dimen; }
 
     bool has_selection() const { return (bool)m_select_rect; }
     rect_t select_rect() const { return m_select_rect; }
-    auto const& selection() const { return m_selection; }
-    auto const& operator[](coord_t c) const { return m_selection.at(c); }
+    bool operator[](coord_t c) const 
+    { 
+        assert(in_bounds(c, dimen()));
+        return !m_words.empty() && ((word(c) >> (c.x % WORD_BITS)) & 1);
+    }
 
     void select_all(bool select = true);
     void select_invert();
@@ -128,21 +284,62 @@ public:
     void select(coord_t c, bool select = true);
     void select(rect_t r, bool select = true);
 
+    // 'other' must have the same dimensions:
+    void select_union(select_map_t const& other);
+    void select_intersection(select_map_t const& other);
+
+    // Defers select_rect() maintenance until the outermost commit_batch(),
+    // for callers that toggle many cells one at a time:
+    void begin_batch();
+    void commit_batch();
+
     virtual void resize(dimen_t d) ;
 
+    // Changes whenever the selection does, and is never shared by two different selections:
+    std::uint64_t revision() const { return m_revision; }
+
     template<typename Fn>
-    void for_each_selected(Fn const& fn)
+    void for_each_selected(Fn const& fn) const
     {
-        for(coord_t c : rect_range(select_rect()))
-            if(m_selection[c])
-                fn(c);
+        if(m_words.empty() || !m_select_rect)
+            return;
+
+        int const w0 = m_select_rect.c.x / WORD_BITS;
+        int const w1 = (m_select_rect.e().x + WORD_BITS - 1) / WORD_BITS;
+        for(int y = m_select_rect.c.y; y < m_select_rect.e().y; ++y)
+        {
+            word_t const* row = &m_words[y * m_row_words];
+            for(int w = w0; w < w1; ++w)
+                for(word_t bits = row[w]; bits; bits &= bits - 1)
+                    fn(coord_t{ w * WORD_BITS + std::countr_zero(bits), y });
+        }
     }
 
 private:
-    void recalc_select_rect(rect_t range);
-
+    word_t& word(coord_t c) { return m_words[c.y * m_row_words + c.x / WORD_BITS]; }
+    word_t const& word(coord_t c) const { return m_words[c.y * m_row_words + c.x / WORD_BITS]; }
+    // The bits of word 'w' covering columns [x0, x1):
+    static word_t span_mask(int w, int x0, int x1);
+    void allocate();
+    void touch() { m_revision = ++next_revision; }
+    // Stores 'bits' into word 'w' of row 'y', keeping the row counts in step.
+    // Column counts are too when a single bit changes; otherwise they go stale until count_cols().
+    void set_word(int y, int w, word_t bits);
+    void count_cols();
+    void recalc_select_rect();
+    void shrink_select_rect();
+
+    dimen_t m_dimen = {};
+    int m_row_words = 0;
     rect_t m_select_rect = {};
-    grid_t<std::uint8_t> m_selection;
+    std::vector<word_t> m_words; // Row-major; empty means nothing is selected.
+    // Selected cells per row and per column, which locate the bounds without a scan:
+    std::vector<unsigned> m_row_counts;
+    std::vector<unsigned> m_col_counts;
+    bool m_cols_stale = false; // Word-wide changes recount columns once, when the bounds are next needed.
+    int m_batch_depth = 0;
+    std::uint64_t m_revision = 0;
+    static inline std::uint64_t next_revision = 0;
 };
 
 enum
@@ -159,7 +356,7 @@ struct tile_copy_t
     unsigned format;
     std::variant<grid_t<std::uint16_t>, std::vector<object_t>> data;
 
-    std::vector<std::uint16_t> to_vec() const
+    std::vector<std::uint16_t> to_vec(model_t const& model) const
     {
         if(auto* grid = std::get_if<grid_t<std::uint16_t>>(&data))
         {
@@ -173,14 +370,14 @@ struct tile_copy_t
             assert(format == LAYER_OBJECTS);
             std::vector<std::uint16_t> vec = { format, objects->size() };
             for(auto const& object : *objects)
-                object.append_vec(vec);
+                object.append_vec(model, vec);
             return vec;
         }
 
         throw std::runtime_error("Unable to convert clip data to vec.");
     }
 
-    static tile_copy_t from_vec(std::vector<std::uint16_t> const& vec)
+    static tile_copy_t from_vec(model_t& model, std::vector<std::uint16_t> const& vec)
     {
         tile_copy_t ret = { vec.at(0) };
         if(ret.format == LAYER_OBJECTS)
@@ -189,7 +386,7 @@ struct tile_copy_t
             std::vector<object_t> objects;
             std::uint16_t const* ptr = vec.data() + 2;
             for(unsigned i = 0; i < size; ++i)
-                objects.emplace_back().from_vec(ptr, &*vec.end());
+                objects.emplace_back().from_vec(model, ptr, &*vec.end());
             ret.data = std::move(objects);
         }
         else
@@ -224,8 +421,9 @@ public:
     virtual dimen_t canvas_dimen() const { return tiles.dimen(); }
     virtual void canvas_resize(dimen_t d) { canvas_selector.resize(d); tiles.resize(d); }
     virtual std::uint16_t get(coord_t c) const { return tiles.at(c); }
-    virtual void set(coord_t c, std::uint16_t value) { tiles.at(c) = value; }
+    virtual void set(coord_t c, std::uint16_t value) { write_tile(c, value); }
     virtual void reset(coord_t c) { set(c, 0); }
+    virtual void reset_rect(rect_t rect) { fill_rect(rect, 0); } // Like reset() on every cell of 'rect'.
     virtual std::uint16_t to_tile(coord_t pick) const { return pick.x + pick.y * picker_selector.dimen().w; }
     virtual coord_t to_pick(std::uint8_t tile) const { return { tile % picker_selector.dimen().w, tile / picker_selector.dimen().w }; }
 
@@ -240,6 +438,12 @@ public:
     virtual undo_t save(coord_t at) { return save({ at, picker_selector.dimen() }); }
     virtual undo_t save(rect_t rect);
 
+    // Bulk access in the value format of get() and set(), without a virtual call per cell.
+    // Buffers are row-major and hold rect.d.w * rect.d.h values; 'rect' must lie within canvas_dimen().
+    void read_rect(rect_t rect, std::uint16_t* out) const { if(rect) do_read_rect(rect, out); }
+    void write_rect(rect_t rect, std::uint16_t const* in) { if(rect) do_write_rect(rect, in); }
+    void fill_rect(rect_t rect, std::uint16_t value) { if(rect) do_fill_rect(rect, value); }
+
     template<typename Fn>
     void for_each_picked(coord_t pen_c, Fn const& fn)
     {
@@ -253,9 +457,30 @@ public:
         });
     }
 
+    // How many cells of 'tiles' hold each value.
+    // Kept current through set() and the rect functions; other writes to 'tiles' bump its revision,
+    // which makes the next call recount.
+    std::array<unsigned, 256> const& usage() const;
+
+    // Replaces every cell of 'tiles' with its entry in 'lut', keeping usage() current.
+    void remap(std::array<std::uint8_t, 256> const& lut);
+
     select_map_t picker_selector;
     select_map_t canvas_selector;
-    grid_t<std::uint8_t> tiles;
+    chunk_grid_t<std::uint8_t> tiles;
+
+protected:
+    // Writes one cell of 'tiles', keeping usage() current.
+    void write_tile(coord_t c, std::uint8_t value);
+    bool usage_current() const { return m_usage_revision == tiles.revision(); }
+
+    mutable std::array<unsigned, 256> m_usage = {};
+    mutable std::uint64_t m_usage_revision = ~std::uint64_t(0); // The revision of 'tiles' 'm_usage' counts.
+
+    // Layers that override get() or set() must override these to match.
+    virtual void do_read_rect(rect_t rect, std::uint16_t* out) const;
+    virtual void do_write_rect(rect_t rect, std::uint16_t const* in);
+    virtual void do_fill_rect(rect_t rect, std::uint16_t value);
 };
 
 class tile_model_t
@@ -264,6 +489,10 @@ public:
     virtual tile_layer_t& layer() = 0;
     tile_layer_t const& clayer() const { return const_cast<tile_model_t*>(this)->layer(); }
 
+    // Bumped when the bitmaps tiles are drawn with are rebuilt, as after palette or CHR changes,
+    // so views can cache what they draw with them.
+    unsigned bitmaps_serial = 0;
+
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -275,10 +504,36 @@ struct chr_file_t
     std::string name;
     std::filesystem::path path;
     chr_array_t chr = {};
+    // Where each of the first 256 tiles of the file on disk sits in 'chr'.
+    // Anything but the identity is a change save() has yet to write.
+    tile_lut_t order = identity_lut();
 
+    bool modified() const { return order != identity_lut(); }
+    // Whether there's a file on disk for save() to rewrite.
+    bool on_disk() const;
+
+    // Discards changes.
     void load();
+    void permute(tile_lut_t const& lut);
+    // Reorders the tiles of the file on disk to match 'chr', keeping its format. Throws on failure.
+    void save();
+};
+
+// Sprite attribute bits that flip a tile.
+constexpr std::uint8_t CHR_FLIP_H = 0x40;
+constexpr std::uint8_t CHR_FLIP_V = 0x80;
+
+struct chr_duplicate_t
+{
+    unsigned tile;
+    std::uint8_t flip; // CHR_FLIP_H and CHR_FLIP_V bits that draw the group's first tile as this one.
 };
 
+// Groups the 16-byte tiles of 'chr' that match under horizontal and vertical flips.
+// Each group is in ascending order, starts with a flip of 0, and holds two or more tiles.
+// Works for any number of tiles, such as a whole multi-bank file.
+std::vector<std::vector<chr_duplicate_t>> chr_duplicates(std::uint8_t const* chr, std::size_t size);
+
 ////////////////////////////////////////////////////////////////////////////////
 // color palette ///////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -315,6 +570,7 @@ public:
     virtual dimen_t tile_size() const override { return { 16, 16 }; }
     virtual dimen_t canvas_dimen() const override { return { tiles.dimen().w, num }; }
     virtual void reset(coord_t c) override { set(c, 0x0F); }
+    virtual void reset_rect(rect_t rect) override { fill_rect(rect, 0x0F); }
     virtual std::uint16_t to_tile(coord_t pick) const override { return pick.y + pick.x * picker_selector.dimen().h; }
     virtual coord_t to_pick(std::uint8_t tile) const override { return { tile / picker_selector.dimen().h, tile % picker_selector.dimen().h }; }
 
@@ -345,14 +601,20 @@ public:
 
     virtual unsigned format() const override { return LAYER_CHR; }
     virtual std::uint16_t get(coord_t c) const override { return tiles.at(c) | attributes.at(vec_div(c, 2)) << 8; }
-    virtual void set(coord_t c, std::uint16_t value) override { tiles.at(c) = value; attributes.at(vec_div(c, 2)) = value >> 8; }
-    virtual void reset(coord_t c) { tiles.at(c) = 0; }
+    virtual void set(coord_t c, std::uint16_t value) override { write_tile(c, value); attributes.at(vec_div(c, 2)) = value >> 8; }
+    virtual void reset(coord_t c) { write_tile(c, 0); }
+    virtual void reset_rect(rect_t rect) override { if(rect) tile_layer_t::do_fill_rect(rect, 0); } // Keeps the attributes.
     virtual std::uint16_t to_tile(coord_t pick) const { return tile_layer_t::to_tile(pick) | (active << 8); }
 
     undo_t fill_attribute();
 
     std::uint8_t const& active;
     grid_t<std::uint8_t> attributes;
+
+protected:
+    virtual void do_read_rect(rect_t rect, std::uint16_t* out) const override;
+    virtual void do_write_rect(rect_t rect, std::uint16_t const* in) override;
+    virtual void do_fill_rect(rect_t rect, std::uint16_t value) override;
 };
 
 class collision_layer_t : public tile_layer_t
@@ -373,7 +635,13 @@ public:
     void clear_chr();
     void refresh_chr(chr_array_t const& chr, palette_array_t const& palette);
 
-    void shift(std::uint8_t from, std::uint8_t to, int amount);
+    // Moves each metatile's CHR, attribute and collision to its index in 'lut', a permutation.
+    void permute(tile_lut_t const& lut);
+
+    // Groups of identical metatiles among the first 'num': same four CHR tiles, attribute and collision.
+    // Each group is in ascending order and holds two or more indices.
+    using duplicate_groups_t = std::vector<std::vector<std::uint8_t>>;
+    duplicate_groups_t duplicates() const;
 
     std::string name = "metatiles";
     std::string chr_name;
@@ -386,6 +654,47 @@ public:
     collision_layer_t collision_layer;
 };
 
+// The 16x16 pixels of each metatile in a set, drawn from its CHR and packed as bitplanes,
+// so differences are counted with popcount: four rows of 16 pixels to a 64-bit word.
+class metatile_pixels_t
+{
+public:
+    enum metric_t
+    {
+        METRIC_PIXELS, // Pixels with a different 2-bit value.
+        METRIC_COLORS, // Pixels showing a different color, given the palette and each metatile's attribute.
+    };
+
+    metatile_pixels_t(metatile_model_t const& metatiles, chr_array_t const& chr, palette_array_t const& palette, metric_t metric);
+
+    // The metatiles compared: the first 'num' of the set.
+    unsigned size() const { return m_num; }
+
+    // The number of differing pixels, out of 256.
+    unsigned distance(unsigned a, unsigned b) const;
+
+    struct match_t
+    {
+        std::uint8_t a;
+        std::uint8_t b;
+        unsigned distance;
+    };
+
+    // Every other metatile as 'b', closest first, ties in index order.
+    std::vector<match_t> rank(std::uint8_t metatile) const;
+    // Every pair within 'max_distance', closest first.
+    std::vector<match_t> pairs(unsigned max_distance) const;
+
+private:
+    static constexpr unsigned PLANE_WORDS = 4;
+
+    unsigned m_num = 0;
+    unsigned m_planes = 0;
+    std::vector<std::uint64_t> m_words; // Per metatile, 'm_planes' planes of PLANE_WORDS words.
+
+    std::uint64_t const* words(unsigned metatile) const { return &m_words[metatile * m_planes * PLANE_WORDS]; }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // levels //////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -394,6 +703,7 @@ struct class_field_t
 {
     std::string type = "U";
     std::string name;
+    unsigned slot = 0; // Index into 'object_t::fields'.
 };
 
 
@@ -402,6 +712,16 @@ struct object_class_t
     std::string name;
     rgb_t color = { 255, 255, 255 };
     std::deque<class_field_t> fields;
+    // Deleted fields leave their slot unused, so that objects held 
+    // by the undo history keep a valid layout.
+    unsigned num_slots = 0;
+
+    class_field_t& new_field()
+    {
+        auto& field = fields.emplace_back();
+        field.slot = num_slots++;
+        return field;
+    }
 };
 
 class metatile_layer_t : public tile_layer_t
@@ -412,7 +732,83 @@ public:
     virtual unsigned format() const override { return LAYER_METATILE; }
     virtual dimen_t tile_size() const { return { 16, 16 }; }
 
-    undo_t save() { return undo_level_dimen_t{ this, tiles }; }
+    undo_t save() { return undo_level_dimen_t{ this, tiles.dimen(), tile_runs_t(tiles) }; }
+};
+
+// Counts the 2x2 blocks of metatiles ("mtts") in levels, aligned to even coordinates.
+// Blocks hanging off the right or bottom edge read their missing cells as 0.
+// Counts live in an open-addressing hash table keyed by the block packed into 32 bits.
+class mtt_stats_t
+{
+public:
+    using key_t = std::uint32_t;
+
+    static constexpr key_t pack(std::uint8_t nw, std::uint8_t ne, std::uint8_t sw, std::uint8_t se)
+    {
+        return key_t(nw) | (key_t(ne) << 8) | (key_t(sw) << 16) | (key_t(se) << 24);
+    }
+
+    // Calls 'fn(coord_t nw, key_t key)' for each block of 'tiles', in row-major order.
+    template<typename Fn>
+    static void for_each_block(chunk_grid_t<std::uint8_t> const& tiles, Fn const& fn)
+    {
+        dimen_t const dimen = tiles.dimen();
+        // Two rows, padded to an even width, so edge blocks need no bounds checks.
+        std::vector<std::uint8_t> rows((dimen.w + 1) & ~1, 0);
+        rows.resize(rows.size() * 2, 0);
+        std::uint8_t* const upper = rows.data();
+        std::uint8_t* const lower = rows.data() + rows.size() / 2;
+
+        for(int y = 0; y < dimen.h; y += 2)
+        {
+            tiles.for_each_span({{ 0, y }, { dimen.w, 1 }}, [&](coord_t at, std::uint8_t const* span, int n)
+            {
+                std::copy_n(span, n, upper + at.x);
+            });
+            if(y + 1 < dimen.h)
+            {
+                tiles.for_each_span({{ 0, y + 1 }, { dimen.w, 1 }}, [&](coord_t at, std::uint8_t const* span, int n)
+                {
+                    std::copy_n(span, n, lower + at.x);
+                });
+            }
+            else
+                std::fill_n(lower, dimen.w, 0);
+
+            for(int x = 0; x < dimen.w; x += 2)
+                fn(coord_t{ x, y }, pack(upper[x], upper[x+1], lower[x], lower[x+1]));
+        }
+    }
+
+    mtt_stats_t() = default;
+    explicit mtt_stats_t(chunk_grid_t<std::uint8_t> const& tiles);
+
+    void add(key_t key, unsigned count = 1);
+    void merge(mtt_stats_t const& other);
+
+    unsigned count(key_t key) const;
+    std::size_t unique() const { return m_unique; } // Distinct blocks.
+    std::size_t total() const { return m_total; } // Blocks counted.
+
+    // Calls 'fn(key_t key, unsigned count)' for each distinct block, in no particular order.
+    template<typename Fn>
+    void for_each(Fn const& fn) const
+    {
+        for(std::size_t i = 0; i < m_counts.size(); ++i)
+            if(m_counts[i])
+                fn(m_keys[i], m_counts[i]);
+    }
+
+private:
+    // Slots with a count of 0 are empty; any key, 0 included, can be stored.
+    std::vector<key_t> m_keys;
+    std::vector<unsigned> m_counts;
+    int m_shift = 32; // 32 - log2(capacity).
+    std::size_t m_unique = 0;
+    std::size_t m_total = 0;
+
+    std::size_t slot(key_t key) const { return std::uint32_t(key * 0x9E3779B1u) >> m_shift; }
+    void grow();
 };
 
 enum level_layer_t
@@ -421,6 +817,99 @@ enum level_layer_t
     OBJECT_LAYER,
 };
 
+// Buckets object handles by the cell their (cropped) position falls in,
+// so hit-testing only has to look at objects near the cursor.
+class object_index_t
+{
+public:
+    static constexpr int CELL_SIZE = 64; // In pixels.
+
+    dimen_t level_dimen() const { return m_level_dimen; }
+    std::size_t size() const { return m_size; }
+
+    void reset(dimen_t level_dimen);
+    void insert(object_handle_t handle, coord_t position);
+    void erase(object_handle_t handle, coord_t position);
+    void move(object_handle_t handle, coord_t from, coord_t to);
+
+    // Calls 'fn' with every handle whose cell overlaps 'pixels'.
+    // Callers must still test the object's actual position.
+    template<typename Fn>
+    void for_each_near(rect_t pixels, Fn const& fn) const
+    {
+        if(m_buckets.dimen().w <= 0 || m_buckets.dimen().h <= 0)
+            return;
+        rect_t const cells = rect_from_2_coords(to_cell(pixels.c), to_cell(pixels.e() - coord_t{ 1, 1 }));
+        for(coord_t c : rect_range(cells))
+            for(object_handle_t handle : m_buckets[c])
+                fn(handle);
+    }
+
+private:
+    coord_t to_cell(coord_t position) const;
+
+    dimen_t m_level_dimen = {};
+    std::size_t m_size = 0;
+    grid_t<std::vector<object_handle_t>> m_buckets;
+};
+
+// Level objects in draw order, also addressable through stable handles.
+// Slots are recycled through a free list, with generations to tell reuses apart.
+class object_list_t
+{
+public:
+    std::size_t size() const { return m_objects.size(); }
+    bool empty() const { return m_objects.empty(); }
+
+    object_t& operator[](std::size_t i) { return m_objects[i]; }
+    object_t const& operator[](std::size_t i) const { return m_objects[i]; }
+    object_t& at(std::size_t i) { return m_objects.at(i); }
+    object_t const& at(std::size_t i) const { return m_objects.at(i); }
+
+    auto begin() { return m_objects.begin(); }
+    auto end() { return m_objects.end(); }
+    auto begin() const { return m_objects.begin(); }
+    auto end() const { return m_objects.end(); }
+
+    object_handle_t handle(std::size_t i) const { return m_handles[i]; }
+    std::vector<object_handle_t> const& handles() const { return m_handles; }
+
+    // Returns -1 for stale handles.
+    int index(object_handle_t handle) const;
+    object_t* get(object_handle_t handle) { int const i = index(handle); return i < 0 ? nullptr : &m_objects[i]; }
+    object_t const* get(object_handle_t handle) const { int const i = index(handle); return i < 0 ? nullptr : &m_objects[i]; }
+    // Throws for stale handles.
+    object_t& at(object_handle_t handle);
+
+    object_handle_t push_back(object_t object);
+    object_t& emplace_back() { push_back({}); return m_objects.back(); }
+    void clear();
+
+    // Removes the objects in a single pass, keeping the rest in order.
+    // Returns what was removed, sorted by index, for 'restore'.
+    std::vector<removed_object_t> erase(std::vector<object_handle_t> const& handles);
+
+    // Puts objects back at their old indices and with their old handles, in a single pass.
+    void restore(std::vector<removed_object_t> const& removed);
+
+private:
+    struct slot_t
+    {
+        std::uint32_t index = 0;
+        std::uint32_t generation = 0;
+        std::uint32_t next_generation = 0;
+        bool live = false;
+        bool in_free = false; // Listed in 'm_free', which then holds each slot at most once.
+    };
+
+    void free_slot(std::uint32_t i);
+
+    std::vector<object_t> m_objects;
+    std::vector<object_handle_t> m_handles; // Parallel to 'm_objects'.
+    std::vector<slot_t> m_slots;
+    std::vector<std::uint32_t> m_free; // Lazily skips slots that 'restore' took back.
+};
+
 
 class level_model_t : public tile_model_t
 {
@@ -431,6 +920,7 @@ public:
     {
         metatile_layer.tiles.resize(dimen);
         metatile_layer.canvas_selector.resize(dimen);
+        reindex_objects();
     }
 
     void clear_metatiles();
@@ -438,9 +928,19 @@ public:
         metatile_model_t const& metatiles, chr_array_t const& chr, 
         std::vector<wxBitmap> const* collision_bitmaps, palette_array_t const& palette);
 
+    // Rebuilds 'object_index' from scratch.
+    // Needed after 'objects' is modified directly.
     void reindex_objects();
 
-    void shift(std::uint8_t from, std::uint8_t to, int amount);
+    // Keeps 'object_index' in sync with 'objects':
+    object_handle_t push_object(object_t object);
+    void move_object(object_handle_t handle, coord_t position);
+    void object_moved(object_handle_t handle, coord_t from);
+    std::vector<removed_object_t> erase_objects(std::vector<object_handle_t> const& handles);
+    void restore_objects(std::vector<removed_object_t> const& removed);
+
+    // Rebuilds the index first if it's gone stale.
+    object_index_t const& object_index();
 
     std::string name = "level";
     std::string macro_name;
@@ -451,8 +951,10 @@ public:
     std::vector<bitmap_t> metatile_bitmaps;
     level_layer_t current_layer = TILE_LAYER;
 
-    std::set<int> object_selector;
-    std::deque<object_t> objects;
+    std::set<object_handle_t> object_selector;
+    object_list_t objects;
+private:
+    object_index_t m_object_index;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -469,6 +971,8 @@ struct model_t
         auto& level = levels.emplace_back(std::make_shared<level_model_t>());
         level->chr_name = "chr";
         level->metatiles_name = "metatiles";
+        index_classes();
+        index_names();
     }
 
     bool modified = false;
@@ -482,9 +986,11 @@ struct model_t
     wxStatusBar* status_bar = nullptr;
 
     std::filesystem::path project_path;
+    std::shared_ptr<journal_t> journal; // Logs edits to recover after a crash. Set up by the frame.
 
     tool_t tool = {};
     std::unique_ptr<tile_copy_t> paste; 
+    unsigned paste_serial = 0; // Bump when 'paste' is replaced, so views can cache what they draw from it.
 
     palette_model_t palette;
     std::deque<std::shared_ptr<metatile_model_t>> metatiles;
@@ -493,25 +999,113 @@ struct model_t
     std::deque<std::shared_ptr<object_class_t>> object_classes;
     object_t object_picker = {};
 
+    // Object class interning:
+    class_id_t class_id(std::string const& name);
+    std::string const& class_name(class_id_t id) const { return class_names.at(id); }
+    // Returns nullptr when no class currently has the ID's name.
+    object_class_t* object_class(class_id_t id) const { return id < class_ptrs.size() ? class_ptrs[id].get() : nullptr; }
+    std::shared_ptr<object_class_t> object_class_ptr(class_id_t id) const { return id < class_ptrs.size() ? class_ptrs[id] : nullptr; }
+    // Looks up a class by name without interning it.
+    object_class_t* find_class(std::string const& name) const
+    {
+        auto it = class_ids.find(name);
+        return it != class_ids.end() ? object_class(it->second) : nullptr;
+    }
+    // Call after 'object_classes' gains, loses, or renames a class.
+    void index_classes();
+    // Gives 'object' the class named 'name', moving its fields from 'layout' to the layout of the name's ID.
+    // An ID without a layout yet takes on 'layout', so that the fields are kept.
+    void set_class(object_t& object, std::string const& name, std::shared_ptr<object_class_t> const& layout);
+    // Forgets every class ID, before reading a project. Levels must hold no objects.
+    // The picker and the paste buffer outlive projects, so their objects are interned again by name,
+    // with their layouts, for index_classes() to move their fields to the new project's classes.
+    void reset_classes();
+    void rename_class(std::string const& old_name, std::string const& new_name);
+
+    std::vector<std::string> class_names = { "" };
+    std::unordered_map<std::string, class_id_t> class_ids = {{ "", 0 }};
+    std::vector<std::shared_ptr<object_class_t>> class_ptrs;
+    // The class each ID's objects have their fields laid out for.
+    // Unlike 'class_ptrs', this outlives deleted classes.
+    class_layouts_t class_layouts;
+    // Moves the fields of an object, recorded while 'layouts' were current, to the current layout.
+    void relayout(object_t& object, class_layouts_t const& layouts) const;
+
+    // Name lookups, through the indices below. Each returns null when nothing has the name.
+    chr_file_t* chr_file(std::string const& name);
+    std::shared_ptr<metatile_model_t> metatile_set(std::string const& name) const;
+    std::shared_ptr<level_model_t> level(std::string const& name) const;
+    // Call after 'chr_files', 'metatiles' or 'levels' gains, loses, or renames an entry.
+    // Until then, names missing from the index aren't found, and stale entries fall back to a linear scan.
+    void index_names();
+
+    // Positions by name. Where names repeat, the first entry wins.
+    std::unordered_map<std::string, std::size_t> chr_index;
+    std::unordered_map<std::string, std::size_t> metatile_index;
+    std::unordered_map<std::string, std::size_t> level_index;
+
+    // Visits every object the model holds: level objects, the picker, and the paste buffer.
+    template<typename Fn>
+    void for_each_object(Fn const& fn)
+    {
+        for(auto& level : levels)
+            for(auto& object : level->objects)
+                fn(object);
+        fn(object_picker);
+        if(paste)
+            if(auto* objects = std::get_if<std::vector<object_t>>(&paste->data))
+                for(auto& object : *objects)
+                    fn(object);
+    }
+
     std::deque<chr_file_t> chr_files;
 
     std::filesystem::path collision_path;
     std::vector<bitmap_t> collision_bitmaps;
     std::vector<wxBitmap> collision_wx_bitmaps;
+    // Replaces both of the above, as loaded by load_collision_file,
+    // and bumps the 'bitmaps_serial' of every model drawn with them.
+    void set_collision_bitmaps(std::pair<std::vector<bitmap_t>, std::vector<wxBitmap>> bitmaps);
 
     palette_array_t palette_array(unsigned palette_index = 0);
 
+    // Tile usage, summed from each layer's incrementally kept tile_layer_t::usage():
+    using usage_t = std::array<unsigned, 256>;
+    std::map<std::string, usage_t> chr_usage() const; // By CHR name, over the metatile sets using it.
+    std::map<std::string, usage_t> metatile_usage() const; // By metatile set name, over the levels using it.
+    usage_t collision_usage() const; // Over every metatile set.
+    // 2x2 metatile blocks by metatile set name, over the levels using it. Levels are counted in parallel.
+    std::map<std::string, mtt_stats_t> mtt_usage() const;
+
+    // Reorders 'metatiles' by 'lut', renumbering the levels using it, and returns the undo record.
+    undo_t permute_metatiles(metatile_model_t& metatiles, tile_lut_t const& lut);
+    // Reorders the tiles of 'file' by 'lut', renumbering the metatile sets using it, and returns the undo record.
+    undo_t permute_chr(chr_file_t& file, tile_lut_t const& lut);
+    // Points the metatile sets using 'file' at the first tile of each group of unflipped chr_duplicates().
+    // Flipped copies stay, as background tiles can't flip.
+    undo_t merge_duplicate_chr(chr_file_t const& file);
+    // metatile_model_t::duplicates() of each set, indexed like 'metatiles'. Sets are searched in parallel.
+    std::vector<metatile_model_t::duplicate_groups_t> duplicate_metatiles() const;
+    // Points the levels using each set at the first metatile of each duplicate group,
+    // then packs the set so the others move past the end and 'num' shrinks. Sets are merged in parallel.
+    undo_t merge_duplicate_metatiles();
+
     // Undo operations:
     undo_t undo(undo_t const& undo) { modify(); return std::visit(*this, undo); }
     undo_t operator()(std::monostate const& m) { return m; }
     undo_t operator()(undo_tiles_t const& undo);
     undo_t operator()(undo_palette_num_t const& undo);
+    undo_t operator()(undo_metatile_num_t const& undo);
     undo_t operator()(undo_level_dimen_t const& undo);
     undo_t operator()(undo_new_object_t const& undo);
     undo_t operator()(undo_delete_object_t const& undo);
     undo_t operator()(undo_edit_object_t const& undo);
     undo_t operator()(undo_move_objects_t const& undo);
-    undo_t operator()(undo_shift_mt_t const& undo);
+    undo_t operator()(undo_level_objects_t const& undo);
+    undo_t operator()(undo_permute_mt_t const& undo);
+    undo_t operator()(undo_permute_chr_t const& undo);
+    undo_t operator()(undo_chr_layers_t const& undo);
+    undo_t operator()(undo_group_t const& undo);
 
     void write_file(FILE* fp, std::filesystem::path base_path) const;
     void read_file(FILE* fp, std::filesystem::path base_path);
@@ -520,22 +1114,77 @@ struct model_t
     void read_json(FILE* fp, std::filesystem::path base_path);
 };
 
+// The approximate memory an undo record holds, in bytes.
+std::size_t undo_bytes(undo_t const& undo);
+
+enum undo_merge_kind_t
+{
+    MERGE_STAMP = 1,
+    MERGE_MOVE_OBJECTS,
+    MERGE_PALETTE_NUM,
+    MERGE_LEVEL_DIMEN,
+};
+
+// Identifies records that may fold into the undo step pushed just before them.
+struct undo_merge_key_t
+{
+    void const* target = nullptr; // What's being edited. Null never merges.
+    int kind = 0;
+    // Set when the earliest record already restores everything later ones would,
+    // so later ones can be dropped rather than kept alongside it.
+    bool snapshot = false;
+
+    explicit operator bool() const { return target; }
+    bool operator==(undo_merge_key_t const&) const = default;
+};
+
 struct undo_history_t
 {
-    std::deque<undo_t> history[2];
+    // Oldest records are culled once a history holds more than this many bytes,
+    // though the front of each stack is always kept, so the last step can be undone or redone.
+    static inline std::size_t budget = DEFAULT_UNDO_BUDGET;
+
+    // Records with equal keys merge while each arrives within this long of the last:
+    static constexpr std::chrono::milliseconds MERGE_WINDOW = std::chrono::milliseconds(1000);
 
     template<undo_type_t U>
     void undo(model_t& model) 
     { 
         if(history[U].empty())
             return;
-        history[!U].push_front(model.undo(history[U].front()));
-        history[U].pop_front();
+        note(history[U].front());
+        undo_t inverse = model.undo(history[U].front());
+        pop_front(U);
+        push_front(undo_type_t(!U), std::move(inverse));
+        m_merge_key = {};
+        cull(undo_type_t(!U));
     }
 
-    void cull(); 
-    void push(undo_t const& undo); 
+    // Drops the oldest records of 'keep', which was just pushed to, then of the other stack,
+    // until within budget or only their fronts are left.
+    void cull(undo_type_t keep); 
+    void push(undo_t undo, undo_merge_key_t key = {}); 
     bool empty(undo_type_t U) const { return history[U].empty(); }
+    void clear();
+    std::size_t bytes() const { return m_bytes[UNDO] + m_bytes[REDO]; }
+
+    // Everything pushed between these becomes a single undo step. They nest.
+    void begin_transaction() { ++m_transaction_depth; }
+    void end_transaction();
+
+    class transaction_t
+    {
+    public:
+        explicit transaction_t(undo_history_t& history) : history(history) { history.begin_transaction(); }
+        ~transaction_t() { history.end_transaction(); }
+        transaction_t(transaction_t const&) = delete;
+        transaction_t& operator=(transaction_t const&) = delete;
+    private:
+        undo_history_t& history;
+    };
+
+    // Mirrors every record pushed or undone, when set:
+    journal_t* journal = nullptr;
 
     template<typename T>
     bool on_top() const
@@ -544,24 +1193,22 @@ struct undo_history_t
             return false;
         return std::holds_alternative<T>(history[UNDO].front());
     }
-};
 
-template<typename C>
-typename C::value_type* lookup_name(std::string const& name, C& c)
-{
-    for(auto& e : c)
-        if(e.name == name)
-            return &e;
-    return nullptr;
-}
+private:
+    std::deque<undo_t> history[2];
+    std::size_t m_bytes[2] = {};
 
-template<typename C>
-typename C::value_type lookup_name_ptr(std::string const& name, C& c)
-{
-    for(auto& e : c)
-        if(e->name == name)
-            return e;
-    return typename C::value_type();
-}
+    // The key of the record on top of 'history[UNDO]', while it can still merge:
+    undo_merge_key_t m_merge_key;
+    std::chrono::steady_clock::time_point m_merge_time;
+
+    int m_transaction_depth = 0;
+    undo_group_t m_transaction;
+
+    void note(undo_t const& undo);
+    void push_front(undo_type_t U, undo_t&& undo);
+    undo_t pop_front(undo_type_t U);
+    void pop_back(undo_type_t U);
+};
 
 #endif
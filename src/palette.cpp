@@ -101,7 +101,7 @@ void palette_canvas_t::draw_tiles(render_t& gc)
 ////////////////////////////////////////////////////////////////////////////////
 
 palette_editor_t::palette_editor_t(wxWindow* parent, model_t& model)
-: editor_t(parent)
+: editor_t(parent, model)
 , model(model)
 {
     dimen_t const nes_colors_dimen = { 4, 16 };
@@ -135,8 +135,7 @@ palette_editor_t::palette_editor_t(wxWindow* parent, model_t& model)
 
 void palette_editor_t::on_change_palette_count(wxSpinEvent& event)
 {
-    if(!history.on_top<undo_palette_num_t>())
-        history.push(undo_palette_num_t{ model.palette.color_layer.num });
+    history.push(undo_palette_num_t{ model.palette.color_layer.num }, { &model.palette, MERGE_PALETTE_NUM, true });
     model.modify();
     model.palette.num = event.GetPosition(); 
     canvas->resize();
@@ -0,0 +1,161 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for splitting up CPU-bound loops, shared by the whole program.
+// Threads are started once, on first use, and sleep between jobs.
+class worker_pool_t
+{
+public:
+    static worker_pool_t& instance()
+    {
+        static worker_pool_t pool(std::max(std::thread::hardware_concurrency(), 1u));
+        return pool;
+    }
+
+    // Starts 'threads - 1' workers. Besides instance(), pools are made by tests wanting a set size.
+    explicit worker_pool_t(unsigned threads)
+    {
+        for(unsigned i = 1; i < threads; ++i)
+            m_workers.emplace_back([this]{ work(); });
+    }
+
+    ~worker_pool_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for(auto& worker : m_workers)
+            worker.join();
+    }
+
+    worker_pool_t(worker_pool_t const&) = delete;
+    worker_pool_t& operator=(worker_pool_t const&) = delete;
+
+    // Including the calling thread, which works alongside the pool.
+    std::size_t size() const { return m_workers.size() + 1; }
+
+    // Calls 'fn(i)' for every i in [0, n), spread across the pool, and returns once all have returned.
+    // Calls may run in any order. The first exception thrown is rethrown here.
+    // Nested calls, made from inside 'fn' on any thread, run serially on the thread making them.
+    void for_each_index(std::size_t n, std::function<void(std::size_t)> const& fn)
+    {
+        if(n <= 1 || m_workers.empty() || in_job())
+        {
+            for(std::size_t i = 0; i < n; ++i)
+                fn(i);
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(m_run_mutex);
+
+        job_t job = { fn, n };
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &job;
+            m_busy = m_workers.size();
+            ++m_generation;
+        }
+        m_cv.notify_all();
+
+        // The calling thread takes indices too, and must not wait on 'm_run_mutex' again if 'fn' nests:
+        in_job() = true;
+        run(job);
+        in_job() = false;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done_cv.wait(lock, [&]{ return m_busy == 0; });
+            m_job = nullptr;
+        }
+
+        if(job.error)
+            std::rethrow_exception(job.error);
+    }
+
+private:
+    struct job_t
+    {
+        std::function<void(std::size_t)> const& fn;
+        std::size_t n;
+        std::atomic<std::size_t> next = 0;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_run_mutex; // Held for a whole job, so callers on different threads take turns.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+    job_t* m_job = nullptr;
+    std::size_t m_busy = 0; // Workers yet to finish the current job.
+    std::uint64_t m_generation = 0; // Bumped per job, so workers can tell a new one apart from a spurious wakeup.
+    bool m_stop = false;
+
+    // Always set on workers, and on a calling thread while it runs indices of a job, on any pool.
+    static bool& in_job()
+    {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    void run(job_t& job)
+    {
+        for(std::size_t i; (i = job.next.fetch_add(1, std::memory_order_relaxed)) < job.n;)
+        {
+            try
+            {
+                job.fn(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if(!job.error)
+                    job.error = std::current_exception();
+            }
+        }
+    }
+
+    void work()
+    {
+        in_job() = true;
+        std::uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while(true)
+        {
+            m_cv.wait(lock, [&]{ return m_stop || m_generation != seen; });
+            if(m_stop)
+                return;
+            seen = m_generation;
+            job_t& job = *m_job;
+
+            lock.unlock();
+            run(job);
+            lock.lock();
+
+            if(--m_busy == 0)
+                m_done_cv.notify_one();
+        }
+    }
+};
+
+// Shorthand for worker_pool_t::for_each_index.
+inline void parallel_for(std::size_t n, std::function<void(std::size_t)> const& fn)
+{
+    worker_pool_t::instance().for_each_index(n, fn);
+}
+
+#endif
@@ -0,0 +1,228 @@
+// Benchmarks for mapfab_bench, on synthetic projects sized like a large game,
+// and on the project given as the first argument (by default the example project).
+// Times are the best of several runs, in milliseconds.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+
+#include "compress.hpp"
+#include "model.hpp"
+#include "parallel.hpp"
+
+template<typename Fn>
+static double best_ms(int runs, Fn const& fn)
+{
+    double best = 0;
+    for(int i = 0; i < runs; ++i)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        fn();
+        double const ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = i ? std::min(best, ms) : ms;
+    }
+    return best;
+}
+
+// Keeps the optimizer from dropping work whose result goes unused.
+template<typename T>
+static void keep(T const& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// 2x2 block usage /////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Select by Usage in 2x2 mode as it was before mtt_stats_t: a std::map per metatile set,
+// bounds-checking each block's cells, then a second pass looking each block up again.
+namespace map_path
+{
+    using mtt_t = std::array<std::uint8_t, 4>;
+
+    mtt_t get_mtt(level_model_t const& level, int x, int y)
+    {
+        std::uint8_t nw = 0, ne = 0, sw = 0, se = 0;
+        auto const& tiles = level.metatile_layer.tiles;
+        nw = tiles[{ x, y }];
+        if(x + 1 < tiles.dimen().w)
+        {
+            ne = tiles[{ x + 1, y }];
+            if(y + 1 < tiles.dimen().h)
+                se = tiles[{ x + 1, y + 1 }];
+        }
+        if(y + 1 < tiles.dimen().h)
+            sw = tiles[{ x, y + 1 }];
+        return {{ nw, ne, sw, se }};
+    }
+
+    std::size_t count_rare(model_t const& model, int usage)
+    {
+        std::map<std::string, std::map<mtt_t, int>> mtt_map;
+        for(auto const& level : model.levels)
+        {
+            auto& map = mtt_map[level->metatiles_name];
+            for(int y = 0; y < level->dimen().h; y += 2)
+            for(int x = 0; x < level->dimen().w; x += 2)
+                map[get_mtt(*level, x, y)] += 1;
+        }
+
+        std::size_t rare = 0;
+        for(auto const& level : model.levels)
+        {
+            auto& map = mtt_map[level->metatiles_name];
+            for(int y = 0; y < level->dimen().h; y += 2)
+            for(int x = 0; x < level->dimen().w; x += 2)
+                rare += map[get_mtt(*level, x, y)] <= usage;
+        }
+        return rare;
+    }
+}
+
+// As Select by Usage finds the blocks to select, short of selecting them.
+static std::size_t count_rare(model_t const& model, int usage)
+{
+    auto const mtt_map = model.mtt_usage();
+    std::vector<std::size_t> rare(model.levels.size());
+    parallel_for(model.levels.size(), [&](std::size_t i)
+    {
+        auto const& stats = mtt_map.at(model.levels[i]->metatiles_name);
+        mtt_stats_t::for_each_block(model.levels[i]->metatile_layer.tiles, [&](coord_t, mtt_stats_t::key_t key)
+        {
+            rare[i] += int(stats.count(key)) <= usage;
+        });
+    });
+
+    std::size_t total = 0;
+    for(std::size_t n : rare)
+        total += n;
+    return total;
+}
+
+// 300 levels of 256x240 across 4 metatile sets, tiled from a few hundred blocks with some noise.
+static void bench_mtt_usage()
+{
+    std::mt19937 rng(41);
+    model_t model;
+    model.levels.clear();
+    for(int i = 0; i < 300; ++i)
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.name = "level" + std::to_string(i);
+        level.metatiles_name = "set" + std::to_string(i % 4);
+        level.resize({ 256, 240 });
+        auto& tiles = level.metatile_layer.tiles;
+        for(int y = 0; y < 240; y += 2)
+        for(int x = 0; x < 256; x += 2)
+        {
+            unsigned const block = rng() % 400;
+            for(int j = 0; j < 4; ++j)
+                tiles[{ x + (j & 1), y + (j >> 1) }] = (block * 7 + j * 13) & 0xFF;
+            if(rng() % 50 == 0)
+                tiles[{ x, y }] = rng();
+        }
+    }
+    model.index_names();
+
+    std::size_t const rare = count_rare(model, 1);
+    if(rare != map_path::count_rare(model, 1))
+        std::printf("MISMATCH: the paths disagree on rare blocks\n");
+
+    std::printf("2x2 block usage, 300 levels of 256x240, %zu distinct blocks in set0, %zu rare:\n",
+                model.mtt_usage().at("set0").unique(), rare);
+    std::printf("  std::map:   %8.1f ms\n", best_ms(5, [&]{ keep(map_path::count_rare(model, 1)); }));
+    std::printf("  mtt_stats:  %8.1f ms\n", best_ms(5, [&]{ keep(count_rare(model, 1)); }));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// level compression ///////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Prints the whole report for a few levels, otherwise just its total.
+static void bench_compress_levels(char const* label, model_t const& model)
+{
+    std::vector<compressed_level_t> levels;
+    double const ms = best_ms(5, [&]{ levels = compress_levels(model); });
+    std::printf("compress_levels, %s: %zu levels in %.2f ms\n", label, levels.size(), ms);
+
+    std::string const report = compression_report(levels);
+    std::size_t const total = report.rfind("Total");
+    std::fputs(levels.size() <= 8 || total == std::string::npos ? report.c_str() : report.c_str() + total, stdout);
+}
+
+static void bench_compress_project(char const* path)
+{
+    FILE* fp = std::fopen(path, "rb");
+    if(!fp)
+    {
+        std::printf("compress_levels: can't open %s, skipping it\n", path);
+        return;
+    }
+
+    model_t model;
+    try
+    {
+        model.read_file(fp, path);
+    }
+    catch(std::exception const& e)
+    {
+        std::printf("compress_levels: can't read %s (%s), skipping it\n", path, e.what());
+        std::fclose(fp);
+        return;
+    }
+    std::fclose(fp);
+
+    bench_compress_levels(path, model);
+}
+
+// 32 levels of 1024x240, a scrolling ground line under open sky, with scattered detail and platforms.
+static void bench_compress_synthetic()
+{
+    std::mt19937 rng(48);
+    model_t model;
+    model.levels.clear();
+    for(int i = 0; i < 32; ++i)
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.name = "level" + std::to_string(i);
+        level.resize({ 1024, 240 });
+        auto& tiles = level.metatile_layer.tiles;
+
+        int ground = 200;
+        for(int x = 0; x < 1024; ++x)
+        {
+            if(rng() % 16 == 0)
+                ground = std::clamp<int>(ground + int(rng() % 33) - 16, 120, 230);
+            for(int y = 0; y < 240; ++y)
+            {
+                std::uint8_t tile = y < ground ? 0 : y == ground ? 1 : 2;
+                if(y >= ground && rng() % 20 == 0)
+                    tile = 3 + rng() % 8;
+                tiles[{ x, y }] = tile;
+            }
+        }
+
+        for(int j = 0; j < 200; ++j)
+        {
+            int const x = rng() % 1000, y = rng() % 200, w = 2 + rng() % 16;
+            for(int k = 0; k < w; ++k)
+                tiles[{ x + k, y }] = 20 + rng() % 4;
+        }
+    }
+
+    bench_compress_levels("32 synthetic levels of 1024x240", model);
+}
+
+int main(int argc, char** argv)
+{
+    std::printf("Worker pool: %zu threads\n\n", worker_pool_t::instance().size());
+    bench_mtt_usage();
+    std::printf("\n");
+    bench_compress_project(argc > 1 ? argv[1] : "examples/project.mapfab");
+    std::printf("\n");
+    bench_compress_synthetic();
+}
@@ -0,0 +1,300 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include "compress.hpp"
+#include "model.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// codecs //////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Noise, a small alphabet, sparse detail on a background, or diagonal stripes.
+static std::vector<std::uint8_t> random_tiles(std::mt19937& rng, dimen_t dimen)
+{
+    std::vector<std::uint8_t> tiles(std::size_t(dimen.w) * dimen.h);
+    unsigned const mode = rng() % 4;
+    for(int y = 0; y < dimen.h; ++y)
+    for(int x = 0; x < dimen.w; ++x)
+    {
+        std::uint8_t& tile = tiles[y * dimen.w + x];
+        switch(mode)
+        {
+        case 0: tile = rng(); break;
+        case 1: tile = rng() % 3; break;
+        case 2: tile = rng() % 8 ? 7 : rng(); break;
+        default: tile = (y * 5 + x / 4) & 0xFF; break;
+        }
+    }
+    return tiles;
+}
+
+TEST(codecs_round_trip)
+{
+    std::mt19937 rng(48);
+    for(int i = 0; i < 1000; ++i)
+    {
+        dimen_t const dimen = { int(1 + rng() % 70), int(1 + rng() % 70) };
+        std::vector<std::uint8_t> const tiles = random_tiles(rng, dimen);
+        for(unsigned c = 0; c < NUM_CODECS; ++c)
+        {
+            codec_t const codec = codec_t(c);
+            std::vector<std::uint8_t> const data = encode_tiles(codec, tiles.data(), dimen);
+            std::size_t cycles = 0;
+            CHECK(decode_tiles(codec, data.data(), data.size(), dimen, &cycles) == tiles);
+            CHECK(cycles > 0);
+            CHECK_THROWS(decode_tiles(codec, data.data(), data.size() - 1, dimen));
+        }
+    }
+}
+
+TEST(codecs_reject_corrupt_data)
+{
+    std::mt19937 rng(148);
+    for(int i = 0; i < 1000; ++i)
+    {
+        dimen_t const dimen = { int(1 + rng() % 40), int(1 + rng() % 40) };
+        std::vector<std::uint8_t> const tiles = random_tiles(rng, dimen);
+        for(unsigned c = 0; c < NUM_CODECS; ++c)
+        {
+            std::vector<std::uint8_t> data = encode_tiles(codec_t(c), tiles.data(), dimen);
+            data[rng() % data.size()] ^= 1 << (rng() % 8);
+            data.resize(data.size() + rng() % 2, rng());
+            // Either throws or decodes to a whole grid, never past it.
+            try
+            {
+                CHECK(decode_tiles(codec_t(c), data.data(), data.size(), dimen).size() == tiles.size());
+            }
+            catch(std::runtime_error const&) {}
+        }
+    }
+}
+
+TEST(codecs_pack_runs)
+{
+    dimen_t const dimen = { 256, 240 };
+    std::vector<std::uint8_t> const tiles(std::size_t(dimen.w) * dimen.h, 3);
+    CHECK(encode_tiles(CODEC_RAW, tiles.data(), dimen).size() == tiles.size());
+    for(codec_t codec : { CODEC_RLE, CODEC_LZ77, CODEC_COLUMN_DELTA })
+        CHECK(encode_tiles(codec, tiles.data(), dimen).size() < tiles.size() / 25);
+}
+
+TEST(compress_level_picks_smallest)
+{
+    std::mt19937 rng(248);
+    for(int i = 0; i < 50; ++i)
+    {
+        level_model_t level;
+        level.resize({ int(1 + rng() % 100), int(1 + rng() % 60) });
+        std::vector<std::uint8_t> const tiles = random_tiles(rng, level.dimen());
+        std::copy(tiles.begin(), tiles.end(), level.metatile_layer.tiles.begin());
+
+        compressed_level_t const out = compress_level(level);
+        CHECK(out.dimen == level.dimen());
+        for(auto const& result : out.results)
+            CHECK(out.results[out.best].size <= result.size);
+        CHECK(out.data == encode_tiles(out.best, tiles.data(), out.dimen));
+        CHECK(decode_tiles(out.best, out.data.data(), out.data.size(), out.dimen) == tiles);
+    }
+
+    // Packets only add to noise, so it stays raw.
+    level_model_t noise;
+    noise.resize({ 64, 64 });
+    for(std::uint8_t& tile : noise.metatile_layer.tiles)
+        tile = rng();
+    CHECK(compress_level(noise).best == CODEC_RAW);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// column streams //////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Levels narrower than, as wide as, and a column past one or several screens.
+static model_t column_model(std::mt19937& rng, int grid_x)
+{
+    model_t model;
+    model.level_grid_x = grid_x;
+    model.levels.clear();
+    for(int w : { 1, 15, 16, 17, 47, 130 })
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.name = "level" + std::to_string(w);
+        level.resize({ w, int(1 + rng() % 40) });
+        std::vector<std::uint8_t> const tiles = random_tiles(rng, level.dimen());
+        std::copy(tiles.begin(), tiles.end(), level.metatile_layer.tiles.begin());
+    }
+    return model;
+}
+
+TEST(column_streams_round_trip)
+{
+    std::mt19937 rng(49);
+    for(int grid_x : { 0, 1, 13, 16 })
+    for(bool rle : { false, true })
+    {
+        model_t const model = column_model(rng, grid_x);
+        std::vector<column_level_t> const columns = encode_column_levels(model, rle);
+        CHECK(columns.size() == model.levels.size());
+        for(std::size_t i = 0; i < columns.size(); ++i)
+        {
+            level_model_t const& level = *model.levels[i];
+            CHECK(columns[i].name == level.name);
+            CHECK(columns[i].bytes[0] == (rle ? COLUMNS_RLE : 0));
+
+            decoded_columns_t const decoded = decode_column_level(columns[i].bytes.data(), columns[i].bytes.size());
+            CHECK(decoded.dimen == level.dimen());
+            CHECK(decoded.screen_width == unsigned(grid_x ? grid_x : 16));
+            CHECK(std::equal(decoded.tiles.begin(), decoded.tiles.end(),
+                             level.metatile_layer.tiles.begin(), level.metatile_layer.tiles.end()));
+        }
+    }
+}
+
+TEST(column_streams_reject_malformed_data)
+{
+    std::mt19937 rng(149);
+    for(bool rle : { false, true })
+    {
+        model_t const model = column_model(rng, 16);
+        for(column_level_t const& level : encode_column_levels(model, rle))
+        {
+            std::vector<std::uint8_t> const& bytes = level.bytes;
+            CHECK_THROWS(decode_column_level(bytes.data(), bytes.size() - 1));
+            CHECK_THROWS(decode_column_level(bytes.data(), 6));
+
+            std::vector<std::uint8_t> bad = bytes;
+            bad[0] |= 0x80;
+            CHECK_THROWS(decode_column_level(bad.data(), bad.size()));
+
+            bad = bytes;
+            bad[5] = bad[6] = 0;
+            CHECK_THROWS(decode_column_level(bad.data(), bad.size()));
+
+            // The last column's offset, pushed a byte past where it starts.
+            unsigned const w = bytes[1] | (bytes[2] << 8);
+            std::size_t const offset = 7 + (w + 15) / 16 * 4 + (w - 1) * 2;
+            bad = bytes;
+            bad[offset] += 1;
+            CHECK_THROWS(decode_column_level(bad.data(), bad.size()));
+        }
+    }
+}
+
+TEST(column_streams_validate)
+{
+    std::mt19937 rng(249);
+    model_t model = column_model(rng, 13);
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "mapfab_test" / "columns";
+    std::filesystem::create_directories(dir);
+
+    write_column_levels(encode_column_levels(model, true), dir);
+    validate_column_levels(model, dir);
+
+    model.levels.back()->metatile_layer.tiles[{ 3, 0 }] ^= 1;
+    CHECK_THROWS(validate_column_levels(model, dir));
+
+    model.level_grid_x = 16;
+    CHECK_THROWS(validate_column_levels(model, dir));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// shared dictionaries /////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+TEST(dictionary_round_trip)
+{
+    std::mt19937 rng(50);
+    for(int i = 0; i < 200; ++i)
+    {
+        dictionary_t dictionary(rng() % 300);
+        for(std::uint8_t& byte : dictionary)
+            byte = rng() % 6;
+        dimen_t const dimen = { int(1 + rng() % 60), int(1 + rng() % 60) };
+        std::vector<std::uint8_t> const tiles = random_tiles(rng, dimen);
+
+        std::vector<std::uint8_t> const data = encode_with_dictionary(dictionary, tiles.data(), tiles.size());
+        CHECK(decode_with_dictionary(dictionary, data.data(), data.size(), tiles.size()) == tiles);
+        CHECK_THROWS(decode_with_dictionary(dictionary, data.data(), data.size() - 1, tiles.size()));
+    }
+}
+
+// Levels sharing a set, either all noise or all built from the same few columns.
+static model_t dictionary_model(std::mt19937& rng, bool noise)
+{
+    model_t model;
+    model.levels.clear();
+    std::vector<std::vector<std::uint8_t>> motifs(8, std::vector<std::uint8_t>(30));
+    for(auto& motif : motifs)
+        for(std::uint8_t& tile : motif)
+            tile = rng();
+
+    for(int i = 0; i < 8; ++i)
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.name = "level" + std::to_string(i);
+        level.metatiles_name = "metatiles";
+        level.resize({ 64, 30 });
+        for(int x = 0; x < 64; ++x)
+        {
+            auto const& motif = motifs[rng() % motifs.size()];
+            for(int y = 0; y < 30; ++y)
+                level.metatile_layer.tiles[{ x, y }] = noise ? rng() : motif[y];
+        }
+    }
+    return model;
+}
+
+static std::size_t per_level_bytes(std::vector<compressed_level_t> const& levels)
+{
+    std::size_t total = 0;
+    for(compressed_level_t const& level : levels)
+        total += 5 + level.data.size();
+    return total;
+}
+
+TEST(shared_dictionaries_fall_back_per_level)
+{
+    std::mt19937 rng(150);
+    for(bool noise : { true, false })
+    {
+        model_t const model = dictionary_model(rng, noise);
+        std::vector<compressed_level_t> const per_level = compress_levels(model);
+        std::vector<shared_dictionary_t> const shared = train_shared_dictionaries(model);
+        CHECK(shared.size() == 1);
+
+        shared_dictionary_t const& set = shared[0];
+        CHECK(set.levels.size() == model.levels.size());
+        CHECK(set.level_bytes() <= per_level_bytes(per_level));
+        if(noise)
+            CHECK(set.dictionary.empty());
+        else
+        {
+            CHECK(!set.dictionary.empty());
+            CHECK(set.dictionary_bytes() + set.level_bytes() < per_level_bytes(per_level));
+        }
+
+        for(auto const& level : set.levels)
+        {
+            level_model_t const& source = *model.levels[level.index];
+            std::vector<std::uint8_t> const tiles(source.metatile_layer.tiles.begin(), source.metatile_layer.tiles.end());
+            if(level.codec == SHARED_CODEC)
+            {
+                // Packets run a column at a time.
+                std::vector<std::uint8_t> const columns = decode_with_dictionary(set.dictionary, level.data.data(),
+                                                                                 level.data.size(), tiles.size());
+                dimen_t const dimen = source.dimen();
+                for(int x = 0; x < dimen.w; ++x)
+                for(int y = 0; y < dimen.h; ++y)
+                    CHECK(columns[x * dimen.h + y] == tiles[y * dimen.w + x]);
+            }
+            else
+            {
+                CHECK(level.codec < NUM_CODECS);
+                CHECK(level.data == per_level[level.index].data);
+                CHECK(decode_tiles(codec_t(level.codec), level.data.data(), level.data.size(), source.dimen()) == tiles);
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#include "test.hpp"
+
+#include <filesystem>
+
+#include "journal.hpp"
+
+// A project path in a scratch directory, with no journal left from an earlier run.
+static std::filesystem::path scratch_project(char const* name)
+{
+    std::filesystem::path const dir = std::filesystem::temp_directory_path() / "mapfab_test";
+    std::filesystem::create_directories(dir);
+    std::filesystem::path const project = dir / name;
+    std::filesystem::remove(journal_t::path_for(project));
+    return project;
+}
+
+static std::vector<std::uint8_t> level_tiles(model_t const& model)
+{
+    auto const& tiles = model.levels.at(0)->metatile_layer.tiles;
+    return std::vector<std::uint8_t>(tiles.begin(), tiles.end());
+}
+
+// Journals a tile edit, then a resize, flushing after each.
+static void journal_edits(model_t& model, std::filesystem::path const& project)
+{
+    level_model_t& level = *model.levels.at(0);
+    journal_t journal(model);
+    journal.open(project);
+
+    rect_t const rect = {{ 2, 3 }, { 4, 2 }};
+    journal.note(undo_tiles_t{ &level.metatile_layer, rect });
+    for(coord_t c : rect_range(rect))
+        level.metatile_layer.tiles[c] = 9;
+    journal.flush();
+
+    journal.note(level.metatile_layer.save());
+    level.resize({ 40, 20 });
+    level.metatile_layer.tiles[{ 39, 19 }] = 5;
+    journal.flush();
+}
+
+TEST(journal_replay)
+{
+    std::filesystem::path const project = scratch_project("replay.mapfab");
+    model_t model;
+    journal_edits(model, project);
+    CHECK(journal_t::needs_recovery(project));
+
+    model_t restored;
+    journal_t::replay_result_t const result = journal_t::replay(restored, project);
+    CHECK(result.applied == 2);
+    CHECK(result.skipped == 0);
+    CHECK(result.last_sequence == 2);
+    CHECK(result.valid_size == std::filesystem::file_size(journal_t::path_for(project)));
+    CHECK(restored.levels.at(0)->dimen() == model.levels.at(0)->dimen());
+    CHECK(level_tiles(restored) == level_tiles(model));
+}
+
+TEST(journal_torn_tail)
+{
+    std::filesystem::path const project = scratch_project("torn.mapfab");
+    model_t model;
+    journal_edits(model, project);
+
+    // As if the crash came mid-write of the resize:
+    std::filesystem::path const path = journal_t::path_for(project);
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 3);
+
+    model_t restored;
+    journal_t::replay_result_t const result = journal_t::replay(restored, project);
+    CHECK(result.applied == 1);
+    CHECK(result.last_sequence == 1);
+    CHECK(result.valid_size < std::filesystem::file_size(path));
+    CHECK(restored.levels.at(0)->dimen() == model_t().levels.at(0)->dimen());
+    CHECK(restored.levels.at(0)->metatile_layer.tiles[{ 2, 3 }] == 9);
+}
+
+TEST(journal_unflushed)
+{
+    std::filesystem::path const project = scratch_project("unflushed.mapfab");
+    model_t model;
+    {
+        journal_t journal(model);
+        journal.open(project);
+        journal.note(undo_tiles_t{ &model.levels.at(0)->metatile_layer, {{ 0, 0 }, { 1, 1 }} });
+        model.levels.at(0)->metatile_layer.tiles[{ 0, 0 }] = 1;
+    } // Destroyed without a flush, so the edit is dropped.
+
+    CHECK(!journal_t::needs_recovery(project));
+    model_t restored;
+    CHECK(journal_t::replay(restored, project).applied == 0);
+}
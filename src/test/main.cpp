@@ -0,0 +1,28 @@
+#include "test.hpp"
+
+#include <exception>
+
+int main()
+{
+    unsigned failed = 0;
+    for(test_t const& test : tests())
+    {
+        unsigned const before = test_failures;
+        try
+        {
+            test.fn();
+        }
+        catch(std::exception const& e)
+        {
+            std::fprintf(stderr, "%s: threw: %s\n", test.name, e.what());
+            ++test_failures;
+        }
+
+        bool const ok = test_failures == before;
+        std::printf("%s %s\n", ok ? "pass" : "FAIL", test.name);
+        failed += !ok;
+    }
+
+    std::printf("%zu tests, %u failed\n", tests().size(), failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,515 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+#include "model.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// tile_runs_t /////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+static std::vector<T> decoded(tile_runs_t const& runs)
+{
+    std::vector<T> values(runs.size());
+    runs.decode(values.data());
+    return values;
+}
+
+TEST(tile_runs_round_trip)
+{
+    std::mt19937 rng(36);
+    for(int i = 0; i < 500; ++i)
+    {
+        // Mixes long runs, short runs and noise, including values past 8 bits.
+        std::vector<std::uint16_t> values(rng() % 2000);
+        for(std::size_t j = 0; j < values.size();)
+        {
+            std::size_t const n = std::min<std::size_t>(values.size() - j, 1 + rng() % (rng() % 4 ? 4 : 300));
+            std::uint16_t const value = rng() % 3 ? rng() % 4 : rng();
+            for(std::size_t k = 0; k < n; ++k)
+                values[j++] = (n < 3 && rng() % 2) ? std::uint16_t(rng()) : value;
+        }
+
+        tile_runs_t const runs(values);
+        CHECK(runs.size() == values.size());
+        CHECK(runs.valid());
+        CHECK(decoded<std::uint16_t>(runs) == values);
+    }
+}
+
+TEST(tile_runs_bytes)
+{
+    std::vector<std::uint8_t> const values(256 * 240, 7);
+    tile_runs_t const runs(values);
+    CHECK(decoded<std::uint8_t>(runs) == values);
+    // Two words per packet of up to 0x7FFF values.
+    CHECK(runs.packets().size() == 4);
+
+    CHECK(tile_runs_t(std::vector<std::uint8_t>()).packets().empty());
+}
+
+TEST(tile_runs_valid)
+{
+    std::vector<std::uint16_t> const values = { 1, 2, 3, 3, 3, 3, 4 };
+    std::vector<std::uint16_t> packets = tile_runs_t(values).packets();
+
+    CHECK(tile_runs_t(values.size(), packets).valid());
+    CHECK(!tile_runs_t(values.size() + 1, packets).valid());
+    packets.pop_back();
+    CHECK(!tile_runs_t(values.size(), packets).valid());
+    CHECK(!tile_runs_t(1, { tile_runs_t::RUN | 1 }).valid());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// mtt_stats_t /////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Counts blocks cell by cell, reading cells off the edge as 0.
+static std::map<mtt_stats_t::key_t, unsigned> count_blocks(chunk_grid_t<std::uint8_t> const& tiles)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t { return in_bounds(coord_t{ x, y }, tiles.dimen()) ? tiles[{ x, y }] : 0; };
+    std::map<mtt_stats_t::key_t, unsigned> counts;
+    for(int y = 0; y < tiles.dimen().h; y += 2)
+    for(int x = 0; x < tiles.dimen().w; x += 2)
+        counts[mtt_stats_t::pack(at(x, y), at(x + 1, y), at(x, y + 1), at(x + 1, y + 1))] += 1;
+    return counts;
+}
+
+static void check_stats(mtt_stats_t const& stats, std::map<mtt_stats_t::key_t, unsigned> const& expected)
+{
+    unsigned total = 0;
+    for(auto const& [key, count] : expected)
+    {
+        CHECK(stats.count(key) == count);
+        total += count;
+    }
+    CHECK(stats.unique() == expected.size());
+    CHECK(stats.total() == total);
+
+    std::size_t visited = 0;
+    stats.for_each([&](mtt_stats_t::key_t key, unsigned count)
+    {
+        auto it = expected.find(key);
+        CHECK(it != expected.end());
+        CHECK(it != expected.end() && it->second == count);
+        ++visited;
+    });
+    CHECK(visited == expected.size());
+}
+
+TEST(mtt_stats_matches_cell_counts)
+{
+    std::mt19937 rng(41);
+    mtt_stats_t merged;
+    std::map<mtt_stats_t::key_t, unsigned> merged_expected;
+    for(int i = 0; i < 100; ++i)
+    {
+        // Odd sizes hang blocks off the edges, and a small alphabet repeats blocks, key 0 included.
+        chunk_grid_t<std::uint8_t> tiles({ int(1 + rng() % 70), int(1 + rng() % 70) });
+        unsigned const alphabet = 1 + rng() % 6;
+        for(std::uint8_t& tile : tiles)
+            tile = rng() % alphabet;
+
+        mtt_stats_t const stats(tiles);
+        auto const expected = count_blocks(tiles);
+        check_stats(stats, expected);
+
+        merged.merge(stats);
+        for(auto const& [key, count] : expected)
+            merged_expected[key] += count;
+    }
+    check_stats(merged, merged_expected);
+    CHECK(mtt_stats_t().count(0) == 0);
+}
+
+TEST(mtt_usage_by_metatile_set)
+{
+    model_t model;
+    model.levels.clear();
+    for(int i = 0; i < 6; ++i)
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.metatiles_name = i % 2 ? "odd" : "even";
+        level.resize({ 5 + i, 3 + i });
+        for(std::uint8_t& tile : level.metatile_layer.tiles)
+            tile = i;
+    }
+
+    auto const usage = model.mtt_usage();
+    CHECK(usage.size() == 2);
+    std::map<mtt_stats_t::key_t, unsigned> even;
+    for(int i = 0; i < 6; i += 2)
+        for(auto const& [key, count] : count_blocks(model.levels[i]->metatile_layer.tiles))
+            even[key] += count;
+    check_stats(usage.at("even"), even);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tile_lut_t //////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static bool is_permutation(tile_lut_t const& lut)
+{
+    std::array<bool, 256> seen = {};
+    for(std::uint8_t to : lut)
+        if(std::exchange(seen[to], true))
+            return false;
+    return true;
+}
+
+TEST(shift_lut)
+{
+    // Rotating [10, 15) right by 2: 10..14 go to 12, 13, 14, 10, 11.
+    tile_lut_t const lut = shift_lut(10, 15, 2);
+    CHECK(is_permutation(lut));
+    CHECK(lut[10] == 12 && lut[12] == 14 && lut[13] == 10 && lut[14] == 11);
+    CHECK(lut[9] == 9 && lut[15] == 15);
+
+    // Negative amounts rotate left, and whole turns change nothing.
+    CHECK(shift_lut(10, 15, -1) == invert_lut(shift_lut(10, 15, 1)));
+    CHECK(shift_lut(10, 15, 5) == identity_lut());
+    CHECK(shift_lut(10, 15, -7) == shift_lut(10, 15, 3));
+
+    // Ranges wrap past 255.
+    tile_lut_t const wrapped = shift_lut(254, 2, 1);
+    CHECK(is_permutation(wrapped));
+    CHECK(wrapped[254] == 255 && wrapped[255] == 0 && wrapped[0] == 1 && wrapped[1] == 254);
+    CHECK(wrapped[2] == 2);
+}
+
+TEST(sort_lut)
+{
+    std::array<unsigned, 256> usage = {};
+    usage[3] = 5;
+    usage[1] = 9;
+    usage[4] = 5;
+    usage[200] = 100; // Past 'num', so it stays put.
+
+    tile_lut_t const lut = sort_lut(usage, 6);
+    CHECK(is_permutation(lut));
+    // Descending usage, ties in their old order, then the unused in their old order.
+    CHECK(lut[1] == 0 && lut[3] == 1 && lut[4] == 2);
+    CHECK(lut[0] == 3 && lut[2] == 4 && lut[5] == 5);
+    for(unsigned i = 6; i < 256; ++i)
+        CHECK(lut[i] == i);
+
+    CHECK(sort_lut({}, 256) == identity_lut());
+}
+
+TEST(permute_luts_compose)
+{
+    std::mt19937 rng(43);
+    for(int i = 0; i < 100; ++i)
+    {
+        tile_lut_t const lut = shift_lut(rng(), rng(), int(rng() % 600) - 300);
+        CHECK(is_permutation(lut));
+        tile_lut_t const inverse = invert_lut(lut);
+        for(unsigned j = 0; j < 256; ++j)
+            CHECK(inverse[lut[j]] == j);
+    }
+    CHECK(is_permutation(swap_lut(7, 200)) && swap_lut(7, 200)[7] == 200);
+}
+
+TEST(permute_metatiles_remaps_levels)
+{
+    model_t model;
+    metatile_model_t& metatiles = *model.metatiles.at(0);
+    level_model_t& level = *model.levels.at(0);
+    level.metatiles_name = metatiles.name;
+    for(unsigned i = 0; i < 256; ++i)
+        metatiles.collision_layer.tiles[{ int(i % 16), int(i / 16) }] = i % 7;
+    std::uint8_t next = 0;
+    for(std::uint8_t& tile : level.metatile_layer.tiles)
+        tile = next++ * 3;
+
+    auto const snapshot = [&]
+    {
+        std::vector<std::uint16_t> state(level.metatile_layer.tiles.begin(), level.metatile_layer.tiles.end());
+        state.insert(state.end(), metatiles.collision_layer.tiles.begin(), metatiles.collision_layer.tiles.end());
+        return state;
+    };
+    auto const before = snapshot();
+    auto const level_before = std::vector<std::uint8_t>(level.metatile_layer.tiles.begin(), level.metatile_layer.tiles.end());
+
+    tile_lut_t const lut = shift_lut(4, 40, 5);
+    undo_t const undo = model.permute_metatiles(metatiles, lut);
+
+    // Each cell still shows the same metatile, under its new number.
+    std::size_t i = 0;
+    for(std::uint8_t tile : level.metatile_layer.tiles)
+    {
+        std::uint8_t const old = level_before[i++];
+        CHECK(tile == lut[old]);
+        CHECK(metatiles.collision_layer.tiles[{ tile % 16, tile / 16 }] == old % 7);
+    }
+
+    undo_t const redo = model.undo(undo);
+    CHECK(snapshot() == before);
+    model.undo(redo);
+    CHECK(level.metatile_layer.tiles[{ 0, 0 }] == lut[level_before[0]]);
+}
+
+TEST(compact_lut)
+{
+    std::array<unsigned, 256> usage = {};
+    usage[5] = 1;
+    usage[2] = 8;
+    usage[255] = 3;
+
+    // The used move to the front and the unused follow, both in their old order.
+    tile_lut_t const lut = compact_lut(usage);
+    CHECK(is_permutation(lut));
+    CHECK(lut[2] == 0 && lut[5] == 1 && lut[255] == 2);
+    CHECK(lut[0] == 3 && lut[1] == 4 && lut[3] == 5 && lut[254] == 255);
+
+    CHECK(compact_lut({}) == identity_lut());
+    usage.fill(1);
+    CHECK(compact_lut(usage) == identity_lut());
+}
+
+TEST(permute_chr_remaps_metatiles)
+{
+    model_t model;
+    chr_file_t& file = model.chr_files.at(0);
+    metatile_model_t& metatiles = *model.metatiles.at(0);
+    CHECK(model.chr_file(metatiles.chr_name) == &file);
+
+    for(unsigned i = 0; i < file.chr.size(); ++i)
+        file.chr[i] = i / 16;
+    metatiles.chr_layer.set({ 0, 0 }, 9);
+    metatiles.chr_layer.set({ 1, 0 }, 40);
+    metatiles.chr_layer.set({ 0, 1 }, 9);
+
+    tile_lut_t const lut = compact_lut(model.chr_usage().at(file.name));
+    undo_t const undo = model.permute_chr(file, lut);
+
+    // Used tiles are packed at the front, with the data moving along with the references.
+    CHECK(metatiles.chr_layer.tiles[{ 0, 0 }] == 1);
+    CHECK(metatiles.chr_layer.tiles[{ 1, 0 }] == 2);
+    CHECK(metatiles.chr_layer.tiles[{ 1, 1 }] == 0);
+    CHECK(file.chr[1 * 16] == 9 && file.chr[2 * 16] == 40 && file.chr[0] == 0);
+    CHECK(file.modified());
+    CHECK(model.chr_usage().at(file.name)[1] == 2);
+
+    // With no file behind it, there's nothing to rewrite.
+    CHECK(!file.on_disk());
+    CHECK_THROWS(file.save());
+
+    model.undo(undo);
+    CHECK(metatiles.chr_layer.tiles[{ 1, 0 }] == 40);
+    CHECK(file.chr[40 * 16] == 40);
+    CHECK(!file.modified());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// duplicate metatiles /////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Metatile i's four CHR cells, with their attributes, then its collision.
+static std::array<std::uint16_t, 5> metatile_content(metatile_model_t const& metatiles, unsigned i)
+{
+    int const x = (i % 16) * 2;
+    int const y = (i / 16) * 2;
+    return {{ metatiles.chr_layer.get({ x, y }), metatiles.chr_layer.get({ x + 1, y }),
+              metatiles.chr_layer.get({ x, y + 1 }), metatiles.chr_layer.get({ x + 1, y + 1 }),
+              metatiles.collision_layer.get({ int(i % 16), int(i / 16) }) }};
+}
+
+TEST(merge_duplicate_metatiles_across_sets)
+{
+    // Several sets, so merging runs a set per index with a nested parallel_for inside,
+    // which is what deadlocked on multicore machines.
+    std::mt19937 rng(45);
+    model_t model;
+    model.metatiles.clear();
+    model.levels.clear();
+    for(int s = 0; s < 4; ++s)
+    {
+        auto& metatiles = *model.metatiles.emplace_back(std::make_shared<metatile_model_t>());
+        metatiles.name = "set" + std::to_string(s);
+        metatiles.num = 100 + s * 50;
+        for(unsigned i = 0; i < 256; ++i)
+        {
+            // Every third metatile copies an earlier one.
+            unsigned const from = (i > 5 && rng() % 3 == 0) ? rng() % i : i;
+            auto const content = metatile_content(metatiles, from);
+            for(int k = 0; k < 4; ++k)
+            {
+                coord_t const c = { int(i % 16) * 2 + k % 2, int(i / 16) * 2 + k / 2 };
+                metatiles.chr_layer.set(c, from == i ? (rng() & 0xFF) | (rng() % 4) << 8 : content[k]);
+            }
+            metatiles.collision_layer.set({ int(i % 16), int(i / 16) }, from == i ? rng() % 3 : content[4]);
+        }
+    }
+    for(int i = 0; i < 12; ++i)
+    {
+        auto& level = *model.levels.emplace_back(std::make_shared<level_model_t>());
+        level.name = "level" + std::to_string(i);
+        level.metatiles_name = "set" + std::to_string(i % 4);
+        level.resize({ 40, 30 });
+        for(std::uint8_t& tile : level.metatile_layer.tiles)
+            tile = rng() % model.metatiles[i % 4]->num;
+    }
+    model.index_names();
+
+    auto const cells = [&]
+    {
+        std::vector<std::array<std::uint16_t, 5>> ret;
+        for(auto const& level : model.levels)
+            for(std::uint8_t tile : level->metatile_layer.tiles)
+                ret.push_back(metatile_content(*model.metatile_set(level->metatiles_name), tile));
+        return ret;
+    };
+
+    std::vector<unsigned> expected_num;
+    for(auto const& metatiles : model.metatiles)
+    {
+        unsigned distinct = 0;
+        for(unsigned i = 0; i < metatiles->num; ++i)
+        {
+            bool repeat = false;
+            for(unsigned j = 0; j < i && !repeat; ++j)
+                repeat = metatile_content(*metatiles, i) == metatile_content(*metatiles, j);
+            distinct += !repeat;
+        }
+        expected_num.push_back(distinct);
+    }
+
+    auto const before = cells();
+    undo_t const undo = model.merge_duplicate_metatiles();
+
+    for(std::size_t s = 0; s < model.metatiles.size(); ++s)
+    {
+        CHECK(model.metatiles[s]->num == expected_num[s]);
+        CHECK(model.metatiles[s]->duplicates().empty());
+    }
+    CHECK(cells() == before); // Every cell shows what it did.
+    CHECK(std::holds_alternative<std::monostate>(model.merge_duplicate_metatiles()));
+
+    undo_t const redo = model.undo(undo);
+    CHECK(model.metatiles[1]->num == 150);
+    CHECK(cells() == before);
+    model.undo(redo);
+    CHECK(model.metatiles[1]->num == expected_num[1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// chr_duplicates //////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+using chr_tile_t = std::array<std::uint8_t, 16>;
+
+// Flips the slow way: pixel by pixel, through both planes.
+static chr_tile_t flip_tile(chr_tile_t const& tile, std::uint8_t flip)
+{
+    chr_tile_t ret = {};
+    for(int plane = 0; plane < 2; ++plane)
+    for(int y = 0; y < 8; ++y)
+    for(int x = 0; x < 8; ++x)
+    {
+        int const from_x = (flip & CHR_FLIP_H) ? 7 - x : x;
+        int const from_y = (flip & CHR_FLIP_V) ? 7 - y : y;
+        if(tile[plane * 8 + from_y] & (0x80 >> from_x))
+            ret[plane * 8 + y] |= 0x80 >> x;
+    }
+    return ret;
+}
+
+static chr_tile_t chr_tile(std::vector<std::uint8_t> const& chr, unsigned i)
+{
+    chr_tile_t tile;
+    std::copy_n(chr.data() + i * 16, 16, tile.data());
+    return tile;
+}
+
+static void check_chr_duplicates(std::vector<std::uint8_t> const& chr)
+{
+    unsigned const tiles = chr.size() / 16;
+    auto const groups = chr_duplicates(chr.data(), chr.size());
+
+    std::vector<int> group_of(tiles, -1);
+    for(std::size_t g = 0; g < groups.size(); ++g)
+    {
+        auto const& group = groups[g];
+        CHECK(group.size() >= 2);
+        CHECK(group.at(0).flip == 0);
+        for(std::size_t i = 0; i < group.size(); ++i)
+        {
+            CHECK(i == 0 || group[i - 1].tile < group[i].tile);
+            CHECK(flip_tile(chr_tile(chr, group[0].tile), group[i].flip) == chr_tile(chr, group[i].tile));
+            CHECK(group_of.at(group[i].tile) == -1);
+            group_of.at(group[i].tile) = g;
+        }
+    }
+
+    // Tiles matching under some flip are grouped together, and only those.
+    for(unsigned i = 0; i < tiles; ++i)
+    for(unsigned j = 0; j < i; ++j)
+    {
+        bool match = false;
+        for(int flip = 0; flip < 4; ++flip)
+            match |= flip_tile(chr_tile(chr, j), flip << 6) == chr_tile(chr, i);
+        CHECK(match == (group_of[i] >= 0 && group_of[i] == group_of[j]));
+    }
+}
+
+TEST(chr_duplicates_flips)
+{
+    std::mt19937 rng(46);
+    chr_tile_t base;
+    for(std::uint8_t& byte : base)
+        byte = rng();
+
+    std::vector<std::uint8_t> chr(16 * 8);
+    auto const put = [&](unsigned i, chr_tile_t const& tile) { std::copy(tile.begin(), tile.end(), chr.begin() + i * 16); };
+    put(1, flip_tile(base, CHR_FLIP_H));
+    put(2, base);
+    put(4, flip_tile(base, CHR_FLIP_H | CHR_FLIP_V));
+    put(5, flip_tile(base, CHR_FLIP_V));
+    put(7, base);
+    // Tiles 0, 3 and 6 are blank, so they match each other under every flip.
+
+    // Groups come in no particular order.
+    auto groups = chr_duplicates(chr.data(), chr.size());
+    std::sort(groups.begin(), groups.end(), [](auto const& a, auto const& b) { return a.at(0).tile < b.at(0).tile; });
+    CHECK(groups.size() == 2);
+    if(groups.size() == 2)
+    {
+        CHECK(groups[0].size() == 3 && groups[0][0].tile == 0 && groups[0][1].flip == 0);
+        // Grouped under the lowest tile, tile 1, which is itself the H-flip of 'base'.
+        CHECK(groups[1].size() == 5 && groups[1][0].tile == 1);
+        CHECK(groups[1][1].tile == 2 && groups[1][1].flip == CHR_FLIP_H);
+        CHECK(groups[1][2].tile == 4 && groups[1][2].flip == CHR_FLIP_V);
+        CHECK(groups[1][3].tile == 5 && groups[1][3].flip == (CHR_FLIP_H | CHR_FLIP_V));
+        CHECK(groups[1][4].tile == 7 && groups[1][4].flip == CHR_FLIP_H);
+    }
+    check_chr_duplicates(chr);
+}
+
+TEST(chr_duplicates_random_banks)
+{
+    // Two banks built from a few base tiles, flipped at random, among unique noise.
+    std::mt19937 rng(146);
+    std::vector<chr_tile_t> bases(20);
+    for(chr_tile_t& base : bases)
+        for(std::uint8_t& byte : base)
+            byte = rng() % 4 ? rng() : 0;
+
+    std::vector<std::uint8_t> chr(16 * 512);
+    for(unsigned i = 0; i < 512; ++i)
+    {
+        chr_tile_t tile;
+        if(rng() % 2)
+            tile = flip_tile(bases[rng() % bases.size()], (rng() % 4) << 6);
+        else
+            for(std::uint8_t& byte : tile)
+                byte = rng();
+        std::copy(tile.begin(), tile.end(), chr.begin() + i * 16);
+    }
+    check_chr_duplicates(chr);
+
+    CHECK(chr_duplicates(chr.data(), 0).empty());
+}
@@ -0,0 +1,49 @@
+#include "test.hpp"
+
+#include <stdexcept>
+
+#include "parallel.hpp"
+
+// Sized explicitly, so these run with several threads on any machine.
+static worker_pool_t& test_pool()
+{
+    static worker_pool_t pool(4);
+    return pool;
+}
+
+TEST(pool_calls_each_index_once)
+{
+    std::vector<std::atomic<unsigned>> calls(10000);
+    test_pool().for_each_index(calls.size(), [&](std::size_t i) { calls[i] += 1; });
+    for(auto const& count : calls)
+        CHECK(count == 1);
+}
+
+TEST(pool_nested_calls)
+{
+    // Nested calls from every thread of a job, the calling thread included, on the same pool and on another.
+    for(int round = 0; round < 50; ++round)
+    {
+        std::atomic<std::size_t> sum = 0;
+        test_pool().for_each_index(64, [&](std::size_t i)
+        {
+            test_pool().for_each_index(8, [&](std::size_t j) { sum += i * 8 + j; });
+            parallel_for(2, [&](std::size_t) { sum += 0; });
+        });
+        CHECK(sum == 512 * 511 / 2);
+    }
+}
+
+TEST(pool_rethrows)
+{
+    CHECK_THROWS(test_pool().for_each_index(100, [](std::size_t i)
+    {
+        if(i == 37)
+            throw std::runtime_error("index 37");
+    }));
+
+    // The pool carries on after a throw.
+    std::atomic<unsigned> calls = 0;
+    test_pool().for_each_index(100, [&](std::size_t) { calls += 1; });
+    CHECK(calls == 100);
+}
@@ -0,0 +1,57 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+#include <cstdio>
+#include <vector>
+
+// A minimal test registry for mapfab_test, which exercises the model without any windows.
+// CHECK stays on in release builds, unlike assert.
+
+struct test_t
+{
+    char const* name;
+    void (*fn)();
+};
+
+inline std::vector<test_t>& tests()
+{
+    static std::vector<test_t> list;
+    return list;
+}
+
+inline unsigned test_failures = 0;
+
+struct register_test_t
+{
+    register_test_t(char const* name, void (*fn)()) { tests().push_back({ name, fn }); }
+};
+
+#define TEST(name) \
+    static void test_##name(); \
+    static register_test_t const register_##name(#name, test_##name); \
+    static void test_##name()
+
+// Variadic, so conditions may hold unbracketed commas.
+#define CHECK(...) \
+    do { \
+        if(!(__VA_ARGS__)) \
+        { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__); \
+            ++test_failures; \
+        } \
+    } while(0)
+
+// Checks that 'expr' throws std::runtime_error.
+#define CHECK_THROWS(expr) \
+    do { \
+        bool threw = false; \
+        try { (void)(expr); } \
+        catch(std::runtime_error const&) { threw = true; } \
+        if(!threw) \
+        { \
+            std::fprintf(stderr, "%s:%d: CHECK_THROWS(%s) didn't throw\n", __FILE__, __LINE__, #expr); \
+            ++test_failures; \
+        } \
+    } while(0)
+
+#endif